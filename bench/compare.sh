@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# compare.sh -- compare two outputs of bench/run.sh.
+#
+# usage: bench/compare.sh [-t percent] base.json new.json
+#
+# Prints throughput and p95 latency of each (size, workload) and marks
+# changes worse than the threshold (default: 5%) as REGRESSION. Exits with
+# status 1 if any regression is found.
+#
+THRESHOLD=5
+
+while getopts t: opt; do
+	case $opt in
+	t) THRESHOLD=$OPTARG ;;
+	*) sed -n '3,9p' "$0" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -ne 2 ]; then
+	sed -n '3,9p' "$0" >&2
+	exit 2
+fi
+
+awk -v threshold="$THRESHOLD" '
+# value of "key": in a line written by run.sh
+function field(line, key,    s) {
+	s = line
+	if (!sub(".*\"" key "\": *\"?", "", s))
+		return ""
+	sub("[\",}].*", "", s)
+	return s
+}
+function change(base, new) {
+	return (base > 0 ? (new - base) * 100.0 / base : 0)
+}
+FNR == 1 { file++ }
+{
+	k = field($0, "size") " " field($0, "workload")
+	if (file == 1) {
+		base_tps[k] = field($0, "tps")
+		base_p95[k] = field($0, "p95_ms")
+	} else {
+		keys[++n] = k
+		new_tps[k] = field($0, "tps")
+		new_p95[k] = field($0, "p95_ms")
+	}
+}
+END {
+	printf "%-8s %-14s %12s %8s %12s %8s\n", "size", "workload", "tps", "%", "p95_ms", "%"
+	for (i = 1; i <= n; i++) {
+		k = keys[i]
+		if (!(k in base_tps))
+			continue
+		dt = change(base_tps[k], new_tps[k])
+		dl = change(base_p95[k], new_p95[k])
+		split(k, a, " ")
+		mark = ""
+		if (dt < -threshold || dl > threshold) {
+			mark = "  REGRESSION"
+			regressions++
+		}
+		printf "%-8s %-14s %12.1f %+7.1f%% %12.3f %+7.1f%%%s\n",
+			a[1], a[2], new_tps[k], dt, new_p95[k], dl, mark
+	}
+	exit (regressions > 0)
+}' "$1" "$2"
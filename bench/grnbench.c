@@ -0,0 +1,547 @@
+/*
+ * IDENTIFICATION
+ *	  bench/grnbench.c
+ *
+ * Standalone microbenchmark of the groonga hot paths of textsearch_groonga.
+ * It builds the same table/column/index layout as GrnCreate without
+ * a PostgreSQL server, and reports ns/op of each loop:
+ *
+ *   insert      grn_table_add and grn_obj_set_value as GrnInsert
+ *   escape      query escaping as appendStringEscaped
+ *   command     select command as GrnBeginScan, send and recv
+ *   parse       result parser as GrnBeginScan, per hit
+ *   query_scan  grn_query_scan as contains_internal
+ *   vacuum      cursor walk of groonga_bulkdelete, deleting every 10th row
+ *   delete      grn_table_delete as GrnDelete
+ *
+ * usage: grnbench [-n rows] [-q queries] [-d dir] [-r hash|pat]
+ *
+ * -r selects the layout of the ctid-keyed table as the rowkey option.
+ * Without -d, files are created in a temporary directory removed at exit.
+ *
+ * Documents are generated with the same hash as bench/setup.sql.
+ */
+#include <groonga.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define GrnTableName		"t1"
+#define GrnIndexName		"i1"
+#define GrnColumnName		"body"
+#define GrnIndexColumnName	"ref"
+#define GrnVocabulary		10000
+
+static const char *syllables[] =
+{
+	"ba", "ko", "ri", "te", "mu", "sa", "no", "gi", "pe", "lu",
+	"da", "vo", "ki", "ne", "ru", "fa", "to", "mi", "ze", "hu"
+};
+#define NumSyllables	(sizeof(syllables) / sizeof(syllables[0]))
+
+typedef struct Buffer
+{
+	char	   *data;
+	size_t		len;
+	size_t		maxlen;
+} Buffer;
+
+static void usage(void);
+static void check(grn_ctx *ctx, grn_rc rc, const char *what);
+static double now_ns(void);
+static void report(const char *name, double elapsed, long nops);
+static unsigned long mix(unsigned long x);
+static double random_of(long a, long b);
+static int zipf(double u);
+static void spell(Buffer *buf, int rank);
+static void document(Buffer *buf, long id);
+static void buffer_append(Buffer *buf, const char *str, size_t len);
+static void buffer_append_string(Buffer *buf, const char *str);
+static void buffer_append_char(Buffer *buf, char c);
+static void append_escaped(Buffer *buf, const char *str, size_t len);
+static grn_obj *create_table(grn_ctx *ctx, const char *name, const char *path, grn_obj_flags flags, grn_obj *type);
+static grn_obj *create_column(grn_ctx *ctx, grn_obj *table, const char *name, const char *path, grn_obj_flags flags, grn_obj *type);
+static long command(grn_ctx *ctx, const char *query, Buffer *res);
+static long parse(char *res);
+
+int
+main(int argc, char *argv[])
+{
+	grn_ctx		ctx;
+	grn_obj	   *db;
+	grn_obj	   *table;
+	grn_obj	   *column;
+	grn_obj	   *keys;
+	grn_obj	   *index;
+	grn_obj		column_ids;
+	grn_obj		value;
+	char		dir[1024] = "";
+	int			tempdir = 0;	/* remove dir at exit */
+	char		path[1024];
+	long		nrows = 100000;
+	grn_obj_flags rowkey = GRN_OBJ_TABLE_HASH_KEY;
+	long		nqueries = 1000;
+	long		i;
+	long		nhits;
+	long		nbytes;
+	double		start;
+	double		elapsed;
+	Buffer		buf = { NULL, 0, 0 };
+	Buffer		res = { NULL, 0, 0 };
+	Buffer		word = { NULL, 0, 0 };
+	int			c;
+
+	while ((c = getopt(argc, argv, "n:q:d:r:")) != -1)
+	{
+		switch (c)
+		{
+		case 'n':
+			nrows = atol(optarg);
+			break;
+		case 'q':
+			nqueries = atol(optarg);
+			break;
+		case 'd':
+			snprintf(dir, sizeof(dir), "%s", optarg);
+			break;
+		case 'r':
+			if (strcmp(optarg, "hash") == 0)
+				rowkey = GRN_OBJ_TABLE_HASH_KEY;
+			else if (strcmp(optarg, "pat") == 0)
+				rowkey = GRN_OBJ_TABLE_PAT_KEY;
+			else
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (nrows <= 0 || nqueries <= 0)
+		usage();
+
+	if (dir[0] == '\0')
+	{
+		snprintf(dir, sizeof(dir), "%s/grnbench.XXXXXX",
+				 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+		if (mkdtemp(dir) == NULL)
+		{
+			perror(dir);
+			return 1;
+		}
+		tempdir = 1;
+	}
+
+	/* ctx is not initialized yet, so check() cannot report the error */
+	if (grn_init() != GRN_SUCCESS)
+	{
+		fprintf(stderr, "grn_init failed\n");
+		if (tempdir)
+			rmdir(dir);
+		return 1;
+	}
+	check(&ctx, grn_ctx_init(&ctx, GRN_CTX_USE_QL | GRN_CTX_BATCH_MODE), "grn_ctx_init");
+	GRN_CTX_SET_ENCODING(&ctx, GRN_ENC_UTF8);
+
+	snprintf(path, sizeof(path), "%s/grn", dir);
+	if ((db = grn_db_create(&ctx, path, NULL)) == NULL)
+		check(&ctx, ctx.rc, "grn_db_create");
+
+	/* same layout as GrnCreate */
+	snprintf(path, sizeof(path), "%s/1.grn", dir);
+	table = create_table(&ctx, GrnTableName, path,
+				rowkey, grn_ctx_at(&ctx, GRN_DB_INT64));
+	snprintf(path, sizeof(path), "%s/1.grn.1", dir);
+	column = create_column(&ctx, table, GrnColumnName, path,
+				GRN_OBJ_COLUMN_SCALAR, grn_ctx_at(&ctx, GRN_DB_LONG_TEXT));
+
+	snprintf(path, sizeof(path), "%s/1.grn.i", dir);
+	keys = create_table(&ctx, GrnIndexName, path,
+				GRN_OBJ_TABLE_PAT_KEY | GRN_OBJ_KEY_NORMALIZE,
+				grn_ctx_at(&ctx, GRN_DB_SHORT_TEXT));
+	grn_obj_set_info(&ctx, keys, GRN_INFO_DEFAULT_TOKENIZER,
+		grn_ctx_at(&ctx, GRN_DB_BIGRAM));
+	snprintf(path, sizeof(path), "%s/1.grn.r", dir);
+	index = create_column(&ctx, keys, GrnIndexColumnName, path,
+				GRN_OBJ_COLUMN_INDEX | GRN_OBJ_WITH_POSITION | GRN_OBJ_WITH_SECTION,
+				table);
+	GRN_UINT32_INIT(&column_ids, 0);
+	GRN_UINT32_PUT(&ctx, &column_ids, grn_obj_id(&ctx, column));
+	grn_obj_set_info(&ctx, index, GRN_INFO_SOURCE, &column_ids);
+	grn_obj_close(&ctx, &column_ids);
+
+	printf("rows: %ld, queries: %ld, rowkey: %s, dir: %s\n", nrows, nqueries,
+		   rowkey == GRN_OBJ_TABLE_PAT_KEY ? "pat" : "hash", dir);
+
+	/* insert; the column is looked up for each row as GrnInsert does */
+	GRN_VALUE_VAR_SIZE_INIT(&value, GRN_OBJ_DO_SHALLOW_COPY, GRN_DB_LONG_TEXT);
+	elapsed = 0;
+	for (i = 1; i <= nrows; i++)
+	{
+		long long	rowkey = ((long long) i / 100) << 16 | (i % 100 + 1);
+		grn_id		rowid;
+		grn_obj	   *col;
+
+		document(&buf, i);
+		start = now_ns();
+		rowid = grn_table_add(&ctx, table, &rowkey, sizeof(rowkey), NULL);
+		col = grn_obj_column(&ctx, table, GrnColumnName, strlen(GrnColumnName));
+		GRN_TEXT_SET_REF(&value, buf.data, buf.len);
+		grn_obj_set_value(&ctx, col, rowid, &value, GRN_OBJ_SET);
+		elapsed += now_ns() - start;
+	}
+	grn_obj_close(&ctx, &value);
+	report("insert", elapsed, nrows);
+
+	/* escape */
+	document(&word, 1);
+	start = now_ns();
+	for (i = 0; i < nqueries * 100; i++)
+	{
+		buf.len = 0;
+		append_escaped(&buf, word.data, word.len);
+	}
+	report("escape", now_ns() - start, nqueries * 100);
+
+	/* command and parse */
+	elapsed = 0;
+	nhits = nbytes = 0;
+	start = now_ns();
+	for (i = 0; i < nqueries; i++)
+	{
+		buf.len = 0;
+		word.len = 0;
+		spell(&word, zipf(random_of(i, 3)));
+		buffer_append_string(&buf, "select --table " GrnTableName
+			" --output_columns _key,_score --limit -1 --query \"(" GrnColumnName ":@");
+		append_escaped(&buf, word.data, word.len);
+		buffer_append_string(&buf, ")\"");
+		nbytes += command(&ctx, buf.data, &res);
+
+		elapsed -= now_ns();
+		nhits += parse(res.data);
+		elapsed += now_ns();
+	}
+	report("command", now_ns() - start - elapsed, nqueries);
+	report("parse", elapsed, nhits > 0 ? nhits : 1);
+	printf("  %ld hits, %ld bytes\n", nhits, nbytes);
+
+	/* query_scan */
+	elapsed = 0;
+	for (i = 0; i < nqueries; i++)
+	{
+		grn_query  *q;
+		const char *doc;
+		unsigned	doclen;
+		int			found;
+		int			score;
+
+		word.len = 0;
+		spell(&word, zipf(random_of(i, 4)));
+		document(&buf, i + 1);
+		doc = buf.data;
+		doclen = buf.len;
+
+		start = now_ns();
+		q = grn_query_open(&ctx, word.data, word.len, GRN_OP_AND, 32);
+		check(&ctx, grn_query_scan(&ctx, q, &doc, &doclen, 1,
+					GRN_QUERY_SCAN_NORMALIZE, &found, &score), "grn_query_scan");
+		grn_query_close(&ctx, q);
+		elapsed += now_ns() - start;
+	}
+	report("query_scan", elapsed, nqueries);
+
+	/* vacuum; delete every 10th row found by a cursor */
+	{
+		grn_table_cursor   *cursor;
+		long				nvisited = 0;
+
+		start = now_ns();
+		cursor = grn_table_cursor_open(&ctx, table, NULL, 0, NULL, 0, 0, -1, 0);
+		if (cursor == NULL)
+			check(&ctx, ctx.rc ? ctx.rc : GRN_UNKNOWN_ERROR, "grn_table_cursor_open");
+		while (grn_table_cursor_next(&ctx, cursor) != GRN_ID_NIL)
+		{
+			long long  *rowkey;
+
+			grn_table_cursor_get_key(&ctx, cursor, (void **) &rowkey);
+			if (++nvisited % 10 == 0)
+			{
+				long long	key = *rowkey;
+
+				(void) grn_table_delete(&ctx, table, &key, sizeof(key));
+			}
+		}
+		grn_table_cursor_close(&ctx, cursor);
+		report("vacuum", now_ns() - start, nvisited > 0 ? nvisited : 1);
+	}
+
+	/* delete */
+	start = now_ns();
+	for (i = 1; i <= nrows; i++)
+	{
+		long long	rowkey = ((long long) i / 100) << 16 | (i % 100 + 1);
+
+		(void) grn_table_delete(&ctx, table, &rowkey, sizeof(rowkey));
+	}
+	report("delete", now_ns() - start, nrows);
+
+	free(buf.data);
+	free(res.data);
+	free(word.data);
+	grn_obj_remove(&ctx, db);
+	grn_ctx_fin(&ctx);
+	grn_fin();
+
+	/* the database removed its files above */
+	if (tempdir && rmdir(dir) != 0)
+		perror(dir);
+
+	return 0;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: grnbench [-n rows] [-q queries] [-d dir]\n");
+	exit(2);
+}
+
+static void
+check(grn_ctx *ctx, grn_rc rc, const char *what)
+{
+	if (rc != GRN_SUCCESS)
+	{
+		fprintf(stderr, "%s failed: %s\n", what, ctx->errbuf);
+		exit(1);
+	}
+}
+
+static double
+now_ns(void)
+{
+	struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+static void
+report(const char *name, double elapsed, long nops)
+{
+	printf("%-12s %12.1f ns/op  (%ld ops)\n", name, elapsed / nops, nops);
+}
+
+/* same as bench_mix() and bench_random() in bench/setup.sql */
+static unsigned long
+mix(unsigned long x)
+{
+	return ((x ^ (x >> 16)) * 73244475UL) % 2147483648UL;
+}
+
+static double
+random_of(long a, long b)
+{
+	unsigned long	x;
+
+	x = ((a % 2147483648UL) * 40503 + (b % 2147483648UL)) % 2147483648UL;
+	return mix(mix(mix(x))) / 2147483648.0;
+}
+
+static int
+zipf(double u)
+{
+	int		rank = (int) floor(exp(u * log(GrnVocabulary + 1)));
+
+	return rank < GrnVocabulary ? rank : GrnVocabulary;
+}
+
+/* same as bench_spell() in bench/setup.sql */
+static void
+spell(Buffer *buf, int rank)
+{
+	int		d;
+	int		base = NumSyllables;
+
+	for (d = 3; d >= 0; d--)
+	{
+		int		p = (int) pow(base, d);
+
+		if (d < 2 || rank >= p)
+			buffer_append(buf, syllables[(rank / p) % base], 2);
+	}
+}
+
+/* English documents of bench_document() */
+static void
+document(Buffer *buf, long id)
+{
+	int		n = 8 + (int) floor(random_of(id, 1) * 17);
+	int		j;
+
+	buf->len = 0;
+	for (j = 1; j <= n; j++)
+	{
+		if (j > 1)
+			buffer_append_char(buf, ' ');
+		spell(buf, zipf(random_of(id * 64 + j, 1)));
+	}
+	buffer_append_char(buf, '.');
+}
+
+/* append len bytes and keep the buffer null-terminated */
+static void
+buffer_append(Buffer *buf, const char *str, size_t len)
+{
+	if (buf->len + len + 1 > buf->maxlen)
+	{
+		buf->maxlen = (buf->len + len + 1) * 2;
+		if ((buf->data = realloc(buf->data, buf->maxlen)) == NULL)
+		{
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(buf->data + buf->len, str, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+}
+
+static void
+buffer_append_string(Buffer *buf, const char *str)
+{
+	buffer_append(buf, str, strlen(str));
+}
+
+static void
+buffer_append_char(Buffer *buf, char c)
+{
+	buffer_append(buf, &c, 1);
+}
+
+/* same as appendStringEscaped */
+static void
+append_escaped(Buffer *buf, const char *str, size_t len)
+{
+	size_t		i;
+
+	for (i = 0; i < len; i++)
+	{
+		switch (str[i])
+		{
+		case ' ':
+		case '(':
+		case ')':
+		case '\'':
+			buffer_append_char(buf, '\\');
+			break;
+		case '"':
+		case '\\':
+			buffer_append(buf, "\\\\\\", 3);
+			break;
+		}
+		buffer_append_char(buf, str[i]);
+	}
+}
+
+static grn_obj *
+create_table(
+	grn_ctx		   *ctx,
+	const char	   *name,
+	const char	   *path,
+	grn_obj_flags	flags,
+	grn_obj		   *type)
+{
+	grn_obj	   *table;
+
+	table = grn_table_create(ctx,
+				name, strlen(name), path,
+				GRN_OBJ_PERSISTENT | flags,
+				type,
+				NULL);
+	if (table == NULL)
+		check(ctx, ctx->rc ? ctx->rc : GRN_UNKNOWN_ERROR, "grn_table_create");
+
+	return table;
+}
+
+static grn_obj *
+create_column(
+	grn_ctx		   *ctx,
+	grn_obj		   *table,
+	const char	   *name,
+	const char	   *path,
+	grn_obj_flags	flags,
+	grn_obj		   *type)
+{
+	grn_obj	   *column;
+
+	column = grn_column_create(ctx, table,
+				name, strlen(name), path,
+				GRN_OBJ_PERSISTENT | flags,
+				type);
+	if (column == NULL)
+		check(ctx, ctx->rc ? ctx->rc : GRN_UNKNOWN_ERROR, "grn_column_create");
+
+	return column;
+}
+
+/* same as GrnCommand; returns the length of the result */
+static long
+command(grn_ctx *ctx, const char *query, Buffer *res)
+{
+	char		   *str;
+	unsigned int	len;
+	int				flags;
+
+	check(ctx, grn_ctx_send(ctx, query, strlen(query), 0), "grn_ctx_send");
+
+	res->len = 0;
+	do
+	{
+		flags = 0;
+		check(ctx, grn_ctx_recv(ctx, &str, &len, &flags), "grn_ctx_recv");
+		if (len > 0)
+		{
+			res->len = 0;
+			buffer_append(res, str, len);
+		}
+	} while (flags & GRN_CTX_MORE);
+
+	return (long) res->len;
+}
+
+/* same as the parser in GrnBeginScan; returns the number of hits */
+static long
+parse(char *res)
+{
+	char	   *token;
+	long		nhits;
+	long		n;
+	long		m = 0;
+
+	if (res == NULL || (token = strtok(res, "[],")) == NULL)
+		return 0;
+	nhits = atol(token);
+	if ((token = strtok(NULL, "[],")) == NULL || strcmp(token, "\"_key\"") != 0 ||
+		(token = strtok(NULL, "[],")) == NULL || strcmp(token, "\"Int64\"") != 0 ||
+		(token = strtok(NULL, "[],")) == NULL || strcmp(token, "\"_score\"") != 0 ||
+		(token = strtok(NULL, "[],")) == NULL || strcmp(token, "\"Int32\"") != 0)
+		return 0;
+
+	for (n = 0; n < nhits; n++)
+	{
+		const char *ctid = strtok(NULL, "[],");
+		const char *score = strtok(NULL, "[],");
+
+		if (ctid == NULL || score == NULL)
+			break;
+		if (atoll(ctid) != 0 && atoi(score) >= 0)
+			m++;
+	}
+
+	return m;
+}
@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# run.sh -- benchmark textsearch_groonga and print results as JSON lines.
+#
+# usage: bench/run.sh [-d dbname] [-s sizes] [-T seconds] [-c clients]
+#                     [-r seed] [-w workloads] [-o options]
+#
+#   -d  database with textsearch_groonga installed (default: grnbench)
+#   -s  comma-separated numbers of documents (default: 10000,100000,1000000)
+#   -T  duration of each pgbench workload in seconds (default: 30)
+#   -c  number of pgbench clients (default: 4)
+#   -r  seed of the data generator (default: 1)
+#   -w  comma-separated pgbench workloads in bench/workloads (default: all)
+#   -o  index options, e.g. "rowkey=pat" (default: none)
+#
+# Each line of the output is one measurement:
+#
+#   {"commit": "...", "options": "", "size": 10000, "workload": "search_rare",
+#    "clients": 4, "tps": 1234.5, "p50_ms": 1.2, "p95_ms": 3.4, "p99_ms": 5.6}
+#
+# One-shot workloads (load, create_index, bulk_insert, vacuum) report the
+# elapsed time in "p50_ms" with "tps" as rows per second. Compare two
+# outputs with bench/compare.sh.
+#
+set -e
+
+DBNAME=grnbench
+SIZES=10000,100000,1000000
+SECONDS_=30
+CLIENTS=4
+SEED=1
+WORKLOADS=
+OPTIONS=
+
+while getopts d:s:T:c:r:w:o: opt; do
+	case $opt in
+	d) DBNAME=$OPTARG ;;
+	s) SIZES=$OPTARG ;;
+	T) SECONDS_=$OPTARG ;;
+	c) CLIENTS=$OPTARG ;;
+	r) SEED=$OPTARG ;;
+	w) WORKLOADS=$OPTARG ;;
+	o) OPTIONS=$OPTARG ;;
+	*) sed -n '3,14p' "$0" >&2; exit 2 ;;
+	esac
+done
+
+BENCHDIR=$(cd "$(dirname "$0")" && pwd)
+COMMIT=$(cd "$BENCHDIR" && git rev-parse --short HEAD 2>/dev/null || echo unknown)
+WORKDIR=$(mktemp -d "${TMPDIR:-/tmp}/grnbench.XXXXXX")
+trap 'rm -rf "$WORKDIR"' 0
+
+WITH=
+if [ -n "$OPTIONS" ]; then
+	WITH="WITH ($OPTIONS)"
+fi
+
+if [ -z "$WORKLOADS" ]; then
+	# searches first; insert grows the table
+	WORKLOADS=search_common,search_medium,search_rare,topk,bitmap,insert
+fi
+
+PSQL="psql -X -q -v ON_ERROR_STOP=1 -d $DBNAME"
+
+# timed SQL -- print elapsed msec of the statement
+timed() {
+	printf '\\timing\n%s\n' "$1" | $PSQL -o /dev/null 2>&1 |
+		sed -n 's/^Time: \([0-9.]*\) ms.*/\1/p' | tail -1
+}
+
+# emit size workload tps p50 p95 p99
+emit() {
+	printf '{"commit": "%s", "options": "%s", "size": %s, "workload": "%s", "clients": %s, "tps": %s, "p50_ms": %s, "p95_ms": %s, "p99_ms": %s}\n' \
+		"$COMMIT" "$OPTIONS" "$1" "$2" "$CLIENTS" "$3" "$4" "$5" "$6"
+}
+
+# one-shot workload; rows processed and elapsed msec
+oneshot() {
+	ms=$(timed "$3")
+	tps=$(awk -v n="$2" -v ms="$ms" 'BEGIN { printf "%.1f", (ms > 0 ? n * 1000 / ms : 0) }')
+	emit "$1" "$4" "$tps" "$ms" "$ms" "$ms"
+}
+
+for size in $(echo "$SIZES" | tr ',' ' '); do
+	$PSQL -f "$BENCHDIR/setup.sql" > /dev/null
+	oneshot "$size" "$size" "SELECT bench_load($size, $SEED);" load
+	$PSQL -c "ANALYZE bench_docs;" > /dev/null
+	oneshot "$size" "$size" "CREATE INDEX bench_docs_body ON bench_docs USING groonga (body) $WITH;" create_index
+
+	bulk=$((size / 10))
+	oneshot "$size" "$bulk" \
+		"SELECT bench_generate($((size + 1)), $((size + bulk)), $SEED);" bulk_insert
+	$PSQL -c "VACUUM ANALYZE bench_docs;" > /dev/null
+
+	for w in $(echo "$WORKLOADS" | tr ',' ' '); do
+		rm -f "$WORKDIR"/pgbench_log.*
+		tps=$(cd "$WORKDIR" &&
+			pgbench -n -l -T "$SECONDS_" -c "$CLIENTS" -f "$BENCHDIR/workloads/$w.sql" "$DBNAME" |
+			sed -n 's/^tps = \([0-9.]*\) (excluding.*/\1/p')
+		# the 3rd field of pgbench logs is the latency in usec
+		cat "$WORKDIR"/pgbench_log.* | awk '{ print $3 / 1000.0 }' | sort -n > "$WORKDIR/latency"
+		set -- $(awk '
+			{ v[NR] = $1 }
+			END {
+				if (NR == 0) { print "0 0 0"; exit }
+				i50 = int(NR * 0.50 + 0.5); if (i50 < 1) i50 = 1
+				i95 = int(NR * 0.95 + 0.5); if (i95 < 1) i95 = 1
+				i99 = int(NR * 0.99 + 0.5); if (i99 < 1) i99 = 1
+				printf "%.3f %.3f %.3f\n", v[i50], v[i95], v[i99]
+			}' "$WORKDIR/latency")
+		emit "$size" "$w" "$tps" "$1" "$2" "$3"
+	done
+
+	# delete every 10th document and measure the cleanup
+	$PSQL -c "DELETE FROM bench_docs WHERE id % 10 = 0;" > /dev/null
+	oneshot "$size" "$((size / 10))" "VACUUM bench_docs;" vacuum
+done
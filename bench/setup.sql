@@ -0,0 +1,112 @@
+--
+-- Data generator for the textsearch_groonga benchmarks.
+--
+-- Documents are generated only from their id and a seed with a portable
+-- pseudo-random generator, so the same corpus is produced on every platform
+-- and PostgreSQL version. Words are drawn from a synthetic vocabulary of
+-- English-like and Japanese (katakana) words with a Zipfian distribution;
+-- rank 1 is the most common word in each language.
+--
+--   SELECT bench_load(100000, 1);   -- 100k documents with seed 1
+--
+
+DROP TABLE IF EXISTS bench_docs;
+DROP TABLE IF EXISTS bench_words;
+DROP SEQUENCE IF EXISTS bench_docs_id_seq;
+
+-- number of words in the vocabulary of each language
+CREATE OR REPLACE FUNCTION bench_vocabulary() RETURNS integer AS
+$$ SELECT 10000 $$
+LANGUAGE sql IMMUTABLE;
+
+-- integer hash of x in [0, 2^31)
+CREATE OR REPLACE FUNCTION bench_mix(x bigint) RETURNS bigint AS
+$$ SELECT (($1 # ($1 >> 16)) * 73244475) % 2147483648 $$
+LANGUAGE sql IMMUTABLE STRICT;
+
+-- uniform random number in [0, 1) derived from (a, b)
+CREATE OR REPLACE FUNCTION bench_random(a bigint, b bigint) RETURNS float8 AS
+$$
+SELECT bench_mix(bench_mix(bench_mix(
+	(($1 % 2147483648) * 40503 + ($2 % 2147483648)) % 2147483648)))::float8 / 2147483648
+$$
+LANGUAGE sql IMMUTABLE STRICT;
+
+-- spell the number n (< 10000) with the given syllables as digits; at least
+-- two syllables
+CREATE OR REPLACE FUNCTION bench_spell(n integer, syllables text[]) RETURNS text AS
+$$
+SELECT array_to_string(ARRAY(
+	SELECT $2[1 + ($1 / (array_upper($2, 1) ^ d)::integer) % array_upper($2, 1)]
+	  FROM generate_series(3, 0, -1) AS d
+	 WHERE d < 2 OR $1 >= array_upper($2, 1) ^ d
+	 ORDER BY d DESC), '')
+$$
+LANGUAGE sql IMMUTABLE STRICT;
+
+CREATE TABLE bench_words (
+	lang	integer,	-- 0: English, 1: Japanese
+	rank	integer,
+	word	text,
+	PRIMARY KEY (lang, rank)
+);
+
+INSERT INTO bench_words
+SELECT 0, r, bench_spell(r, ARRAY[
+		'ba', 'ko', 'ri', 'te', 'mu', 'sa', 'no', 'gi', 'pe', 'lu',
+		'da', 'vo', 'ki', 'ne', 'ru', 'fa', 'to', 'mi', 'ze', 'hu'])
+  FROM generate_series(1, bench_vocabulary()) AS r;
+
+INSERT INTO bench_words
+SELECT 1, r, bench_spell(r, ARRAY[
+		'ア', 'イ', 'ウ', 'エ', 'オ', 'カ', 'キ', 'ク', 'ケ', 'コ',
+		'サ', 'シ', 'ス', 'セ', 'ソ', 'タ', 'チ', 'ツ', 'テ', 'ト',
+		'ナ', 'ニ', 'ヌ', 'ネ', 'ノ', 'ハ', 'ヒ', 'フ', 'ヘ', 'ホ',
+		'マ', 'ミ', 'ム', 'メ', 'モ', 'ラ', 'リ', 'ル', 'レ', 'ロ'])
+  FROM generate_series(1, bench_vocabulary()) AS r;
+
+CREATE OR REPLACE FUNCTION bench_word(lang integer, rank integer) RETURNS text AS
+$$ SELECT word FROM bench_words WHERE lang = $1 AND rank = $2 $$
+LANGUAGE sql STABLE STRICT;
+
+-- Zipfian rank in [1, bench_vocabulary()] for a uniform random number
+CREATE OR REPLACE FUNCTION bench_zipf(u float8) RETURNS integer AS
+$$ SELECT least(floor(exp($1 * ln(bench_vocabulary() + 1)))::integer, bench_vocabulary()) $$
+LANGUAGE sql IMMUTABLE STRICT;
+
+-- document of id; even ids are Japanese and odd ids are English
+CREATE OR REPLACE FUNCTION bench_document(id bigint, seed integer) RETURNS text AS
+$$
+SELECT CASE $1 % 2
+	WHEN 0 THEN array_to_string(words, 'の') || '。'
+	ELSE array_to_string(words, ' ') || '.'
+	END
+  FROM (SELECT ARRAY(
+		SELECT w.word
+		  FROM generate_series(1, 8 + floor(bench_random($1, $2) * 17)::integer) AS j,
+			   bench_words w
+		 WHERE w.lang = 1 - ($1 % 2)::integer
+		   AND w.rank = bench_zipf(bench_random($1 * 64 + j, $2))
+		 ORDER BY j) AS words) AS t
+$$
+LANGUAGE sql STABLE STRICT;
+
+CREATE TABLE bench_docs (
+	id		bigint PRIMARY KEY,
+	body	text
+);
+
+CREATE SEQUENCE bench_docs_id_seq;
+
+-- append documents [start, stop]
+CREATE OR REPLACE FUNCTION bench_generate(start bigint, stop bigint, seed integer) RETURNS bigint AS
+$$
+INSERT INTO bench_docs SELECT i, bench_document(i, $3) FROM generate_series($1, $2) AS i;
+SELECT setval('bench_docs_id_seq', $2);
+$$
+LANGUAGE sql VOLATILE STRICT;
+
+-- load n documents into the empty bench_docs
+CREATE OR REPLACE FUNCTION bench_load(n bigint, seed integer) RETURNS bigint AS
+$$ SELECT bench_generate(1, $1, $2) $$
+LANGUAGE sql VOLATILE STRICT;
@@ -0,0 +1,5 @@
+\setrandom lang 0 1
+\setrandom rank 10 100
+SET enable_seqscan = off;
+SET enable_indexscan = off;
+SELECT count(*) FROM bench_docs WHERE body %% bench_word(:lang, :rank);
@@ -0,0 +1,2 @@
+INSERT INTO bench_docs
+SELECT i, bench_document(i, 2) FROM (SELECT nextval('bench_docs_id_seq') AS i) AS s;
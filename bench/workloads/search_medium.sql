@@ -0,0 +1,5 @@
+\setrandom lang 0 1
+\setrandom rank 50 200
+SET enable_seqscan = off;
+SET enable_bitmapscan = off;
+SELECT count(*) FROM bench_docs WHERE body %% bench_word(:lang, :rank);
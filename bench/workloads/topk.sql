@@ -0,0 +1,9 @@
+\setrandom lang 0 1
+\setrandom rank 10 100
+SET enable_seqscan = off;
+SET enable_bitmapscan = off;
+SELECT id, groonga.score(tableoid, ctid)
+  FROM bench_docs
+ WHERE body %% bench_word(:lang, :rank)
+ ORDER BY groonga.score(tableoid, ctid) DESC, id
+ LIMIT 10;
@@ -0,0 +1,672 @@
+/*
+ * IDENTIFICATION
+ *	  groonga_cache.c
+ *
+ * Search result cache in shared memory. Results are keyed by index and
+ * groonga command, and are stored as varint-encoded deltas of rowkeys
+ * followed by scores. Each index has a version which is changed after
+ * every insert and delete; entries made with an older version are never
+ * returned. The cache is available only when the module is loaded with
+ * shared_preload_libraries and groonga.cache_size is set.
+ */
+#include "postgres.h"
+
+#include "textsearch_groonga.h"
+#include "access/hash.h"
+#include "access/heapam.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/rel.h"
+#include "pgut/pgut-be.h"
+
+PG_FUNCTION_INFO_V1(groonga_cache_stat);
+PG_FUNCTION_INFO_V1(groonga_cache_reset);
+
+/* maximum length of a varint-encoded 64bit integer */
+#define GrnVarintMaxLen		10
+
+typedef struct GrnCacheKey
+{
+	RelFileNode	node;
+	uint32		hash;			/* hash of the groonga command */
+} GrnCacheKey;
+
+typedef struct GrnCacheEntry
+{
+	GrnCacheKey	key;			/* hash key of entry - MUST BE FIRST */
+	uint64		version;		/* version of the index when cached */
+	uint64		lru;			/* clock of the last access */
+	int64		num;			/* number of hits */
+	int			cmdlen;			/* length of the command in the slot */
+	int			datalen;		/* length of the encoded hits in the slot */
+	int			slot;			/* index of the slot */
+} GrnCacheEntry;
+
+typedef struct GrnCacheVersion
+{
+	RelFileNode	key;			/* hash key of entry - MUST BE FIRST */
+	uint64		version;		/* protected by grnCache->mutex */
+	int			nentries;		/* number of cached entries of the index */
+} GrnCacheVersion;
+
+typedef struct GrnCacheShared
+{
+	LWLockId	lock;			/* protects hashtables, slots and free list */
+	slock_t		mutex;			/* protects the counters and versions */
+	uint64		counter;		/* source of versions */
+	uint64		clock;			/* source of lru */
+	int64		hits;
+	int64		misses;
+	int64		stores;
+	int64		evictions;
+	int			nfree;			/* number of free slots */
+	int			freelist[1];	/* VARIABLE LENGTH ARRAY */
+} GrnCacheShared;
+
+/* GUC variables */
+static int	grnCacheSize = 0;
+static int	grnCacheEntrySize = 64;
+
+#if PG_VERSION_NUM >= 80400
+/* saved hook value */
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#endif
+
+/* links to shared memory state */
+static GrnCacheShared  *grnCache = NULL;
+static HTAB			   *grnCacheHash = NULL;
+static HTAB			   *grnCacheVersions = NULL;
+static char			   *grnCacheSlots = NULL;
+
+#if PG_VERSION_NUM >= 80400
+static void GrnCacheStartup(void);
+static Size GrnCacheShmemSize(void);
+#endif
+static int GrnCacheSlots(void);
+static Size GrnCacheSlotSize(void);
+static void GrnCacheMakeKey(GrnCacheKey *key, Relation index, const char *command);
+static void GrnCacheEvict(GrnCacheEntry *entry);
+static char *GrnEncodeVarint(char *p, uint64 value);
+static const char *GrnDecodeVarint(const char *p, uint64 *value);
+
+/*
+ * GrnCacheInit -- called from _PG_init.
+ */
+void
+GrnCacheInit(void)
+{
+#if PG_VERSION_NUM >= 80400
+	/*
+	 * We can allocate shared memory only when preloaded. Results are not
+	 * cached otherwise.
+	 */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("groonga.cache_size",
+		"Sets the amount of shared memory used for the search result cache.",
+		"Zero disables the cache.",
+		&grnCacheSize,
+		0,
+		0,
+		MAX_KILOBYTES,
+		PGC_POSTMASTER,
+		GUC_UNIT_KB,
+		NULL,
+		NULL);
+
+	DefineCustomIntVariable("groonga.cache_entry_size",
+		"Sets the maximum size of each cached search result.",
+		"Results larger than this are not cached.",
+		&grnCacheEntrySize,
+		64,
+		1,
+		MAX_KILOBYTES,
+		PGC_POSTMASTER,
+		GUC_UNIT_KB,
+		NULL,
+		NULL);
+
+	if (GrnCacheSlots() <= 0)
+		return;
+
+	RequestAddinShmemSpace(GrnCacheShmemSize());
+	RequestAddinLWLocks(1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = GrnCacheStartup;
+#endif
+}
+
+static int
+GrnCacheSlots(void)
+{
+	return grnCacheSize / grnCacheEntrySize;
+}
+
+static Size
+GrnCacheSlotSize(void)
+{
+	return (Size) grnCacheEntrySize * 1024;
+}
+
+#if PG_VERSION_NUM >= 80400
+static Size
+GrnCacheShmemSize(void)
+{
+	int		nslots = GrnCacheSlots();
+	Size	size;
+
+	size = MAXALIGN(offsetof(GrnCacheShared, freelist) + sizeof(int) * nslots);
+	size = add_size(size, mul_size(nslots, GrnCacheSlotSize()));
+	size = add_size(size, hash_estimate_size(nslots, sizeof(GrnCacheEntry)));
+	size = add_size(size, hash_estimate_size(nslots, sizeof(GrnCacheVersion)));
+	return size;
+}
+
+static void
+GrnCacheStartup(void)
+{
+	int			nslots = GrnCacheSlots();
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	grnCache = ShmemInitStruct("groonga cache",
+		MAXALIGN(offsetof(GrnCacheShared, freelist) + sizeof(int) * nslots),
+		&found);
+	grnCacheSlots = ShmemInitStruct("groonga cache slots",
+		mul_size(nslots, GrnCacheSlotSize()), &found);
+	if (!found)
+	{
+		int		i;
+
+		grnCache->lock = LWLockAssign();
+		SpinLockInit(&grnCache->mutex);
+		grnCache->counter = 0;
+		grnCache->clock = 0;
+		grnCache->hits = 0;
+		grnCache->misses = 0;
+		grnCache->stores = 0;
+		grnCache->evictions = 0;
+		grnCache->nfree = nslots;
+		for (i = 0; i < nslots; i++)
+			grnCache->freelist[i] = nslots - i - 1;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(GrnCacheKey);
+	info.entrysize = sizeof(GrnCacheEntry);
+	info.hash = tag_hash;
+	grnCacheHash = ShmemInitHash("groonga cache hash",
+								 nslots, nslots,
+								 &info,
+								 HASH_ELEM | HASH_FUNCTION);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(RelFileNode);
+	info.entrysize = sizeof(GrnCacheVersion);
+	info.hash = tag_hash;
+	grnCacheVersions = ShmemInitHash("groonga cache versions",
+									 nslots, nslots,
+									 &info,
+									 HASH_ELEM | HASH_FUNCTION);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+#endif
+
+/*
+ * GrnCacheLookup -- find a cached result of the command.
+ *
+ * On hit, returns true and sets palloc'd arrays of ctids and scores.
+ */
+bool
+GrnCacheLookup(Relation index, const char *command,
+			   ItemPointer *ctids, int32 **scores, int64 *num)
+{
+	volatile GrnCacheShared *cache = grnCache;
+	GrnCacheKey			key;
+	GrnCacheEntry	   *entry;
+	GrnCacheVersion	   *ver;
+	char			   *data = NULL;
+	int					datalen = 0;
+	int64				n = 0;
+	bool				hit = false;
+
+	if (grnCache == NULL)
+		return false;
+
+	GrnCacheMakeKey(&key, index, command);
+
+	LWLockAcquire(grnCache->lock, LW_SHARED);
+
+	ver = (GrnCacheVersion *) hash_search(grnCacheVersions, &index->rd_node, HASH_FIND, NULL);
+	entry = (GrnCacheEntry *) hash_search(grnCacheHash, &key, HASH_FIND, NULL);
+	if (ver != NULL && entry != NULL)
+	{
+		const char *slot = grnCacheSlots + entry->slot * GrnCacheSlotSize();
+
+		SpinLockAcquire(&cache->mutex);
+		hit = (entry->version == ver->version);
+		SpinLockRelease(&cache->mutex);
+
+		/* different commands might have the same hash */
+		hit = (hit &&
+			   entry->cmdlen == (int) strlen(command) &&
+			   memcmp(slot, command, entry->cmdlen) == 0);
+
+		/* copy the encoded hits to keep locking time short */
+		if (hit)
+		{
+			SpinLockAcquire(&cache->mutex);
+			entry->lru = ++cache->clock;
+			SpinLockRelease(&cache->mutex);
+
+			n = entry->num;
+			datalen = entry->datalen;
+			data = palloc(datalen);
+			memcpy(data, slot + entry->cmdlen, datalen);
+		}
+	}
+
+	LWLockRelease(grnCache->lock);
+
+	SpinLockAcquire(&cache->mutex);
+	if (hit)
+		cache->hits++;
+	else
+		cache->misses++;
+	SpinLockRelease(&cache->mutex);
+
+	if (hit)
+	{
+		const char *p = data;
+		int64		i;
+		uint64		rowkey = 0;
+
+		*ctids = (ItemPointer) palloc(sizeof(ItemPointerData) * Max(n, 1));
+		*scores = (int32 *) palloc(sizeof(int32) * Max(n, 1));
+		for (i = 0; i < n; i++)
+		{
+			uint64		delta;
+
+			p = GrnDecodeVarint(p, &delta);
+			rowkey += delta;
+			ItemPointerSet(&(*ctids)[i], (BlockNumber) (rowkey >> 16), (OffsetNumber) (rowkey & 0xFFFF));
+		}
+		for (i = 0; i < n; i++)
+		{
+			uint64		score;
+
+			p = GrnDecodeVarint(p, &score);
+			(*scores)[i] = (int32) (uint32) score;
+		}
+		Assert(p == data + datalen);
+		*num = n;
+		pfree(data);
+	}
+
+	return hit;
+}
+
+/*
+ * GrnCacheBegin -- returns the current version of the index, which must be
+ * passed to GrnCacheStore after search. Returns 0 when the result cannot be
+ * cached.
+ */
+uint64
+GrnCacheBegin(Relation index)
+{
+	volatile GrnCacheShared *cache = grnCache;
+	GrnCacheVersion	   *ver;
+	uint64				version = 0;
+	bool				found;
+
+	if (grnCache == NULL)
+		return 0;
+
+	LWLockAcquire(grnCache->lock, LW_SHARED);
+	ver = (GrnCacheVersion *) hash_search(grnCacheVersions, &index->rd_node, HASH_FIND, NULL);
+	if (ver != NULL)
+	{
+		SpinLockAcquire(&cache->mutex);
+		version = ver->version;
+		SpinLockRelease(&cache->mutex);
+	}
+	LWLockRelease(grnCache->lock);
+
+	if (ver != NULL)
+		return version;
+
+	/* need exclusive lock to make a new entry */
+	LWLockAcquire(grnCache->lock, LW_EXCLUSIVE);
+
+	ver = (GrnCacheVersion *) hash_search(grnCacheVersions, &index->rd_node, HASH_ENTER_NULL, &found);
+	if (ver == NULL)
+	{
+		/* the table is full; forget indexes without cached entries */
+		HASH_SEQ_STATUS		status;
+		GrnCacheVersion	   *v;
+
+		hash_seq_init(&status, grnCacheVersions);
+		while ((v = (GrnCacheVersion *) hash_seq_search(&status)) != NULL)
+		{
+			if (v->nentries == 0)
+				hash_search(grnCacheVersions, &v->key, HASH_REMOVE, NULL);
+		}
+		ver = (GrnCacheVersion *) hash_search(grnCacheVersions, &index->rd_node, HASH_ENTER_NULL, &found);
+	}
+
+	if (ver != NULL)
+	{
+		SpinLockAcquire(&cache->mutex);
+		if (!found)
+		{
+			/*
+			 * Versions are unique among all indexes, so a version taken
+			 * before the entry was forgotten never matches the new one.
+			 */
+			ver->version = ++cache->counter;
+			ver->nentries = 0;
+		}
+		version = ver->version;
+		SpinLockRelease(&cache->mutex);
+	}
+
+	LWLockRelease(grnCache->lock);
+
+	return version;
+}
+
+/*
+ * GrnCacheStore -- store the search result if the index has not been
+ * modified since GrnCacheBegin.
+ */
+void
+GrnCacheStore(Relation index, const char *command, uint64 version,
+			  const ItemPointerData ctids[], const int32 scores[], int64 num)
+{
+	volatile GrnCacheShared *cache = grnCache;
+	int					cmdlen = strlen(command);
+	Size				maxlen = (Size) (num * 2 + 1) * GrnVarintMaxLen;
+	char			   *data;
+	char			   *p;
+	uint64				prev = 0;
+	int64				i;
+	GrnCacheKey			key;
+	GrnCacheEntry	   *entry;
+	GrnCacheVersion	   *ver;
+	bool				found;
+	bool				valid;
+
+	if (grnCache == NULL || version == 0)
+		return;
+
+	if ((Size) cmdlen >= GrnCacheSlotSize())
+		return;
+
+	/* ctids are sorted, so the deltas are small and positive */
+	p = data = palloc(Min(maxlen, GrnCacheSlotSize() + GrnVarintMaxLen * 2));
+	for (i = 0; i < num; i++)
+	{
+		uint64	rowkey = ((uint64) ItemPointerGetBlockNumber(&ctids[i]) << 16) |
+						 ItemPointerGetOffsetNumber(&ctids[i]);
+
+		p = GrnEncodeVarint(p, rowkey - prev);
+		prev = rowkey;
+		if ((Size) (cmdlen + (p - data)) > GrnCacheSlotSize())
+		{
+			pfree(data);
+			return;
+		}
+	}
+	for (i = 0; i < num; i++)
+	{
+		p = GrnEncodeVarint(p, (uint32) scores[i]);
+		if ((Size) (cmdlen + (p - data)) > GrnCacheSlotSize())
+		{
+			pfree(data);
+			return;
+		}
+	}
+
+	GrnCacheMakeKey(&key, index, command);
+
+	LWLockAcquire(grnCache->lock, LW_EXCLUSIVE);
+
+	ver = (GrnCacheVersion *) hash_search(grnCacheVersions, &index->rd_node, HASH_FIND, NULL);
+	if (ver != NULL)
+	{
+		SpinLockAcquire(&cache->mutex);
+		valid = (ver->version == version);
+		SpinLockRelease(&cache->mutex);
+	}
+	else
+		valid = false;
+
+	if (valid)
+	{
+		/* replace an existing entry of the same key */
+		entry = (GrnCacheEntry *) hash_search(grnCacheHash, &key, HASH_FIND, NULL);
+		if (entry != NULL)
+			GrnCacheEvict(entry);
+
+		/* evict the least recently used entry when no slots are free */
+		if (grnCache->nfree == 0)
+		{
+			HASH_SEQ_STATUS	status;
+			GrnCacheEntry  *victim = NULL;
+			GrnCacheEntry  *e;
+
+			hash_seq_init(&status, grnCacheHash);
+			while ((e = (GrnCacheEntry *) hash_seq_search(&status)) != NULL)
+			{
+				if (victim == NULL || e->lru < victim->lru)
+					victim = e;
+			}
+			if (victim != NULL)
+				GrnCacheEvict(victim);
+		}
+
+		entry = (GrnCacheEntry *) hash_search(grnCacheHash, &key, HASH_ENTER_NULL, &found);
+		if (entry != NULL && grnCache->nfree > 0)
+		{
+			char   *slot;
+
+			Assert(!found);
+			entry->version = version;
+			entry->num = num;
+			entry->cmdlen = cmdlen;
+			entry->datalen = p - data;
+			entry->slot = grnCache->freelist[--grnCache->nfree];
+
+			slot = grnCacheSlots + entry->slot * GrnCacheSlotSize();
+			memcpy(slot, command, cmdlen);
+			memcpy(slot + cmdlen, data, entry->datalen);
+			ver->nentries++;
+
+			SpinLockAcquire(&cache->mutex);
+			entry->lru = ++cache->clock;
+			cache->stores++;
+			SpinLockRelease(&cache->mutex);
+		}
+		else if (entry != NULL)
+			hash_search(grnCacheHash, &key, HASH_REMOVE, NULL);
+	}
+
+	LWLockRelease(grnCache->lock);
+
+	pfree(data);
+}
+
+/*
+ * GrnCacheInvalidate -- called after the index is modified.
+ */
+void
+GrnCacheInvalidate(Relation index)
+{
+	volatile GrnCacheShared *cache = grnCache;
+	GrnCacheVersion	   *ver;
+
+	if (grnCache == NULL)
+		return;
+
+	LWLockAcquire(grnCache->lock, LW_SHARED);
+
+	/* nothing to do if the index has never been cached */
+	ver = (GrnCacheVersion *) hash_search(grnCacheVersions, &index->rd_node, HASH_FIND, NULL);
+	if (ver != NULL)
+	{
+		SpinLockAcquire(&cache->mutex);
+		ver->version = ++cache->counter;
+		SpinLockRelease(&cache->mutex);
+	}
+
+	LWLockRelease(grnCache->lock);
+}
+
+static void
+GrnCacheMakeKey(GrnCacheKey *key, Relation index, const char *command)
+{
+	memset(key, 0, sizeof(GrnCacheKey));
+	key->node = index->rd_node;
+	key->hash = DatumGetUInt32(hash_any((const unsigned char *) command, strlen(command)));
+}
+
+/*
+ * Remove the entry and release the slot. Caller must hold an exclusive lock
+ * on grnCache->lock.
+ */
+static void
+GrnCacheEvict(GrnCacheEntry *entry)
+{
+	volatile GrnCacheShared *cache = grnCache;
+	GrnCacheVersion	   *ver;
+
+	ver = (GrnCacheVersion *) hash_search(grnCacheVersions, &entry->key.node, HASH_FIND, NULL);
+	if (ver != NULL)
+		ver->nentries--;
+
+	grnCache->freelist[grnCache->nfree++] = entry->slot;
+	hash_search(grnCacheHash, &entry->key, HASH_REMOVE, NULL);
+
+	SpinLockAcquire(&cache->mutex);
+	cache->evictions++;
+	SpinLockRelease(&cache->mutex);
+}
+
+static char *
+GrnEncodeVarint(char *p, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		*p++ = (char) ((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	*p++ = (char) value;
+	return p;
+}
+
+static const char *
+GrnDecodeVarint(const char *p, uint64 *value)
+{
+	uint64	v = 0;
+	int		shift = 0;
+
+	while (*p & 0x80)
+	{
+		v |= (uint64) (*p++ & 0x7F) << shift;
+		shift += 7;
+	}
+	v |= (uint64) (unsigned char) *p++ << shift;
+	*value = v;
+	return p;
+}
+
+/**
+ * groonga.cache_stat() : record
+ *
+ * @return	counters of the search result cache.
+ */
+Datum
+groonga_cache_stat(PG_FUNCTION_ARGS)
+{
+	volatile GrnCacheShared *cache = grnCache;
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6];
+	int64		entries;
+	int			i;
+
+	if (grnCache == NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+			 errmsg("groonga: result cache requires textsearch_groonga in shared_preload_libraries and groonga.cache_size")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	LWLockAcquire(grnCache->lock, LW_SHARED);
+	entries = hash_get_num_entries(grnCacheHash);
+	LWLockRelease(grnCache->lock);
+
+	memset(nulls, 0, sizeof(nulls));
+	i = 0;
+	SpinLockAcquire(&cache->mutex);
+	values[i++] = Int64GetDatum(cache->hits);
+	values[i++] = Int64GetDatum(cache->misses);
+	values[i++] = Int64GetDatum(cache->stores);
+	values[i++] = Int64GetDatum(cache->evictions);
+	SpinLockRelease(&cache->mutex);
+	values[i++] = Int64GetDatum(entries);
+	values[i++] = Int64GetDatum((int64) GrnCacheSlots());
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/**
+ * groonga.cache_reset() : void
+ *
+ * Discard all cached results and reset the counters.
+ */
+Datum
+groonga_cache_reset(PG_FUNCTION_ARGS)
+{
+	volatile GrnCacheShared *cache = grnCache;
+	HASH_SEQ_STATUS		status;
+	GrnCacheEntry	   *entry;
+
+	if (grnCache == NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+			 errmsg("groonga: result cache requires textsearch_groonga in shared_preload_libraries and groonga.cache_size")));
+
+	LWLockAcquire(grnCache->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, grnCacheHash);
+	while ((entry = (GrnCacheEntry *) hash_seq_search(&status)) != NULL)
+		GrnCacheEvict(entry);
+
+	SpinLockAcquire(&cache->mutex);
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->stores = 0;
+	cache->evictions = 0;
+	SpinLockRelease(&cache->mutex);
+
+	LWLockRelease(grnCache->lock);
+
+	PG_RETURN_VOID();
+}
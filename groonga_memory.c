@@ -0,0 +1,198 @@
+/*
+ * IDENTIFICATION
+ *	  groonga_memory.c
+ *
+ * Accounting of memory used by groonga searches in the backend. Search
+ * results copied into postgres memory are counted and limited by
+ * groonga.work_mem. groonga allocates its own memory outside of memory
+ * contexts, so the heap and mapped files of the process are reported as
+ * seen by the operating system.
+ */
+#include "postgres.h"
+
+#include "textsearch_groonga.h"
+#include "access/heapam.h"
+#include "funcapi.h"
+#include "storage/fd.h"
+#include "utils/guc.h"
+#include "pgut/pgut-be.h"
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+PG_FUNCTION_INFO_V1(groonga_memory_usage);
+
+/* GUC variables */
+static int	grnWorkMem = 0;
+
+/* bytes of search results held by the backend */
+static int64	grnMemoryResults = 0;
+static int64	grnMemoryPeak = 0;
+
+static int64 GrnMemoryHeap(void);
+static int64 GrnMemoryMapped(void);
+
+/*
+ * GrnMemoryInit -- called from _PG_init.
+ */
+void
+GrnMemoryInit(void)
+{
+	DefineCustomIntVariable("groonga.work_mem",
+		"Sets the maximum memory used for results of groonga searches in a backend.",
+		"Searches needing more memory fail. Zero disables the limit.",
+		&grnWorkMem,
+		0,
+		0,
+		MAX_KILOBYTES,
+		PGC_USERSET,
+		GUC_UNIT_KB,
+		NULL,
+		NULL);
+}
+
+/*
+ * GrnMemoryAvailable -- true if size bytes more of results fit in
+ * groonga.work_mem.
+ */
+bool
+GrnMemoryAvailable(int64 size)
+{
+	return grnWorkMem <= 0 ||
+		   grnMemoryResults + size <= (int64) grnWorkMem * 1024;
+}
+
+/*
+ * GrnMemoryReserve -- count size bytes of results, or fail if they exceed
+ * groonga.work_mem. Call before allocating them.
+ */
+void
+GrnMemoryReserve(int64 size)
+{
+	if (!GrnMemoryAvailable(size))
+		GrnMemoryExceeded();
+
+	grnMemoryResults += size;
+	if (grnMemoryPeak < grnMemoryResults)
+		grnMemoryPeak = grnMemoryResults;
+}
+
+void
+GrnMemoryRelease(int64 size)
+{
+	grnMemoryResults -= size;
+	if (grnMemoryResults < 0)
+		grnMemoryResults = 0;
+}
+
+void
+GrnMemoryExceeded(void)
+{
+	ereport(ERROR,
+		(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+		 errmsg("groonga: search results exceed groonga.work_mem (%d kB)",
+			grnWorkMem),
+		 errhint("Narrow the search condition, or raise groonga.work_mem.")));
+}
+
+/*
+ * GrnMemoryReset -- called at the end of transactions, where all scans
+ * have been closed or their memory has been released with the contexts.
+ */
+void
+GrnMemoryReset(void)
+{
+	grnMemoryResults = 0;
+}
+
+/*
+ * Bytes allocated with malloc in the process, including memory contexts of
+ * postgres. -1 if unknown.
+ */
+static int64
+GrnMemoryHeap(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2	mi = mallinfo2();
+
+	return (int64) mi.uordblks + (int64) mi.hblkhd;
+#elif defined(__GLIBC__)
+	struct mallinfo		mi = mallinfo();
+
+	/* fields are int and wrap around beyond 2GB */
+	return (int64) (unsigned int) mi.uordblks + (int64) (unsigned int) mi.hblkhd;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Bytes of groonga files mapped in the process. -1 if unknown.
+ */
+static int64
+GrnMemoryMapped(void)
+{
+#ifdef __linux__
+	FILE	   *fp;
+	char		line[MAXPGPATH + 256];
+	int64		mapped = 0;
+
+	if ((fp = AllocateFile("/proc/self/maps", "r")) == NULL)
+		return -1;
+
+	/* start-end perms offset dev inode path */
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		unsigned long	start;
+		unsigned long	end;
+		const char	   *path;
+		const char	   *name;
+
+		if (sscanf(line, "%lx-%lx", &start, &end) != 2 ||
+			(path = strchr(line, '/')) == NULL)
+			continue;
+
+		/* the database "grn*" and indexes "{relfilenode}*.grn*" */
+		name = last_dir_separator(path) + 1;
+		if (strncmp(name, GrnDatabaseName, strlen(GrnDatabaseName)) == 0 ||
+			strstr(name, ".grn") != NULL)
+			mapped += end - start;
+	}
+	FreeFile(fp);
+
+	return mapped;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * groonga.memory_usage() : record
+ *
+ * @return	memory used by groonga in the backend; NULL if unknown.
+ */
+Datum
+groonga_memory_usage(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[4];
+	bool		nulls[4];
+	int64		heap = GrnMemoryHeap();
+	int64		mapped = GrnMemoryMapped();
+	int			i;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	i = 0;
+	values[i++] = Int64GetDatum(grnMemoryResults);
+	values[i++] = Int64GetDatum(grnMemoryPeak);
+	nulls[i] = (heap < 0);
+	values[i++] = Int64GetDatum(heap);
+	nulls[i] = (mapped < 0);
+	values[i++] = Int64GetDatum(mapped);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
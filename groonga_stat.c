@@ -0,0 +1,381 @@
+/*
+ * IDENTIFICATION
+ *	  groonga_stat.c
+ *
+ * Per-index activity counters in shared memory. They are available only
+ * when the module is loaded with shared_preload_libraries.
+ */
+#include "postgres.h"
+
+#include "textsearch_groonga.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/rel.h"
+#include "pgut/pgut-be.h"
+
+PG_FUNCTION_INFO_V1(groonga_stat_indexes);
+PG_FUNCTION_INFO_V1(groonga_stat_reset);
+
+/* upper bounds of scan time histogram buckets in msec; the last is open */
+static const double GrnStatHistBounds[GrnStatHistBuckets - 1] =
+{
+	0.1, 1, 10, 100, 1000
+};
+
+typedef struct GrnStatEntry
+{
+	RelFileNode	key;			/* hash key of entry - MUST BE FIRST */
+	slock_t		mutex;			/* protects the counters only */
+	int64		scans;			/* number of searches */
+	int64		hits;			/* number of tuples returned by searches */
+	int64		inserts;		/* number of inserted tuples */
+	int64		deletes;		/* number of deleted tuples */
+	int64		lock_waits;		/* number of lock waits */
+	double		lock_time;		/* msec waited for locks */
+	double		command_time;	/* msec spent in groonga commands */
+	int64		bytes_parsed;	/* bytes of search results parsed */
+	int64		scan_hist[GrnStatHistBuckets];
+} GrnStatEntry;
+
+typedef struct GrnStatShared
+{
+	LWLockId	lock;			/* protects hashtable search/modification */
+} GrnStatShared;
+
+/* GUC variables */
+static int	grnStatMax = 1000;
+
+#if PG_VERSION_NUM >= 80400
+/* saved hook value */
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#endif
+
+/* links to shared memory state */
+static GrnStatShared   *grnStat = NULL;
+static HTAB			   *grnStatHash = NULL;
+
+#if PG_VERSION_NUM >= 80400
+static void GrnStatStartup(void);
+static Size GrnStatShmemSize(void);
+#endif
+static volatile GrnStatEntry *GrnStatBegin(Relation index);
+static void GrnStatEnd(void);
+static GrnStatEntry *GrnStatAlloc(const RelFileNode *key);
+
+/*
+ * GrnStatInit -- called from _PG_init.
+ */
+void
+GrnStatInit(void)
+{
+#if PG_VERSION_NUM >= 80400
+	/*
+	 * We can allocate shared memory only when preloaded. Counters are not
+	 * maintained otherwise.
+	 */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("groonga.stat_max",
+		"Sets the maximum number of indexes tracked by groonga.stat_indexes.",
+		NULL,
+		&grnStatMax,
+		1000,
+		100,
+		INT_MAX,
+		PGC_POSTMASTER,
+		0,
+		NULL,
+		NULL);
+
+	RequestAddinShmemSpace(GrnStatShmemSize());
+	RequestAddinLWLocks(1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = GrnStatStartup;
+#endif
+}
+
+#if PG_VERSION_NUM >= 80400
+static Size
+GrnStatShmemSize(void)
+{
+	return add_size(MAXALIGN(sizeof(GrnStatShared)),
+					hash_estimate_size(grnStatMax, sizeof(GrnStatEntry)));
+}
+
+static void
+GrnStatStartup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	grnStat = ShmemInitStruct("groonga stat",
+							  sizeof(GrnStatShared), &found);
+	if (!found)
+		grnStat->lock = LWLockAssign();
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(RelFileNode);
+	info.entrysize = sizeof(GrnStatEntry);
+	info.hash = tag_hash;
+	grnStatHash = ShmemInitHash("groonga stat hash",
+								grnStatMax, grnStatMax,
+								&info,
+								HASH_ELEM | HASH_FUNCTION);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+#endif
+
+void
+GrnStatScan(Relation index, int64 nhits, int64 nbytes, double command_time, double total_time)
+{
+	volatile GrnStatEntry  *entry;
+	int						i;
+
+	if ((entry = GrnStatBegin(index)) == NULL)
+		return;
+
+	for (i = 0; i < GrnStatHistBuckets - 1; i++)
+	{
+		if (total_time < GrnStatHistBounds[i])
+			break;
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->scans += 1;
+	entry->hits += nhits;
+	entry->bytes_parsed += nbytes;
+	entry->command_time += command_time;
+	entry->scan_hist[i] += 1;
+	SpinLockRelease(&entry->mutex);
+
+	GrnStatEnd();
+}
+
+void
+GrnStatInsert(Relation index)
+{
+	volatile GrnStatEntry  *entry;
+
+	if ((entry = GrnStatBegin(index)) == NULL)
+		return;
+
+	SpinLockAcquire(&entry->mutex);
+	entry->inserts += 1;
+	SpinLockRelease(&entry->mutex);
+
+	GrnStatEnd();
+}
+
+void
+GrnStatDelete(Relation index, int64 ndeleted)
+{
+	volatile GrnStatEntry  *entry;
+
+	if ((entry = GrnStatBegin(index)) == NULL)
+		return;
+
+	SpinLockAcquire(&entry->mutex);
+	entry->deletes += ndeleted;
+	SpinLockRelease(&entry->mutex);
+
+	GrnStatEnd();
+}
+
+void
+GrnStatLockWait(Relation index, double lock_time)
+{
+	volatile GrnStatEntry  *entry;
+
+	if ((entry = GrnStatBegin(index)) == NULL)
+		return;
+
+	SpinLockAcquire(&entry->mutex);
+	entry->lock_waits += 1;
+	entry->lock_time += lock_time;
+	SpinLockRelease(&entry->mutex);
+
+	GrnStatEnd();
+}
+
+/*
+ * Find or create an entry for the index. The returned entry is protected
+ * by a shared or exclusive lock of grnStat->lock until GrnStatEnd().
+ */
+static volatile GrnStatEntry *
+GrnStatBegin(Relation index)
+{
+	GrnStatEntry   *entry;
+
+	if (grnStat == NULL || grnStatHash == NULL)
+		return NULL;
+
+	LWLockAcquire(grnStat->lock, LW_SHARED);
+
+	entry = (GrnStatEntry *) hash_search(grnStatHash, &index->rd_node, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		/* need exclusive lock to make a new entry */
+		LWLockRelease(grnStat->lock);
+		LWLockAcquire(grnStat->lock, LW_EXCLUSIVE);
+		entry = GrnStatAlloc(&index->rd_node);
+	}
+
+	return entry;
+}
+
+static void
+GrnStatEnd(void)
+{
+	LWLockRelease(grnStat->lock);
+}
+
+/*
+ * Allocate a new entry. Caller must hold an exclusive lock on grnStat->lock.
+ * When the hashtable is full, the least active entry is evicted.
+ */
+static GrnStatEntry *
+GrnStatAlloc(const RelFileNode *key)
+{
+	GrnStatEntry   *entry;
+	bool			found;
+
+	if (hash_get_num_entries(grnStatHash) >= grnStatMax)
+	{
+		HASH_SEQ_STATUS	status;
+		GrnStatEntry   *victim = NULL;
+		GrnStatEntry   *e;
+
+		hash_seq_init(&status, grnStatHash);
+		while ((e = (GrnStatEntry *) hash_seq_search(&status)) != NULL)
+		{
+			if (victim == NULL ||
+				e->scans + e->inserts + e->deletes <
+				victim->scans + victim->inserts + victim->deletes)
+				victim = e;
+		}
+		if (victim != NULL)
+			hash_search(grnStatHash, &victim->key, HASH_REMOVE, NULL);
+	}
+
+	entry = (GrnStatEntry *) hash_search(grnStatHash, key, HASH_ENTER, &found);
+	if (!found)
+	{
+		/* reset the counters, but don't clobber the key */
+		memset((char *) entry + sizeof(RelFileNode), 0,
+			   sizeof(GrnStatEntry) - sizeof(RelFileNode));
+		SpinLockInit(&entry->mutex);
+	}
+
+	return entry;
+}
+
+/**
+ * groonga.stat_indexes() : SETOF record
+ *
+ * @return	activity counters of each groonga index.
+ */
+Datum
+groonga_stat_indexes(PG_FUNCTION_ARGS)
+{
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	HASH_SEQ_STATUS		status;
+	GrnStatEntry	   *entry;
+
+	if (grnStat == NULL || grnStatHash == NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+			 errmsg("groonga: statistics require textsearch_groonga in shared_preload_libraries")));
+
+	tupstore = GrnMaterialize(fcinfo, &tupdesc);
+
+	LWLockAcquire(grnStat->lock, LW_SHARED);
+
+	hash_seq_init(&status, grnStatHash);
+	while ((entry = (GrnStatEntry *) hash_seq_search(&status)) != NULL)
+	{
+		Datum		values[12];
+		bool		nulls[12];
+		Datum		hist[GrnStatHistBuckets];
+		GrnStatEntry tmp;
+		int			i;
+
+		/* copy counters to a local variable to keep locking time short */
+		{
+			volatile GrnStatEntry *e = (volatile GrnStatEntry *) entry;
+
+			SpinLockAcquire(&e->mutex);
+			tmp = *e;
+			SpinLockRelease(&e->mutex);
+		}
+
+		for (i = 0; i < GrnStatHistBuckets; i++)
+			hist[i] = Int64GetDatumFast(tmp.scan_hist[i]);
+
+		memset(nulls, 0, sizeof(nulls));
+		i = 0;
+		values[i++] = ObjectIdGetDatum(tmp.key.spcNode);
+		values[i++] = ObjectIdGetDatum(tmp.key.dbNode);
+		values[i++] = ObjectIdGetDatum(tmp.key.relNode);
+		values[i++] = Int64GetDatumFast(tmp.scans);
+		values[i++] = Int64GetDatumFast(tmp.hits);
+		values[i++] = Int64GetDatumFast(tmp.inserts);
+		values[i++] = Int64GetDatumFast(tmp.deletes);
+		values[i++] = Int64GetDatumFast(tmp.lock_waits);
+		values[i++] = Float8GetDatumFast(tmp.lock_time);
+		values[i++] = Float8GetDatumFast(tmp.command_time);
+		values[i++] = Int64GetDatumFast(tmp.bytes_parsed);
+		values[i++] = PointerGetDatum(construct_array(hist, GrnStatHistBuckets,
+			INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(grnStat->lock);
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/**
+ * groonga.stat_reset() : void
+ */
+Datum
+groonga_stat_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS		status;
+	GrnStatEntry	   *entry;
+
+	if (grnStat == NULL || grnStatHash == NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+			 errmsg("groonga: statistics require textsearch_groonga in shared_preload_libraries")));
+
+	LWLockAcquire(grnStat->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, grnStatHash);
+	while ((entry = (GrnStatEntry *) hash_seq_search(&status)) != NULL)
+		hash_search(grnStatHash, &entry->key, HASH_REMOVE, NULL);
+
+	LWLockRelease(grnStat->lock);
+
+	PG_RETURN_VOID();
+}
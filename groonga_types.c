@@ -6,8 +6,12 @@
 
 #include "textsearch_groonga.h"
 #include "catalog/pg_type.h"
+#include "lib/stringinfo.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/datetime.h"
+#include "utils/geo_decls.h"
+#include "utils/lsyscache.h"
 #include <groonga.h>
 #include "pgut/pgut-be.h"
 
@@ -22,6 +26,7 @@ PG_FUNCTION_INFO_V1(groonga_get_float4);
 PG_FUNCTION_INFO_V1(groonga_get_float8);
 PG_FUNCTION_INFO_V1(groonga_get_timestamp);
 PG_FUNCTION_INFO_V1(groonga_get_timestamptz);
+PG_FUNCTION_INFO_V1(groonga_get_point);
 PG_FUNCTION_INFO_V1(groonga_set_text);
 PG_FUNCTION_INFO_V1(groonga_set_bpchar);
 PG_FUNCTION_INFO_V1(groonga_set_bool);
@@ -32,6 +37,8 @@ PG_FUNCTION_INFO_V1(groonga_set_float4);
 PG_FUNCTION_INFO_V1(groonga_set_float8);
 PG_FUNCTION_INFO_V1(groonga_set_timestamp);
 PG_FUNCTION_INFO_V1(groonga_set_timestamptz);
+PG_FUNCTION_INFO_V1(groonga_set_point);
+PG_FUNCTION_INFO_V1(groonga_set_array);
 
 /**
  * groonga_typeof -- map a postgres' built-in type to a groonga's type
@@ -44,8 +51,31 @@ groonga_typeof(PG_FUNCTION_ARGS)
 	Oid		typid = PG_GETARG_OID(0);
 	int		typmod = PG_GETARG_INT32(1);
 	int32	maxlen;
+	Oid		elemtype;
 
-	/* TODO: support array and record types. */
+	/* arrays are stored in vector columns of the element type */
+	if (OidIsValid(elemtype = get_element_type(typid)))
+	{
+		switch (elemtype)
+		{
+			case INT2OID:
+				return GRN_DB_INT16;
+			case INT4OID:
+				return GRN_DB_INT32;
+			case INT8OID:
+				return GRN_DB_INT64;
+			case TEXTOID:
+			case VARCHAROID:
+				return GRN_DB_SHORT_TEXT;
+			default:
+				ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("groonga: unsupported array type: %u", typid)));
+				return GRN_DB_VOID;	/* keep compiler quiet */
+		}
+	}
+
+	/* TODO: support record types. */
 	switch (typid)
 	{
 		case BOOLOID:
@@ -80,10 +110,8 @@ groonga_typeof(PG_FUNCTION_ARGS)
 					return GRN_DB_TEXT;			/* 64KB */
 			}
 			return GRN_DB_LONG_TEXT;
-#ifdef NOT_USED
 		case POINTOID:
-			return GRN_DB_TOKYO_GEO_POINT or GRN_DB_WGS84_GEO_POINT;
-#endif
+			return GRN_DB_WGS84_GEO_POINT;	/* (longitude, latitude) */
 		default:
 			ereport(ERROR,
 				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
@@ -202,6 +230,23 @@ groonga_get_timestamptz(PG_FUNCTION_ARGS)
 	return groonga_get_timestamp(fcinfo);
 }
 
+/*
+ * Points are (longitude, latitude) in degrees and are passed to groonga as
+ * "{latitude}x{longitude}" in milliseconds.
+ */
+Datum
+groonga_get_point(PG_FUNCTION_ARGS)
+{
+	Point	   *var = PG_GETARG_POINT_P(0);
+	int		   *len = (int *) PG_GETARG_POINTER(1);
+	char	   *ret = (char *) palloc(32);
+
+	*len = snprintf(ret, 32, "%dx%d",
+		GrnDegreeToMsec(var->y), GrnDegreeToMsec(var->x));
+
+	PG_RETURN_POINTER(ret);
+}
+
 Datum
 groonga_set_text(PG_FUNCTION_ARGS)
 {
@@ -305,3 +350,80 @@ groonga_set_timestamptz(PG_FUNCTION_ARGS)
 {
 	return groonga_set_timestamp(fcinfo);
 }
+
+Datum
+groonga_set_point(PG_FUNCTION_ARGS)
+{
+	grn_ctx	   *ctx = (grn_ctx *) PG_GETARG_POINTER(0);
+	grn_obj	   *obj = (grn_obj *) PG_GETARG_POINTER(1);
+	Point	   *var = PG_GETARG_POINT_P(2);
+	double		x;
+	double		y;
+
+	/*
+	 * Points out of the range of longitude and latitude are clamped to the
+	 * nearest boundary, as boxes of geo searches are. Those searches always
+	 * recheck the rows, so the points are found with their true values.
+	 */
+	x = Max(-180.0, Min(var->x, 180.0));
+	y = Max(-90.0, Min(var->y, 90.0));
+
+	GRN_GEO_POINT_SET(ctx, obj, GrnDegreeToMsec(y), GrnDegreeToMsec(x));
+	PG_RETURN_VOID();
+}
+
+Datum
+groonga_set_array(PG_FUNCTION_ARGS)
+{
+	grn_ctx	   *ctx = (grn_ctx *) PG_GETARG_POINTER(0);
+	grn_obj	   *obj = (grn_obj *) PG_GETARG_POINTER(1);
+	ArrayType  *var = PG_GETARG_ARRAYTYPE_P(2);
+	Oid			elemtype = ARR_ELEMTYPE(var);
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	int			i;
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+	deconstruct_array(var, elemtype, typlen, typbyval, typalign,
+					  &elems, &nulls, &nelems);
+
+	/* text elements make a vector, and integers make a uvector */
+	grn_obj_reinit(ctx, obj, obj->header.domain, GRN_OBJ_VECTOR);
+
+	for (i = 0; i < nelems; i++)
+	{
+		if (nulls[i])
+			continue;
+
+		switch (elemtype)
+		{
+			case INT2OID:
+				GRN_INT16_PUT(ctx, obj, DatumGetInt16(elems[i]));
+				break;
+			case INT4OID:
+				GRN_INT32_PUT(ctx, obj, DatumGetInt32(elems[i]));
+				break;
+			case INT8OID:
+				GRN_INT64_PUT(ctx, obj, DatumGetInt64(elems[i]));
+				break;
+			default:
+			{
+				text   *elem = DatumGetTextPP(elems[i]);
+
+				grn_vector_add_element(ctx, obj,
+					VARDATA_ANY(elem), VARSIZE_ANY_EXHDR(elem),
+					0, obj->header.domain);
+				break;
+			}
+		}
+	}
+
+	pfree(elems);
+	pfree(nulls);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,583 @@
+/*
+ * IDENTIFICATION
+ *	  groonga_wal.c
+ *
+ * Change log of groonga indexes for hot standbys. Groonga files are written
+ * outside of WAL, so ctids of inserted and deleted rows are recorded in
+ * pages of the postgres index relation, which are WAL-logged as full page
+ * images. Standbys apply the log to their own groonga databases before
+ * searches; see GrnReplay() in textsearch_groonga.c.
+ *
+ * Inserts are kept in backend memory and written once at the end of each
+ * statement, which is still before the commit record.
+ *
+ * Block 0 is the metapage and the log starts at block 1. The log restarts
+ * in a new generation when the index is rebuilt or the log grows larger
+ * than the index. Pages are reused from block 1 then, and standbys rebuild
+ * their groonga objects from the heap.
+ */
+#include "postgres.h"
+
+#include "textsearch_groonga.h"
+#include "access/heapam.h"
+#include "access/xlog.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "storage/bufmgr.h"
+#include "storage/bufpage.h"
+#include "storage/fd.h"
+#include "storage/lmgr.h"
+#include "tcop/utility.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include <unistd.h>
+#include "pgut/pgut-be.h"
+
+#define GRN_WAL_MAGIC		0x47524E57	/* "GRNW" */
+#define GRN_WAL_METAPAGE	0
+
+typedef struct GrnWalMeta
+{
+	uint32		magic;
+	uint32		generation;		/* starts with 1; incremented when the log
+								 * restarts */
+	BlockNumber	tail;			/* last block of the log, or 0 if empty */
+} GrnWalMeta;
+
+typedef struct GrnWalPageOpaque
+{
+	uint32		generation;		/* generation in which the page was filled */
+} GrnWalPageOpaque;
+
+#define GrnWalPageGetMeta(page) \
+	((GrnWalMeta *) PageGetContents(page))
+#define GrnWalPageGetOpaque(page) \
+	((GrnWalPageOpaque *) PageGetSpecialPointer(page))
+#define GrnWalPageGetRecords(page) \
+	((GrnWalRecord *) PageGetContents(page))
+#define GrnWalPageGetCount(page) \
+	((int) ((((PageHeader) (page))->pd_lower - MAXALIGN(SizeOfPageHeaderData)) / sizeof(GrnWalRecord)))
+#define GrnWalRecordsPerPage \
+	((int) ((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - \
+			 MAXALIGN(sizeof(GrnWalPageOpaque))) / sizeof(GrnWalRecord)))
+
+/* records of an index not written yet */
+typedef struct GrnWalPending
+{
+	Oid				relid;
+	Oid				relNode;	/* relfilenode the records belong to */
+	int				num;
+	GrnWalRecord	records[GrnWalRecordsPerPage];
+} GrnWalPending;
+
+static List	   *grnWalPendings = NIL;	/* list of GrnWalPending */
+
+#if PG_VERSION_NUM >= 90000
+static ExecutorEnd_hook_type	prev_ExecutorEnd_hook = NULL;
+static ProcessUtility_hook_type	prev_ProcessUtility_hook = NULL;
+
+static void GrnWalExecutorEnd(QueryDesc *queryDesc);
+static void GrnWalProcessUtility(Node *parsetree, const char *queryString, ParamListInfo params, bool isTopLevel, DestReceiver *dest, char *completionTag);
+#endif
+static GrnWalPending *GrnWalGetPending(Relation index, bool create);
+static void GrnWalWrite(Relation index, GrnWalPending *pending);
+static Buffer GrnWalLockMeta(Relation index);
+static Buffer GrnWalGetBuffer(Relation index, BlockNumber blkno);
+static void GrnWalWriteMeta(Relation index, Buffer buf, uint32 generation);
+static void GrnWalLogPage(Relation index, Buffer buf);
+static char *GrnWalPositionPath(Relation index);
+
+/*
+ * GrnWalInit -- called from _PG_init.
+ */
+void
+GrnWalInit(void)
+{
+#if PG_VERSION_NUM >= 90000
+	prev_ExecutorEnd_hook = ExecutorEnd_hook;
+	ExecutorEnd_hook = GrnWalExecutorEnd;
+	prev_ProcessUtility_hook = ProcessUtility_hook;
+	ProcessUtility_hook = GrnWalProcessUtility;
+#endif
+}
+
+/*
+ * GrnWalAppend -- add a change to the log. Changes are written to pages
+ * at GrnWalFlush(), at the end of the statement, or when a page worth of
+ * changes are accumulated.
+ */
+void
+GrnWalAppend(Relation index, uint16 op, ItemPointer ctid)
+{
+	GrnWalPending  *pending = GrnWalGetPending(index, true);
+
+	pending->records[pending->num].ctid = *ctid;
+	pending->records[pending->num].op = op;
+	pending->num++;
+
+	if (pending->num >= GrnWalRecordsPerPage)
+		GrnWalWrite(index, pending);
+}
+
+/*
+ * GrnWalFlush -- write pending changes of the index to the log.
+ */
+void
+GrnWalFlush(Relation index)
+{
+	GrnWalPending  *pending = GrnWalGetPending(index, false);
+
+	if (pending != NULL)
+		GrnWalWrite(index, pending);
+}
+
+/*
+ * GrnWalFlushAll -- write pending changes of all indexes to the log.
+ * Indexes are still locked by the transaction that changed them.
+ */
+void
+GrnWalFlushAll(void)
+{
+	ListCell   *cell;
+
+	foreach (cell, grnWalPendings)
+	{
+		GrnWalPending  *pending = (GrnWalPending *) lfirst(cell);
+		Relation		index;
+
+		if (pending->num == 0)
+			continue;
+
+		/*
+		 * The index might have been dropped or rebuilt after a failed
+		 * subtransaction; the records are useless then.
+		 */
+		index = try_relation_open(pending->relid, RowExclusiveLock);
+		if (index == NULL)
+		{
+			pending->num = 0;
+			continue;
+		}
+		if (index->rd_node.relNode == pending->relNode)
+			GrnWalWrite(index, pending);
+		else
+			pending->num = 0;
+		relation_close(index, RowExclusiveLock);
+	}
+}
+
+/*
+ * GrnWalReset -- discard pending changes at the end of transactions.
+ * Changes are left only when the transaction failed. Standbys might have
+ * stale rows then, but their ctids are checked with the heap anyway.
+ */
+void
+GrnWalReset(void)
+{
+	list_free_deep(grnWalPendings);
+	grnWalPendings = NIL;
+}
+
+#if PG_VERSION_NUM >= 90000
+static void
+GrnWalExecutorEnd(QueryDesc *queryDesc)
+{
+	if (prev_ExecutorEnd_hook)
+		prev_ExecutorEnd_hook(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+
+	GrnWalFlushAll();
+}
+
+/* COPY inserts rows without the executor */
+static void
+GrnWalProcessUtility(Node *parsetree, const char *queryString,
+					 ParamListInfo params, bool isTopLevel,
+					 DestReceiver *dest, char *completionTag)
+{
+	if (prev_ProcessUtility_hook)
+		prev_ProcessUtility_hook(parsetree, queryString, params,
+								 isTopLevel, dest, completionTag);
+	else
+		standard_ProcessUtility(parsetree, queryString, params,
+								isTopLevel, dest, completionTag);
+
+	GrnWalFlushAll();
+}
+#endif
+
+/*
+ * Returns pending changes of the index, or NULL if none and not create.
+ */
+static GrnWalPending *
+GrnWalGetPending(Relation index, bool create)
+{
+	GrnWalPending  *pending;
+	ListCell	   *cell;
+	MemoryContext	oldcontext;
+
+	foreach (cell, grnWalPendings)
+	{
+		pending = (GrnWalPending *) lfirst(cell);
+		if (pending->relNode == index->rd_node.relNode)
+			return pending;
+	}
+
+	if (!create)
+		return NULL;
+
+	/* released by GrnWalReset even on error */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	pending = (GrnWalPending *) palloc(sizeof(GrnWalPending));
+	pending->relid = RelationGetRelid(index);
+	pending->relNode = index->rd_node.relNode;
+	pending->num = 0;
+	grnWalPendings = lappend(grnWalPendings, pending);
+	MemoryContextSwitchTo(oldcontext);
+
+	return pending;
+}
+
+/*
+ * Write pending changes to the log. Each modified page is logged once, and
+ * the metapage is logged only when the log moves to the next page.
+ */
+static void
+GrnWalWrite(Relation index, GrnWalPending *pending)
+{
+	Buffer		metabuf;
+	GrnWalMeta *meta;
+	int			done = 0;
+
+	if (pending->num == 0)
+		return;
+
+	/* the exclusive lock on the metapage serializes writers */
+	metabuf = GrnWalLockMeta(index);
+	meta = GrnWalPageGetMeta(BufferGetPage(metabuf));
+
+	while (done < pending->num)
+	{
+		Buffer		buf = InvalidBuffer;
+		Page		page;
+		int			count = 0;
+		int			n;
+		bool		newpage;
+
+		if (meta->tail != 0)
+		{
+			buf = GrnWalGetBuffer(index, meta->tail);
+			count = GrnWalPageGetCount(BufferGetPage(buf));
+		}
+
+		newpage = (meta->tail == 0 || count >= GrnWalRecordsPerPage);
+		if (newpage)
+		{
+			if (BufferIsValid(buf))
+				UnlockReleaseBuffer(buf);
+			buf = GrnWalGetBuffer(index, meta->tail + 1);
+			count = 0;
+		}
+
+		page = BufferGetPage(buf);
+		n = Min(GrnWalRecordsPerPage - count, pending->num - done);
+
+		START_CRIT_SECTION();
+
+		if (newpage)
+		{
+			PageInit(page, BLCKSZ, sizeof(GrnWalPageOpaque));
+			((PageHeader) page)->pd_lower = MAXALIGN(SizeOfPageHeaderData);
+			GrnWalPageGetOpaque(page)->generation = meta->generation;
+		}
+		memcpy(GrnWalPageGetRecords(page) + count, pending->records + done,
+			   n * sizeof(GrnWalRecord));
+		((PageHeader) page)->pd_lower += n * sizeof(GrnWalRecord);
+		MarkBufferDirty(buf);
+		GrnWalLogPage(index, buf);
+
+		/* the page must be logged before the metapage pointing to it */
+		if (newpage)
+		{
+			meta->tail = BufferGetBlockNumber(buf);
+			MarkBufferDirty(metabuf);
+			GrnWalLogPage(index, metabuf);
+		}
+
+		END_CRIT_SECTION();
+
+		UnlockReleaseBuffer(buf);
+		done += n;
+	}
+
+	UnlockReleaseBuffer(metabuf);
+	pending->num = 0;
+}
+
+/*
+ * GrnWalRestart -- start a new generation of the log, creating the
+ * metapage if not exists.
+ */
+void
+GrnWalRestart(Relation index)
+{
+	Buffer			buf = GrnWalLockMeta(index);
+	GrnWalMeta	   *meta = GrnWalPageGetMeta(BufferGetPage(buf));
+	GrnWalPending  *pending;
+
+	GrnWalWriteMeta(index, buf, meta->generation + 1);
+	UnlockReleaseBuffer(buf);
+
+	if ((pending = GrnWalGetPending(index, false)) != NULL)
+		pending->num = 0;
+}
+
+/*
+ * GrnWalLatest -- the end of the log. Returns false if the index has no log.
+ */
+bool
+GrnWalLatest(Relation index, GrnWalPosition *pos)
+{
+	Buffer		buf;
+	Page		page;
+	GrnWalMeta *meta;
+	BlockNumber	tail;
+
+	if (RelationGetNumberOfBlocks(index) == 0)
+		return false;
+
+	buf = ReadBuffer(index, GRN_WAL_METAPAGE);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	meta = GrnWalPageGetMeta(BufferGetPage(buf));
+	if (meta->magic != GRN_WAL_MAGIC)
+		elog(ERROR, "groonga: index \"%s\" has no change log",
+			RelationGetRelationName(index));
+	pos->generation = meta->generation;
+	tail = meta->tail;
+	UnlockReleaseBuffer(buf);
+
+	pos->nrecords = 0;
+	if (tail == 0)
+		return true;
+
+	buf = ReadBuffer(index, tail);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	if (GrnWalPageGetOpaque(page)->generation == pos->generation)
+		pos->nrecords = (int64) (tail - 1) * GrnWalRecordsPerPage +
+						GrnWalPageGetCount(page);
+	UnlockReleaseBuffer(buf);
+
+	return true;
+}
+
+/*
+ * GrnWalRead -- read at most max changes following pos, and advance pos.
+ * Returns 0 at the end of the log, or when the log has restarted in another
+ * generation.
+ */
+int
+GrnWalRead(Relation index, GrnWalPosition *pos, GrnWalRecord *records, int max)
+{
+	GrnWalPosition	latest;
+	BlockNumber		blkno;
+	Buffer			buf;
+	Page			page;
+	int				slot;
+	int				n = 0;
+
+	/* don't read beyond the tail, where pages might be left by a crash */
+	if (!GrnWalLatest(index, &latest) ||
+		latest.generation != pos->generation ||
+		latest.nrecords <= pos->nrecords)
+		return 0;
+
+	blkno = 1 + pos->nrecords / GrnWalRecordsPerPage;
+	slot = pos->nrecords % GrnWalRecordsPerPage;
+
+	buf = ReadBuffer(index, blkno);
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buf);
+	if (GrnWalPageGetOpaque(page)->generation == pos->generation)
+	{
+		n = Min(GrnWalPageGetCount(page) - slot, max);
+		n = Min(n, latest.nrecords - pos->nrecords);
+		if (n > 0)
+		{
+			memcpy(records, GrnWalPageGetRecords(page) + slot,
+				   n * sizeof(GrnWalRecord));
+			pos->nrecords += n;
+		}
+	}
+	UnlockReleaseBuffer(buf);
+
+	return Max(n, 0);
+}
+
+/*
+ * GrnWalReadPosition -- the position applied to the local groonga database.
+ * Returns false if the log has never been applied.
+ */
+bool
+GrnWalReadPosition(Relation index, GrnWalPosition *pos)
+{
+	char	   *path = GrnWalPositionPath(index);
+	FILE	   *fp;
+	bool		found = false;
+
+	if ((fp = AllocateFile(path, PG_BINARY_R)) != NULL)
+	{
+		found = (fread(pos, sizeof(GrnWalPosition), 1, fp) == 1);
+		FreeFile(fp);
+	}
+	else if (errno != ENOENT)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("groonga: could not open file \"%s\": %m", path)));
+
+	pfree(path);
+	return found;
+}
+
+/*
+ * GrnWalWritePosition -- save the applied position, or remove it if pos is
+ * NULL. The file is replaced atomically.
+ */
+void
+GrnWalWritePosition(Relation index, const GrnWalPosition *pos)
+{
+	char	   *path = GrnWalPositionPath(index);
+	char		tmppath[MAXPGPATH];
+	FILE	   *fp;
+
+	if (pos == NULL)
+	{
+		if (unlink(path) != 0 && errno != ENOENT)
+			ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("groonga: could not remove file \"%s\": %m", path)));
+		pfree(path);
+		return;
+	}
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	if ((fp = AllocateFile(tmppath, PG_BINARY_W)) == NULL)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("groonga: could not create file \"%s\": %m", tmppath)));
+	if (fwrite(pos, sizeof(GrnWalPosition), 1, fp) != 1 || FreeFile(fp))
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("groonga: could not write file \"%s\": %m", tmppath)));
+	if (rename(tmppath, path) != 0)
+		ereport(ERROR,
+			(errcode_for_file_access(),
+			 errmsg("groonga: could not rename file \"%s\" to \"%s\": %m",
+				tmppath, path)));
+
+	pfree(path);
+}
+
+/*
+ * Returns the metapage locked in exclusive mode. An empty metapage is
+ * created at the first call for the index.
+ */
+static Buffer
+GrnWalLockMeta(Relation index)
+{
+	Buffer		buf;
+
+	if (RelationGetNumberOfBlocks(index) == 0)
+	{
+		LockRelationForExtension(index, ExclusiveLock);
+		if (RelationGetNumberOfBlocks(index) == 0)
+		{
+			buf = ReadBuffer(index, P_NEW);
+			Assert(BufferGetBlockNumber(buf) == GRN_WAL_METAPAGE);
+			LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+			UnlockRelationForExtension(index, ExclusiveLock);
+			GrnWalWriteMeta(index, buf, 1);
+			return buf;
+		}
+		UnlockRelationForExtension(index, ExclusiveLock);
+	}
+
+	buf = ReadBuffer(index, GRN_WAL_METAPAGE);
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	if (GrnWalPageGetMeta(BufferGetPage(buf))->magic != GRN_WAL_MAGIC)
+		elog(ERROR, "groonga: index \"%s\" has no change log",
+			RelationGetRelationName(index));
+
+	return buf;
+}
+
+/*
+ * Returns a block of the log locked in exclusive mode, extending the
+ * relation if needed. Caller must hold the lock on the metapage.
+ */
+static Buffer
+GrnWalGetBuffer(Relation index, BlockNumber blkno)
+{
+	Buffer		buf;
+
+	if (blkno < RelationGetNumberOfBlocks(index))
+		buf = ReadBuffer(index, blkno);
+	else
+	{
+		LockRelationForExtension(index, ExclusiveLock);
+		buf = ReadBuffer(index, P_NEW);
+		UnlockRelationForExtension(index, ExclusiveLock);
+		if (BufferGetBlockNumber(buf) != blkno)
+			elog(ERROR, "groonga: unexpected block %u in change log of index \"%s\"",
+				BufferGetBlockNumber(buf), RelationGetRelationName(index));
+	}
+
+	LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+	return buf;
+}
+
+static void
+GrnWalWriteMeta(Relation index, Buffer buf, uint32 generation)
+{
+	Page		page = BufferGetPage(buf);
+	GrnWalMeta *meta;
+
+	START_CRIT_SECTION();
+
+	PageInit(page, BLCKSZ, 0);
+	meta = GrnWalPageGetMeta(page);
+	meta->magic = GRN_WAL_MAGIC;
+	meta->generation = generation;
+	meta->tail = 0;
+	((PageHeader) page)->pd_lower =
+		MAXALIGN(SizeOfPageHeaderData) + sizeof(GrnWalMeta);
+
+	MarkBufferDirty(buf);
+	GrnWalLogPage(index, buf);
+
+	END_CRIT_SECTION();
+}
+
+static void
+GrnWalLogPage(Relation index, Buffer buf)
+{
+#if PG_VERSION_NUM >= 80400
+	log_newpage(&index->rd_node, MAIN_FORKNUM,
+				BufferGetBlockNumber(buf), BufferGetPage(buf));
+#else
+	log_newpage(&index->rd_node, BufferGetBlockNumber(buf), BufferGetPage(buf));
+#endif
+}
+
+static char *
+GrnWalPositionPath(Relation index)
+{
+	char	   *relfile = relpathperm(index->rd_node, MAIN_FORKNUM);
+	char	   *path = palloc(strlen(relfile) + 9);
+
+	sprintf(path, "%s.grn.wal", relfile);
+	pfree(relfile);
+
+	return path;
+}
@@ -8,6 +8,12 @@
 #include "fmgr.h"
 #include "utils/tuplestore.h"
 
+#if PG_VERSION_NUM < 80400
+#include "executor/instrument.h"
+#else
+#include "portability/instr_time.h"
+#endif
+
 #ifndef PGDLLEXPORT
 
 #ifndef WIN32
@@ -140,6 +146,10 @@ extern void tuplestore_putvalues(Tuplestorestate *state, TupleDesc tdesc,
 
 #define CStringGetTextDatum(s)		PointerGetDatum(cstring_to_text(s))
 #define TextDatumGetCString(d)		text_to_cstring((text *) DatumGetPointer(d))
+#define FLOAT8PASSBYVAL				false
+#define Int64GetDatumFast(X)		Int64GetDatum(X)
+#define Float8GetDatumFast(X)		Float8GetDatum(X)
+#define INSTR_TIME_GET_MILLISEC(t)	(INSTR_TIME_GET_DOUBLE(t) * 1000.0)
 
 #endif
 
@@ -159,6 +169,20 @@ extern void tuplestore_putvalues(Tuplestorestate *state, TupleDesc tdesc,
 	SearchSysCache(cacheId, key1, 0, 0, 0)
 #endif
 
+#if PG_VERSION_NUM >= 90100
+/* check_hook was added in 9.1 */
+#define DefineCustomBoolVariable(name, short_desc, long_desc, valueAddr, bootValue, context, flags, assign_hook, show_hook) \
+	DefineCustomBoolVariable((name), (short_desc), (long_desc), (valueAddr), (bootValue), (context), (flags), NULL, (assign_hook), (show_hook))
+#define DefineCustomIntVariable(name, short_desc, long_desc, valueAddr, bootValue, minValue, maxValue, context, flags, assign_hook, show_hook) \
+	DefineCustomIntVariable((name), (short_desc), (long_desc), (valueAddr), (bootValue), (minValue), (maxValue), (context), (flags), NULL, (assign_hook), (show_hook))
+#define DefineCustomRealVariable(name, short_desc, long_desc, valueAddr, bootValue, minValue, maxValue, context, flags, assign_hook, show_hook) \
+	DefineCustomRealVariable((name), (short_desc), (long_desc), (valueAddr), (bootValue), (minValue), (maxValue), (context), (flags), NULL, (assign_hook), (show_hook))
+#define DefineCustomStringVariable(name, short_desc, long_desc, valueAddr, bootValue, context, flags, assign_hook, show_hook) \
+	DefineCustomStringVariable((name), (short_desc), (long_desc), (valueAddr), (bootValue), (context), (flags), NULL, (assign_hook), (show_hook))
+#define DefineCustomEnumVariable(name, short_desc, long_desc, valueAddr, bootValue, options, context, flags, assign_hook, show_hook) \
+	DefineCustomEnumVariable((name), (short_desc), (long_desc), (valueAddr), (bootValue), (options), (context), (flags), NULL, (assign_hook), (show_hook))
+#endif
+
 #if PG_VERSION_NUM < 80300
 #define RelationSetNewRelfilenode(rel, xid) \
 	setNewRelfilenode((rel))
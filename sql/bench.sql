@@ -1,53 +1,54 @@
 SET client_encoding = utf8;
-
-CREATE TABLE words (
-    word text
-);
-
-INSERT INTO words VALUES('PostgreSQL');
-INSERT INTO words VALUES('カリフォルニア');
-INSERT INTO words VALUES('大学バークレイ校');
-INSERT INTO words VALUES('コンピュータ');
-INSERT INTO words VALUES('サイエンス');
-INSERT INTO words VALUES('学科');
-INSERT INTO words VALUES('開発');
-INSERT INTO words VALUES('POSTGRES');
-INSERT INTO words VALUES('データベース');
-INSERT INTO words VALUES('管理システム');
-INSERT INTO words VALUES('後からいくつか');
-INSERT INTO words VALUES('商用データベース');
-INSERT INTO words VALUES('利用');
-INSERT INTO words VALUES('多くの概念');
-INSERT INTO words VALUES('先駆');
-
-CREATE TABLE bench (
-    id integer,
-    sentence text
-);
-
-CREATE FUNCTION random_word() RETURNS text AS
-$$
-SELECT word FROM words LIMIT 1 OFFSET (
-  SELECT floor(random() * n)
-    FROM (SELECT count(*) AS n FROM words) AS w)
-$$
-LANGUAGE sql STABLE;
-
-CREATE FUNCTION random_sentence() RETURNS text AS
-$$
-SELECT array_to_string(array_agg(word), 'の') || 'でした。'
-  FROM (SELECT word FROM words WHERE random() > 0.5 ORDER BY random()) AS t
-$$
-LANGUAGE sql STABLE;
-
-INSERT INTO bench
-  SELECT i, random_sentence() FROM generate_series(1, 10000) AS s(i);
-ALTER TABLE bench ADD PRIMARY KEY (id);
-CREATE INDEX idx_bench ON bench USING groonga (sentence);
-ANALYZE bench;
-
-CREATE TABLE pgbench_branches (dummy integer);
-
-\! pgbench -n contrib_regression -f data/bench.sql -T5 -c8 > /dev/null
-VACUUM bench;
-\! pgbench -n contrib_regression -f data/bench.sql -T5 -c8 > /dev/null
+SET client_min_messages = warning;
+\set ECHO none
+\i bench/setup.sql
+\set ECHO all
+RESET client_min_messages;
+
+-- vocabulary
+SELECT lang, count(*), count(DISTINCT word) FROM bench_words GROUP BY lang ORDER BY lang;
+SELECT lang, rank, word FROM bench_words WHERE rank IN (1, 2, 20, 21, 400, 10000) ORDER BY lang, rank;
+
+-- documents are reproducible
+SELECT bench_load(1000, 1);
+SELECT count(*) FROM bench_docs
+ WHERE body <> bench_document(id, 1)
+    OR length(body) = 0;
+SELECT bench_document(1, 1) = bench_document(1, 2) AS same_seed;
+
+-- more common words appear in more documents
+SELECT (SELECT count(*) FROM bench_docs WHERE body LIKE '%' || bench_word(0, 1) || '%') >
+	   (SELECT count(*) FROM bench_docs WHERE body LIKE '%' || bench_word(0, 1000) || '%') AS zipfian;
+
+CREATE INDEX bench_docs_body ON bench_docs USING groonga (body);
+SELECT bench_generate(1001, 1100, 1);
+ANALYZE bench_docs;
+
+-- every workload gives the same answer with and without the index
+SET enable_indexscan = off;
+SET enable_bitmapscan = off;
+CREATE TABLE bench_answers AS
+SELECT lang, rank,
+	   (SELECT count(*) FROM bench_docs WHERE body %% bench_word(lang, rank)) AS hits
+  FROM (SELECT 0 AS lang UNION ALL SELECT 1) AS l,
+	   (SELECT 1 AS rank UNION ALL SELECT 100 UNION ALL SELECT 5000) AS r;
+
+SET enable_seqscan = off;
+SET enable_indexscan = on;
+SELECT count(*) FROM bench_answers
+ WHERE hits <> (SELECT count(*) FROM bench_docs WHERE body %% bench_word(lang, rank));
+
+SET enable_indexscan = off;
+SET enable_bitmapscan = on;
+SELECT count(*) FROM bench_answers
+ WHERE hits <> (SELECT count(*) FROM bench_docs WHERE body %% bench_word(lang, rank));
+
+SET enable_indexscan = on;
+SET enable_bitmapscan = off;
+DELETE FROM bench_docs WHERE id % 10 = 0;
+VACUUM bench_docs;
+SELECT count(*) FROM bench_docs WHERE body %% bench_word(0, 1) AND id % 10 = 0;
+
+RESET enable_seqscan;
+RESET enable_indexscan;
+RESET enable_bitmapscan;
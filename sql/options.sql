@@ -0,0 +1,130 @@
+SET client_min_messages = warning;
+
+CREATE TABLE opt (id integer, body text);
+INSERT INTO opt VALUES (1, 'abc');
+INSERT INTO opt VALUES (2, 'bcab');
+INSERT INTO opt VALUES (3, 'ABC');
+INSERT INTO opt VALUES (4, 'x abc y');
+
+-- invalid options
+CREATE INDEX opt_idx ON opt USING groonga (body) WITH (foo=bar);
+CREATE INDEX opt_idx ON opt USING groonga (body) WITH (tokenizer=nosuch);
+CREATE INDEX opt_idx ON opt USING groonga (body) WITH (normalizer=nfkc);
+CREATE INDEX opt_idx ON opt USING groonga (body) WITH (with_position=maybe);
+
+-- without positions, results of %% are rechecked
+CREATE INDEX opt_idx ON opt USING groonga (body) WITH (with_position=off, lexicon=hash);
+SET enable_seqscan = off;
+SET enable_indexscan = on;
+SET enable_bitmapscan = off;
+SELECT id FROM opt WHERE body %% 'abc' ORDER BY id;
+SET enable_indexscan = off;
+SET enable_bitmapscan = on;
+SELECT id FROM opt WHERE body %% 'abc' ORDER BY id;
+DROP INDEX opt_idx;
+
+-- delimiter tokenizer without normalization
+CREATE INDEX opt_idx ON opt USING groonga (body) WITH (tokenizer=delimit, normalizer=none);
+SELECT reloptions FROM pg_class WHERE relname = 'opt_idx';
+SET enable_indexscan = on;
+SET enable_bitmapscan = off;
+SELECT id FROM opt WHERE body %% 'abc' ORDER BY id;
+SELECT groonga.optimize('opt_idx') > 0 AS optimized;
+SELECT id FROM opt WHERE body %% 'abc' ORDER BY id;
+
+-- ctid-ordered row keys
+DROP INDEX opt_idx;
+CREATE INDEX opt_idx ON opt USING groonga (body) WITH (rowkey=btree);
+CREATE INDEX opt_idx ON opt USING groonga (body) WITH (rowkey=pat);
+SELECT id FROM opt WHERE body %% 'abc' ORDER BY id;
+DELETE FROM opt WHERE id = 1;
+VACUUM opt;
+SELECT id FROM opt WHERE body %% 'abc' ORDER BY id;
+INSERT INTO opt VALUES (5, 'abcabc');
+SELECT id FROM opt WHERE body %% 'abc' ORDER BY id;
+
+-- index without stored values
+DROP INDEX opt_idx;
+CREATE INDEX opt_idx ON opt USING groonga (body) WITH (compress=gzip);
+CREATE INDEX opt_idx ON opt USING groonga (body) WITH (store=off);
+SELECT id FROM opt WHERE body %% 'abc' ORDER BY id;
+SELECT id FROM opt WHERE body @@ 'abc' ORDER BY id;
+SELECT groonga.count('opt_idx', groonga.query('abc', 'body'), false);
+SELECT groonga.optimize('opt_idx');
+DELETE FROM opt WHERE id = 5;
+VACUUM opt;
+INSERT INTO opt VALUES (6, 'xyz');
+SELECT id FROM opt WHERE body %% 'abc' ORDER BY id;
+SELECT id FROM opt WHERE body %% 'xyz' ORDER BY id;
+-- other operators don't narrow the search, and every row is rechecked
+SELECT id FROM opt WHERE body = 'xyz' ORDER BY id;
+SELECT id FROM opt WHERE body <> 'xyz' ORDER BY id;
+SELECT id FROM opt WHERE body &^ 'X' ORDER BY id;
+
+-- VACUUM visits only blocks not marked in the visibility map
+CREATE TABLE vac (id integer, body text);
+INSERT INTO vac SELECT i, 'word' || (i % 10) FROM generate_series(1, 2000) AS s(i);
+VACUUM vac;
+CREATE INDEX vac_pat ON vac USING groonga (body) WITH (rowkey=pat);
+CREATE INDEX vac_hash ON vac USING groonga (body) WITH (rowkey=hash);
+DELETE FROM vac WHERE id IN (5, 6, 1500);
+SET client_min_messages = debug1;
+VACUUM vac;
+SET client_min_messages = warning;
+INSERT INTO vac VALUES (5, 'other');
+INSERT INTO vac VALUES (6, 'other');
+INSERT INTO vac VALUES (1500, 'other');
+SELECT c.relname,
+	   groonga.count(c.oid, groonga.query('word5', 'body'), false) AS word5,
+	   groonga.count(c.oid, groonga.query('word0', 'body'), false) AS word0,
+	   groonga.count(c.oid, groonga.query('other', 'body'), false) AS other
+  FROM pg_class c WHERE c.relname IN ('vac_pat', 'vac_hash') ORDER BY c.relname;
+DROP TABLE vac;
+
+-- groonga.work_mem limits search results held by the backend
+CREATE TABLE mem (id integer, body text);
+INSERT INTO mem SELECT i, 'word' || (i % 10) FROM generate_series(1, 2000) AS s(i);
+CREATE INDEX mem_idx ON mem USING groonga (body);
+SET groonga.work_mem = 1;
+SELECT count(*) FROM mem WHERE body %% 'word5';
+RESET groonga.work_mem;
+SELECT count(*) FROM mem WHERE body %% 'word5';
+SELECT results = 0 AS idle, peak_results > 0 AS used FROM groonga.memory_usage();
+DROP TABLE mem;
+
+-- wal=on logs changes in the index relation for hot standbys
+CREATE TABLE walt (id integer, body text);
+INSERT INTO walt VALUES (1, 'abc');
+INSERT INTO walt VALUES (2, 'abc xyz');
+CREATE INDEX walt_idx ON walt USING groonga (body) WITH (wal=maybe);
+CREATE INDEX walt_idx ON walt USING groonga (body) WITH (wal=on);
+INSERT INTO walt VALUES (3, 'xyz');
+DELETE FROM walt WHERE id = 2;
+VACUUM walt;
+SELECT id FROM walt WHERE body %% 'xyz' ORDER BY id;
+SELECT id FROM walt WHERE body %% 'abc' ORDER BY id;
+SELECT pg_relation_size('walt_idx') > 0 AS logged;
+-- replaying the log into fresh groonga objects gives the same rows, including
+-- deletes of dead tuples found by index scans
+INSERT INTO walt VALUES (4, 'abc');
+DELETE FROM walt WHERE id = 4;
+SELECT id FROM walt WHERE body %% 'abc' ORDER BY id;
+SELECT groonga.count('walt_idx', groonga.query('abc', 'body'), false) AS before;
+SELECT groonga.wal_replay('walt_idx') > 0 AS replayed;
+SELECT groonga.count('walt_idx', groonga.query('abc', 'body'), false) AS after;
+SELECT id FROM walt WHERE body %% 'abc' ORDER BY id;
+SELECT id FROM walt WHERE body %% 'xyz' ORDER BY id;
+-- inserts are logged at the end of each statement, including COPY
+INSERT INTO walt SELECT i, 'multi' FROM generate_series(10, 12) AS s(i);
+COPY walt FROM stdin;
+13	multi
+\.
+SELECT groonga.wal_replay('walt_idx') > 0 AS replayed;
+SELECT id FROM walt WHERE body %% 'multi' ORDER BY id;
+DROP TABLE walt;
+
+RESET enable_seqscan;
+RESET enable_indexscan;
+RESET enable_bitmapscan;
+DROP TABLE opt;
+RESET client_min_messages;
@@ -41,6 +41,11 @@ SELECT groonga.command(
   FROM pg_class c
  WHERE c.oid = 'grnidx'::regclass;
 
+SELECT * FROM groonga.command_stream((
+	SELECT 'select --table t' || c.relfilenode || ' --query title:@YYY --sortby _key --output_columns _key,title'
+	  FROM pg_class c
+	 WHERE c.oid = 'grnidx'::regclass));
+
 --
 -- high-level interface (index scan)
 --
@@ -133,3 +138,155 @@ SELECT id, groonga.score(tableoid, ctid), title, body
 RESET enable_seqscan;
 RESET enable_indexscan;
 RESET enable_bitmapscan;
+
+--
+-- drilldown
+--
+CREATE TABLE facet (id integer, category integer, body text);
+INSERT INTO facet SELECT i, i % 3, CASE WHEN i % 2 = 1 THEN 'apple' ELSE 'banana' END
+  FROM generate_series(1, 31) AS s(i);
+CREATE INDEX facet_idx ON facet USING groonga (category, body);
+SELECT * FROM groonga.drilldown('facet_idx', groonga.query('apple', 'body'), 'category');
+SELECT * FROM groonga.drilldown('facet_idx', groonga.query('apple', 'body'), 'category', 1);
+SELECT * FROM groonga.drilldown('facet_idx', groonga.query('apple', 'body'), 'title');
+-- the query cannot be evaluated with store=off
+DROP INDEX facet_idx;
+CREATE INDEX facet_idx ON facet USING groonga (category, body) WITH (store=off);
+SELECT * FROM groonga.drilldown('facet_idx', groonga.query('apple', 'body'), 'category');
+DROP TABLE facet;
+
+--
+-- snippet and highlight
+--
+SELECT groonga.highlight('PostgreSQL & groonga', 'groonga');
+SELECT groonga.highlight('PostgreSQL & groonga', 'mysql');
+SELECT groonga.snippet('PostgreSQL & groonga', 'groonga postgresql');
+
+--
+-- LIKE, ILIKE and regular expressions
+--
+CREATE TABLE pattern (id integer, body text);
+INSERT INTO pattern VALUES (1, 'PostgreSQL database');
+INSERT INTO pattern VALUES (2, 'groonga full-text search');
+INSERT INTO pattern VALUES (3, '100% pure');
+CREATE INDEX pattern_idx ON pattern USING groonga (body groonga.text_like_ops)
+  WITH (tokenizer=substring);
+SET enable_seqscan = off;
+SELECT id FROM pattern WHERE body LIKE '%tab%' ORDER BY id;
+SELECT id FROM pattern WHERE body LIKE '%TAB%' ORDER BY id;
+SELECT id FROM pattern WHERE body ILIKE '%TAB%' ORDER BY id;
+SELECT id FROM pattern WHERE body LIKE 'gr_onga%text%' ORDER BY id;
+SELECT id FROM pattern WHERE body LIKE E'%0\\%%' ORDER BY id;
+SELECT id FROM pattern WHERE body LIKE '%' ORDER BY id;
+SELECT id FROM pattern WHERE body ~ 'Post(gre)?SQL' ORDER BY id;
+SELECT id FROM pattern WHERE body ~ 'full-?text +search$' ORDER BY id;
+SELECT id FROM pattern WHERE body ~ 'data|pure' ORDER BY id;
+SELECT id FROM pattern WHERE body ~ E'[0-9]+\\% p' ORDER BY id;
+SELECT id FROM pattern WHERE body ~ 'SEARCH' ORDER BY id;
+SELECT id FROM pattern WHERE body ~* 'SEARCH' ORDER BY id;
+RESET enable_seqscan;
+DROP TABLE pattern;
+--
+-- prefix search and completion
+--
+CREATE TABLE words (id integer, name text);
+INSERT INTO words VALUES (1, 'PostgreSQL');
+INSERT INTO words VALUES (2, 'Postfix');
+INSERT INTO words VALUES (3, 'pgAdmin');
+INSERT INTO words VALUES (4, 'ＰＯＳＴ office');
+CREATE INDEX words_idx ON words USING groonga (name) WITH (tokenizer=none);
+SET enable_seqscan = off;
+SELECT id FROM words WHERE name &^ 'post' ORDER BY id;
+SELECT id FROM words WHERE name &^ 'PG' ORDER BY id;
+SELECT id FROM words WHERE name &^ 'postgresql database' ORDER BY id;
+RESET enable_seqscan;
+SELECT * FROM groonga.complete('words_idx', 'POST');
+SELECT * FROM groonga.complete('words_idx', 'p', 2);
+-- tokenized lexicons don't narrow prefix searches; same rows as seq scans
+DROP INDEX words_idx;
+INSERT INTO words VALUES (5, '全文検索エンジン');
+CREATE INDEX words_idx ON words USING groonga (name);
+SET enable_seqscan = off;
+SELECT id FROM words WHERE name &^ 'postg' ORDER BY id;
+SELECT id FROM words WHERE name &^ 'ＰＯＳＴ off' ORDER BY id;
+SELECT id FROM words WHERE name &^ '全文検索' ORDER BY id;
+RESET enable_seqscan;
+SET enable_indexscan = off;
+SET enable_bitmapscan = off;
+SELECT id FROM words WHERE name &^ 'postg' ORDER BY id;
+SELECT id FROM words WHERE name &^ 'ＰＯＳＴ off' ORDER BY id;
+SELECT id FROM words WHERE name &^ '全文検索' ORDER BY id;
+RESET enable_indexscan;
+RESET enable_bitmapscan;
+DROP TABLE words;
+--
+-- similarity ordering
+--
+CREATE TABLE similars (id integer, body text);
+INSERT INTO similars VALUES (1, 'PostgreSQL database');
+INSERT INTO similars VALUES (2, 'Postgres SQL');
+INSERT INTO similars VALUES (3, 'groonga fulltext search');
+INSERT INTO similars VALUES (4, 'MySQL database');
+CREATE INDEX similars_idx ON similars USING groonga (body) WITH (tokenizer=substring);
+SELECT 'abc' <~> 'ABC'::text AS same, 'abc' <~> 'xyz'::text AS different;
+SET enable_seqscan = off;
+SELECT id, round((body <~> 'PostgreSQL')::numeric, 3) AS distance
+  FROM similars ORDER BY body <~> 'PostgreSQL' LIMIT 3;
+-- rows not sharing any bigram follow the nearest ones
+SELECT id, round((body <~> 'database')::numeric, 3) AS distance
+  FROM similars ORDER BY body <~> 'database';
+-- groonga.max_hits limits only searches narrowed by conditions
+SET groonga.max_hits = 2;
+SELECT id FROM similars ORDER BY body <~> 'database';
+SELECT groonga.count('similars_idx', groonga.query('sql', 'body')) AS exact;
+SELECT id FROM similars WHERE body %% 'sql' ORDER BY id;
+RESET groonga.max_hits;
+SELECT id, round((body <~> 'mysql')::numeric, 3) AS distance
+  FROM similars WHERE body %% 'database' ORDER BY body <~> 'mysql';
+RESET enable_seqscan;
+DROP TABLE similars;
+--
+-- geo search
+--
+CREATE TABLE places (id integer, name text, loc point);
+INSERT INTO places VALUES (1, 'Tokyo ramen', '(139.767,35.681)');
+INSERT INTO places VALUES (2, 'Shinjuku ramen', '(139.700,35.690)');
+INSERT INTO places VALUES (3, 'Ueno ramen', '(139.777,35.714)');
+INSERT INTO places VALUES (4, 'Oshiage ramen', '(139.813,35.710)');
+INSERT INTO places VALUES (5, 'Osaka ramen', '(135.500,34.693)');
+INSERT INTO places VALUES (6, 'Sapporo soba', '(141.354,43.062)');
+CREATE INDEX places_idx ON places USING groonga (name, loc);
+INSERT INTO places VALUES (7, 'Nowhere', '(200,0)');
+SET enable_seqscan = off;
+SELECT id FROM places WHERE loc <@ box '((139,35),(140,36))' ORDER BY id;
+SELECT id FROM places WHERE loc <@ circle '((139.767,35.681),0.05)' ORDER BY id;
+-- out of range points are indexed at the boundary and rechecked
+SELECT id FROM places WHERE loc <@ box '((190,-1),(210,1))' ORDER BY id;
+SELECT id FROM places WHERE loc <@ box '((185,-1),(195,1))' ORDER BY id;
+SELECT id FROM places
+ WHERE name @@ groonga.query('ramen', 'name', NULL,
+                             'geo_in_circle(loc, "128451600x503161200", 5000)')
+ ORDER BY id;
+RESET enable_seqscan;
+DROP TABLE places;
+--
+-- arrays
+--
+CREATE TABLE tagged (id integer, tags text[], nums int4[]);
+INSERT INTO tagged VALUES (1, '{postgres,groonga}', '{1,2}');
+INSERT INTO tagged VALUES (2, '{postgres,mysql}', '{2,3}');
+INSERT INTO tagged VALUES (3, '{groonga,mroonga,NULL}', '{3}');
+INSERT INTO tagged VALUES (4, '{"full text"}', NULL);
+CREATE INDEX tagged_idx ON tagged USING groonga (tags, nums);
+SET enable_seqscan = off;
+SELECT id FROM tagged WHERE tags && '{groonga,mysql}' ORDER BY id;
+SELECT id FROM tagged WHERE tags @> '{postgres,groonga}' ORDER BY id;
+SELECT id FROM tagged WHERE tags && '{"full text"}' ORDER BY id;
+SELECT id FROM tagged WHERE tags && '{}' ORDER BY id;
+SELECT id FROM tagged WHERE nums @> '{2}' AND tags && '{mysql}' ORDER BY id;
+SET groonga.max_hits = 2;
+SELECT id FROM tagged WHERE tags && '{postgres}' ORDER BY id;
+SELECT id FROM tagged WHERE tags && '{groonga,mysql}' ORDER BY id;
+RESET groonga.max_hits;
+RESET enable_seqscan;
+DROP TABLE tagged;
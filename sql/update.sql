@@ -24,4 +24,9 @@ UPDATE item SET counter = counter + 1;
 SELECT * FROM item WHERE name %% 'foo';
 UPDATE item SET counter = counter + 1;
 SELECT * FROM item WHERE name %% 'foo';
+SELECT groonga.optimize('item_idx') > 0 AS optimized;
+SELECT groonga.prewarm('item_idx') > 0 AS prewarmed;
+SELECT * FROM item WHERE name %% 'foo';
+SELECT phase, duration >= 0 AS valid, detail LIKE '% hits' AS hits FROM groonga.explain('item_idx', 'foo');
+SELECT groonga.count('item_idx', groonga.query('foo', 'name')) AS exact, groonga.count('item_idx', groonga.query('foo', 'name'), false) >= 1 AS approx, groonga.count('item_idx', groonga.query('bar', 'name')) AS bar;
 RESET enable_seqscan;
@@ -6,19 +6,39 @@
 
 #include "textsearch_groonga.h"
 #include "access/genam.h"
+#include "access/heapam.h"
 #include "access/relscan.h"
+#if PG_VERSION_NUM >= 80400
+#include "access/visibilitymap.h"
+#endif
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "catalog/catalog.h"
 #include "catalog/index.h"
 #include "catalog/pg_tablespace.h"
+#include "catalog/pg_type.h"
+#include "executor/executor.h"
+#include "funcapi.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
+#include "optimizer/cost.h"
+#include "storage/bufmgr.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
 #include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/geo_decls.h"
+#include "utils/guc.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/selfuncs.h"
-#include "utils/syscache.h"
+#if PG_VERSION_NUM >= 80400
+#include "utils/snapmgr.h"
+#endif
+#include <ctype.h>
+#include <sys/time.h>
 #include <groonga.h>
 #include "pgut/pgut-be.h"
 
@@ -31,6 +51,62 @@ typedef struct GrnBuildState
 	StringInfoData	buf;
 } GrnBuildState;
 
+/* elapsed time of each phase in GrnBeginScan, in msec */
+typedef struct GrnScanTiming
+{
+	double		build;		/* build a groonga command from scan keys */
+	double		search;		/* grn_ctx_send; search and output in groonga */
+	double		transfer;	/* grn_ctx_recv and copy of the result */
+	double		parse;		/* parse the result into hits */
+	double		sort;		/* sort hits by ctid */
+} GrnScanTiming;
+
+/* index options; WITH (...) in CREATE INDEX */
+typedef enum GrnLexiconType
+{
+	GrnLexiconPat,
+	GrnLexiconDat,
+	GrnLexiconHash
+} GrnLexiconType;
+
+typedef enum GrnRowKeyType
+{
+	GrnRowKeyHash,
+	GrnRowKeyPat
+} GrnRowKeyType;
+
+typedef enum GrnCompressType
+{
+	GrnCompressNone,
+	GrnCompressZlib,
+	GrnCompressLzo,
+	GrnCompressLz4,
+	GrnCompressZstd
+} GrnCompressType;
+
+typedef struct GrnOptions
+{
+	int32			vl_len_;		/* varlena header (do not touch directly!) */
+	char			tokenizer[NAMEDATALEN];	/* or "none" */
+	bool			normalize;
+	bool			with_position;
+	GrnLexiconType	lexicon;
+	GrnRowKeyType	rowkey;
+	bool			store;			/* store values of full-text columns */
+	GrnCompressType	compress;		/* compression of variable-length columns */
+	bool			wal;			/* log changes for hot standbys */
+} GrnOptions;
+
+/* heap access to apply the change log on hot standbys */
+typedef struct GrnReplayState
+{
+	Relation		heap;
+	IndexInfo	   *indexInfo;
+	EState		   *estate;
+	TupleTableSlot *slot;
+	List		   *predicate;
+} GrnReplayState;
+
 typedef struct GrnScanDesc
 {
 	grn_ctx			   *ctx;
@@ -40,33 +116,177 @@ typedef struct GrnScanDesc
 	Oid					tableoid;
 	ItemPointerData	   *ctid;		/* array[num] */
 	int32			   *score;		/* array[num] */
+	bool				recheck;	/* results of %% need recheck */
+	char			   *command;	/* groonga command used in the scan */
+	int64				nbytes;		/* length of the command result */
+	GrnScanTiming		timing;
+	int64				prefetch;	/* next ctid to be prefetched */
+	BlockNumber			prefetch_block;	/* last prefetched heap block */
+	int					prefetch_pages;	/* blocks prefetched ahead of cursor */
+	int64			   *order;		/* array[num] of hits in return order,
+									 * or NULL to return in ctid order */
+	int64				reserved;	/* bytes counted in groonga.work_mem */
+	bool				partial;	/* only the nearest hits of ORDER BY <~>
+									 * are loaded; see GrnOrderNearest */
+	int					max_hits;	/* groonga.max_hits, or 0 if unlimited */
 
 	struct GrnScanDesc *next;
 } GrnScanDesc;
 
+/* called for each chunk of a command result */
+typedef void (*GrnRecvCallback)(const char *str, unsigned int len, void *arg);
+
+typedef struct GrnAppendState
+{
+	StringInfoData		buf;
+	bool				overflow;	/* exceeded groonga.work_mem */
+	int64				reserved;	/* bytes counted in groonga.work_mem */
+} GrnAppendState;
+
+typedef struct GrnChunkState
+{
+	Tuplestorestate	   *tupstore;
+	TupleDesc			tupdesc;
+	int32				seq;
+	StringInfoData		partial;	/* incomplete character at the end of
+									 * the last chunk */
+} GrnChunkState;
+
+/* compiled snippet conditions cached in fn_extra */
+typedef struct GrnSnipCache
+{
+	uint32		generation;		/* grnSnipGeneration when opened */
+	int			flags;
+	int			width;
+	int			max_results;
+	Oid			indexid;
+	char	   *keywords;
+	char	   *open_tag;
+	char	   *close_tag;
+	grn_snip   *snip;
+} GrnSnipCache;
+
+typedef struct GrnHit
+{
+	int64		key;
+	int32		score;
+} GrnHit;
+
+/* a hit ranked by the distance of ORDER BY <~> */
+typedef struct GrnRankedHit
+{
+	int64		key;			/* rowkey or index of the hit */
+	double		distance;
+} GrnRankedHit;
+
+/* sorted and unique bigrams of a normalized string */
+typedef struct GrnGrams
+{
+	int			num;
+	char	  **grams;
+} GrnGrams;
+
+/* longer keys are not searched in groonga; all rows become candidates */
+#define GrnSimilarMaxGrams	256
+
+/* rows sharing most bigrams with the key, ranked first by ORDER BY <~> */
+#define GrnSimilarCandidates	1000
+
+/* cost of computing the distance of a candidate, in cpu_operator_cost */
+#define GrnSimilarCost		10.0
+
+/* size of reads by groonga.prewarm() */
+#define GrnPrewarmChunkSize	(1024 * 1024)
+
 static void GrnBuildCallback(Relation index, HeapTuple htup, Datum *values, bool *nulls, bool tupleIsAlive, void *context);
-static GrnScanDesc *GrnBeginScan(Relation index, int nkeys, const ScanKeyData keys[/*nkeys*/]);
+static GrnScanDesc *GrnBeginScan(Relation index, int nkeys, const ScanKeyData keys[/*nkeys*/], int norderbys, const ScanKeyData orderbys[/*norderbys*/], bool limited);
+static GrnScanDesc *GrnBeginIndexScan(IndexScanDesc scan);
+static void GrnSearch(Relation index, GrnScanDesc *desc, GrnScanTiming *timing, instr_time *lap);
+static void GrnOrderHits(Relation index, GrnScanDesc *desc, const ScanKeyData *orderby);
+static bool GrnOrderNearest(Relation index, GrnScanDesc *desc, const ScanKeyData *orderby);
+static void GrnOrderRest(IndexScanDesc scan, GrnScanDesc *desc);
+static bool GrnCanOrderNearest(const GrnOptions *options);
+static GrnScanDesc *GrnQueryScan(Relation index, Datum query, bool limited);
+static void GrnParseHits(GrnScanDesc *desc, text *res, GrnScanTiming *timing, instr_time *lap);
 static void GrnEndScan(GrnScanDesc *desc);
+static void GrnPrefetch(IndexScanDesc scan, GrnScanDesc *desc);
+static double GrnScanTotalTime(const GrnScanTiming *timing);
+static double GrnLap(instr_time *lap);
+static int GrnHitCmp(const void *lhs, const void *rhs);
+static void GrnInit(void);
 static grn_ctx *GrnOpen(void);
-static void GrnCommand(grn_ctx *ctx, const char *query, text **res);
+static void GrnCommand(grn_ctx *ctx, const char *query, text **res, GrnScanTiming *timing);
+static void GrnCommandRecv(grn_ctx *ctx, const char *query, GrnRecvCallback callback, void *arg, GrnScanTiming *timing);
+static void GrnAppendChunk(const char *str, unsigned int len, void *arg);
+static void GrnFreeResult(text *res);
+static void GrnPutChunk(const char *str, unsigned int len, void *arg);
+static void GrnPutText(GrnChunkState *state, const char *str, int len);
 static void GrnInsert(grn_ctx *ctx, Relation index, grn_obj *table, Datum values[], bool nulls[], ItemPointer ctid);
 static void GrnDelete(grn_ctx *ctx, grn_obj *table, ItemPointer ctid);
-static grn_obj *GrnCreate(grn_ctx *ctx, Relation index);
+static int64 GrnReplay(grn_ctx *ctx, Relation index);
+static bool GrnWalEnabled(Relation index);
+#if PG_VERSION_NUM >= 90000
+static void GrnReplayBegin(GrnReplayState *state, Relation index);
+static void GrnReplayEnd(GrnReplayState *state);
+static void GrnReplayInsert(grn_ctx *ctx, Relation index, grn_obj *table, GrnReplayState *state, ItemPointer ctid);
+static void GrnReplayTuple(grn_ctx *ctx, Relation index, grn_obj *table, GrnReplayState *state, HeapTuple tuple, ItemPointer ctid, Buffer buf);
+static void GrnRebuild(grn_ctx *ctx, Relation index, GrnReplayState *state);
+#endif
+static grn_obj *GrnCreate(grn_ctx *ctx, Relation index, const char *suffix);
 static void GrnDrop(grn_ctx *ctx, Relation index);
+static int64 GrnOptimize(grn_ctx *ctx, Relation index);
+static double GrnFragmentation(grn_ctx *ctx, Relation index);
 static grn_obj *GrnCreateTable(grn_ctx *ctx, const char *name, const char *path, grn_obj_flags flags, grn_obj *type);
 static grn_obj *GrnCreateColumn(grn_ctx *ctx, grn_obj *table, const char *name, const char *path, grn_obj_flags flags, grn_obj *type);
 static int32 GrnScore(const GrnScanDesc *desc, ItemPointer ctid);
 static grn_obj *GrnLookup(grn_ctx *ctx, const char *name, int elevel);
 static grn_obj *GrnLookupTable(grn_ctx *ctx, Relation index, int elevel);
 static grn_obj *GrnLookupIndex(grn_ctx *ctx, Relation index, int elevel);
-static void GrnLock(Relation index, LOCKMODE mode);
-static void GrnUnlock(Relation index, LOCKMODE mode);
+static grn_obj *GrnLookupGeoIndex(grn_ctx *ctx, Relation index, int elevel);
+static grn_obj *GrnLookupVectorIndex(grn_ctx *ctx, Relation index, int attnum, int elevel);
+static void appendGeoPoint(StringInfo buf, double x, double y);
+static Relation GrnOpenIndex(Oid relid, LOCKMODE mode);
+static void GrnAppendConjunction(StringInfo buf, bool *needs_terminator);
+static bool GrnCanFindSubstring(const char *tokenizer);
+static bool GrnCanFindPrefix(const GrnOptions *options);
+static List *GrnLikeLiterals(const char *str, int len);
+static List *GrnRegexLiterals(const char *str, int len);
+static void GrnRegexFlush(List **literals, StringInfo literal);
+static int GrnRegexSkipBracket(const char *str, int len, int n);
+static int64 GrnCountHits(Relation index, Datum query);
+static int64 GrnCountVisible(Relation index, Datum query);
+static bool GrnJsonExpect(const char **p, char c);
+static pg_wchar GrnJsonHex4(const char *s);
+static char *GrnJsonScalar(const char **p);
+static void GrnJsonSkip(const char **p);
+static grn_snip *GrnSnipOpen(FunctionCallInfo fcinfo, int flags, int width, int max_results, const char *keywords, const char *open_tag, const char *close_tag, Oid indexid);
+static void GrnSnipCloseAll(void);
+static void GrnBigrams(grn_ctx *ctx, const char *str, int len, GrnGrams *grams);
+static void GrnFreeGrams(GrnGrams *grams);
+static double GrnDistance(const GrnGrams *lhs, const GrnGrams *rhs);
+static void appendHtmlEscaped(StringInfo buf, const char *str, int len);
+static GrnOptions *GrnParseOptions(Datum reloptions, bool validate);
+static const GrnOptions *GrnGetOptions(Relation index);
+static bool GrnParseBool(const char *name, const char *value);
+static grn_obj_flags GrnCompressFlags(GrnCompressType compress);
+static bool GrnIsTextColumn(Relation index, int attnum);
+static bool GrnIsVectorColumn(Relation index, int attnum);
+static void GrnCheckSelectPrivilege(Relation index);
+static void GrnCheckQuerySupported(Relation index);
+static void GrnLock(Relation index, LOCKMODE mode, LOCKTAG *tag);
+static void GrnUnlock(const LOCKTAG *tag, LOCKMODE mode);
+static void GrnLockTag(Relation index, LOCKTAG *tag);
+static int GrnObjectNames(Relation index, const char *suffix, char (*names)[NAMEDATALEN]);
+static bool GrnRenameObject(grn_ctx *ctx, const char *from, const char *to);
+static void GrnRemoveObjects(grn_ctx *ctx, char (*names)[NAMEDATALEN], int nnames);
 static grn_encoding GrnGetEncoding(void);
 static void appendStringEscaped(StringInfo buf, const char *str, int len);
 static void appendTextEscaped(StringInfo buf, const text *t);
 static int64 CtidToInt64(ItemPointer ctid);
 static ItemPointerData Int64ToCtid(int64 n);
 static IndexBulkDeleteResult *GrnBulkDeleteResult(IndexVacuumInfo *info, grn_ctx *ctx, grn_obj *table);
+static double GrnBulkDeleteCursor(grn_ctx *ctx, Relation index, grn_obj *table, grn_table_cursor *cursor, IndexBulkDeleteCallback callback, void *callback_state);
+static int GrnDirtyRanges(IndexVacuumInfo *info, BlockNumber **ranges, BlockNumber *ndirty);
 static void GrnXactCallback(XactEvent event, void *arg);
 static void GrnOnProcExit(int code, Datum arg);
 static grn_builtin_type GrnGetType(Relation index, int attnum);
@@ -77,8 +297,22 @@ PG_FUNCTION_INFO_V1(groonga_query_in);
 PG_FUNCTION_INFO_V1(groonga_query);
 PG_FUNCTION_INFO_V1(groonga_purge);
 PG_FUNCTION_INFO_V1(groonga_command);
+PG_FUNCTION_INFO_V1(groonga_command_stream);
+PG_FUNCTION_INFO_V1(groonga_optimize);
+PG_FUNCTION_INFO_V1(groonga_prewarm);
+PG_FUNCTION_INFO_V1(groonga_wal_replay);
+PG_FUNCTION_INFO_V1(groonga_explain);
+PG_FUNCTION_INFO_V1(groonga_count);
+PG_FUNCTION_INFO_V1(groonga_drilldown);
+PG_FUNCTION_INFO_V1(groonga_complete);
+PG_FUNCTION_INFO_V1(groonga_snippet);
+PG_FUNCTION_INFO_V1(groonga_highlight);
 PG_FUNCTION_INFO_V1(groonga_contains);
 PG_FUNCTION_INFO_V1(groonga_contains_bpchar);
+PG_FUNCTION_INFO_V1(groonga_prefix);
+PG_FUNCTION_INFO_V1(groonga_prefix_bpchar);
+PG_FUNCTION_INFO_V1(groonga_distance);
+PG_FUNCTION_INFO_V1(groonga_distance_bpchar);
 PG_FUNCTION_INFO_V1(groonga_match);
 PG_FUNCTION_INFO_V1(groonga_score);
 PG_FUNCTION_INFO_V1(groonga_insert);
@@ -94,7 +328,15 @@ PG_FUNCTION_INFO_V1(groonga_costestimate);
 PG_FUNCTION_INFO_V1(groonga_options);
 
 static grn_ctx		grnContext;
+static bool			grnInitialized = false;
 static GrnScanDesc *grnScanDescs = NULL;	/* list of GrnScanDesc */
+static List	   *grnSnips = NIL;			/* grn_snip opened in transaction */
+static uint32	grnSnipGeneration = 0;	/* incremented when snips are closed */
+
+/* GUC variables */
+static double		grnOptimizeThreshold = 0.0;
+static int			grnLogMinDuration = -1;
+static int			grnMaxHits = 0;
 
 #ifdef HAVE_LONG_INT_64
 #define atoi64		atol
@@ -107,13 +349,49 @@ static GrnScanDesc *grnScanDescs = NULL;	/* list of GrnScanDesc */
 void
 _PG_init(void)
 {
-	if (grn_init())
-		elog(ERROR, "grn_init() failed");
-	if (grn_ctx_init(&grnContext, GRN_CTX_USE_QL | GRN_CTX_BATCH_MODE))
-		elog(ERROR, "grn_ctx_init() failed");
-
-	on_proc_exit(GrnOnProcExit, 0);
+	/* groonga itself is initialized at the first use; see GrnOpen */
 	RegisterXactCallback(GrnXactCallback, NULL);
+
+	DefineCustomRealVariable("groonga.optimize_threshold",
+		"Fraction of dead lexicon entries at which VACUUM optimizes the index.",
+		"Zero disables automatic optimization.",
+		&grnOptimizeThreshold,
+		0.0,
+		0.0,
+		1.0,
+		PGC_USERSET,
+		0,
+		NULL,
+		NULL);
+
+	DefineCustomIntVariable("groonga.log_min_duration",
+		"Sets the minimum execution time above which groonga searches will be logged.",
+		"Zero prints all searches. -1 turns this feature off.",
+		&grnLogMinDuration,
+		-1,
+		-1,
+		INT_MAX,
+		PGC_SUSET,
+		GUC_UNIT_MS,
+		NULL,
+		NULL);
+
+	DefineCustomIntVariable("groonga.max_hits",
+		"Sets the maximum number of rows a groonga search can match.",
+		"Searches matching more rows fail. Zero disables the limit.",
+		&grnMaxHits,
+		0,
+		0,
+		INT_MAX,
+		PGC_USERSET,
+		0,
+		NULL,
+		NULL);
+
+	GrnStatInit();
+	GrnCacheInit();
+	GrnMemoryInit();
+	GrnWalInit();
 }
 
 Datum
@@ -224,483 +502,1860 @@ groonga_command(PG_FUNCTION_ARGS)
 	 * 自由クエリではどのオブジェクトのロックが必要なのか判断できないため。
 	 */
 	ctx = GrnOpen();
-	GrnCommand(ctx, query, &res);
+	GrnCommand(ctx, query, &res, NULL);
 
 	if (res == NULL)
 		PG_RETURN_NULL();
-	else
-		PG_RETURN_POINTER(res);
+
+	/* no longer held by groonga functions */
+	GrnMemoryRelease(VARSIZE(res) - VARHDRSZ);
+	PG_RETURN_POINTER(res);
 }
 
-static bool
-contains_internal(
-	const char *doc, unsigned doclen,
-	const char *key, unsigned keylen)
+/**
+ * groonga.command_stream(query) : SETOF (seq, chunk)
+ *
+ * Same as groonga.command, but each chunk received from groonga is put
+ * into a tuplestore as soon as it arrives. The tuplestore spills to disk
+ * beyond work_mem, so a large result is not held in memory twice.
+ *
+ * @param	query		groonga QL.
+ * @return	chunks of query result in the order received.
+ */
+Datum
+groonga_command_stream(PG_FUNCTION_ARGS)
 {
-	grn_ctx	   *ctx = GrnOpen();
-	grn_query  *q;
-	grn_rc		rc;
-	int			found;
-	int			score;
+	char		   *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	grn_ctx		   *ctx;
+	GrnChunkState	state;
 
-	q = grn_query_open(ctx, key, keylen, GRN_OP_AND, 32);
-	rc = grn_query_scan(ctx, q, &doc, &doclen, 1,
-			GRN_QUERY_SCAN_NORMALIZE, &found, &score);
-	if (rc)
+	state.tupstore = GrnMaterialize(fcinfo, &state.tupdesc);
+	state.seq = 0;
+	initStringInfo(&state.partial);
+
+	ctx = GrnOpen();
+	GrnCommandRecv(ctx, query, GrnPutChunk, &state, NULL);
+
+	/* the result ended in the middle of a character */
+	if (state.partial.len > 0)
 	{
-		char *err = pstrdup(ctx->errbuf);
-		grn_query_close(ctx, q);
-		elog(ERROR, "grn_query_scan() failed: %s", err);
+		pg_verify_mbstr(GetDatabaseEncoding(),
+						state.partial.data, state.partial.len, false);
+		GrnPutText(&state, state.partial.data, state.partial.len);
 	}
-	grn_query_close(ctx, q);
+	pfree(state.partial.data);
 
-	/*
-	 * FIXME: We cannot return score values with groonga.score() on seq scan.
-	 */
-	return found && score;
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(state.tupstore);
+
+	return (Datum) 0;
 }
 
 /**
- * groonga.contains(doc text, key text) : bool
+ * groonga.optimize(index regclass) : bigint
+ *
+ * Rewrite the groonga table and index into fresh segments, dropping
+ * lexicon entries and garbage left by deleted rows.
+ *
+ * @param	index		groonga index to be optimized.
+ * @return	number of rows in the rewritten table.
  */
 Datum
-groonga_contains(PG_FUNCTION_ARGS)
+groonga_optimize(PG_FUNCTION_ARGS)
 {
-	text	   *doc = PG_GETARG_TEXT_PP(0);
-	text	   *key = PG_GETARG_TEXT_PP(1);
+	Oid			relid = PG_GETARG_OID(0);
+	Relation	index;
+	int64		nrows;
 
-	PG_RETURN_BOOL(contains_internal(
-		VARDATA_ANY(doc), VARSIZE_ANY_EXHDR(doc),
-		VARDATA_ANY(key), VARSIZE_ANY_EXHDR(key)));
+	index = GrnOpenIndex(relid, AccessShareLock);
+
+	if (!pg_class_ownercheck(relid, GetUserId()))
+		aclcheck_error(ACLCHECK_NOT_OWNER, ACL_KIND_CLASS,
+					   RelationGetRelationName(index));
+
+	nrows = GrnOptimize(GrnOpen(), index);
+
+	index_close(index, AccessShareLock);
+
+	PG_RETURN_INT64(nrows);
 }
 
 /**
- * groonga.contains(doc bpchar, key bpchar) : bool
+ * groonga.prewarm(index regclass) : bigint
+ *
+ * Read all files of the index into the OS cache, so that the first searches
+ * after a restart don't wait for page faults on the mapped files.
+ *
+ * @param	index		groonga index to be loaded.
+ * @return	number of bytes read.
  */
 Datum
-groonga_contains_bpchar(PG_FUNCTION_ARGS)
+groonga_prewarm(PG_FUNCTION_ARGS)
 {
-	BpChar	   *doc = PG_GETARG_BPCHAR_PP(0);
-	BpChar	   *key = PG_GETARG_BPCHAR_PP(1);
+	Oid				relid = PG_GETARG_OID(0);
+	Relation		index;
+	grn_ctx		   *ctx;
+	grn_obj		   *table;
+	const char	   *path;
+	const char	   *prefix;
+	char			dir[MAXPGPATH];
+	DIR			   *dirdesc;
+	struct dirent  *de;
+	char		   *buffer;
+	int64			nbytes = 0;
+	LOCKTAG			tag;
+
+	index = GrnOpenIndex(relid, AccessShareLock);
+	GrnCheckSelectPrivilege(index);
+	ctx = GrnOpen();
 
-	PG_RETURN_BOOL(contains_internal(
-		VARDATA_ANY(doc), bpchar_size(doc),
-		VARDATA_ANY(key), bpchar_size(key)));
+	/* the files must not be swapped by GrnOptimize while reading */
+	GrnLock(index, AccessShareLock, &tag);
+
+	table = GrnLookupTable(ctx, index, ERROR);
+	if ((path = grn_obj_path(ctx, table)) == NULL)
+		elog(ERROR, "grn_obj_path: %s", ctx->errbuf);
+
+	/* names of all files for the index start with the name of the table */
+	strlcpy(dir, path, MAXPGPATH);
+	get_parent_directory(dir);
+	prefix = last_dir_separator(path);
+	prefix = (prefix != NULL ? prefix + 1 : path);
+
+	buffer = palloc(GrnPrewarmChunkSize);
+	dirdesc = AllocateDir(dir);
+	while ((de = ReadDir(dirdesc, dir)) != NULL)
+	{
+		char	file[MAXPGPATH];
+		FILE   *fp;
+		size_t	nread;
+
+		if (strncmp(de->d_name, prefix, strlen(prefix)) != 0)
+			continue;
+
+		snprintf(file, sizeof(file), "%s/%s", dir, de->d_name);
+		if ((fp = AllocateFile(file, PG_BINARY_R)) == NULL)
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("groonga: could not open file \"%s\": %m", file)));
+		while ((nread = fread(buffer, 1, GrnPrewarmChunkSize, fp)) > 0)
+		{
+			CHECK_FOR_INTERRUPTS();
+			nbytes += nread;
+		}
+		if (ferror(fp))
+			ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("groonga: could not read file \"%s\": %m", file)));
+		FreeFile(fp);
+	}
+	FreeDir(dirdesc);
+	pfree(buffer);
+
+	GrnUnlock(&tag, AccessShareLock);
+	index_close(index, AccessShareLock);
+
+	PG_RETURN_INT64(nbytes);
 }
 
 /**
- * groonga.match(doc, query) : bool
+ * groonga.wal_replay(index regclass) : bigint
+ *
+ * Rebuild the groonga objects of the index as a new hot standby does: from
+ * the heap and then with the whole change log of the current generation.
+ *
+ * @param	index		groonga index with wal=on.
+ * @return	number of applied records.
  */
 Datum
-groonga_match(PG_FUNCTION_ARGS)
+groonga_wal_replay(PG_FUNCTION_ARGS)
 {
-#ifdef NOT_USED
-	text	   *doc = PG_GETARG_TEXT_PP(0);
-	text	   *query = PG_GETARG_TEXT_PP(1);
-#endif
+	Oid				relid = PG_GETARG_OID(0);
+	Relation		index;
+	GrnWalPosition	pos;
+	int64			napplied;
 
-	elog(ERROR,
-		"groonga: operator @@ (doc, query) is available only in index scans");
+	index = GrnOpenIndex(relid, AccessShareLock);
 
-	PG_RETURN_BOOL(false);
+	if (!pg_class_ownercheck(relid, GetUserId()))
+		aclcheck_error(ACLCHECK_NOT_OWNER, ACL_KIND_CLASS,
+					   RelationGetRelationName(index));
+
+	if (!GrnGetOptions(index)->wal)
+		ereport(ERROR,
+			(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+			 errmsg("groonga: index \"%s\" has no change log",
+				RelationGetRelationName(index)),
+			 errhint("Set wal=on and REINDEX.")));
+
+	/* pretend that the log has never been applied */
+	pos.generation = 0;
+	pos.nrecords = 0;
+	GrnWalWritePosition(index, &pos);
+	napplied = GrnReplay(GrnOpen(), index);
+	GrnWalWritePosition(index, NULL);
+
+	index_close(index, AccessShareLock);
+
+	PG_RETURN_INT64(napplied);
 }
 
 /**
- * groonga.score(tableoid, ctid) : int32
+ * groonga.explain(index regclass, query groonga.query) : SETOF record
  *
- * @param	tableoid	tableoid of the heap
- * @param	ctid		ctid of heap tuple
- * @return	score of the row in the query.
+ * Run a search with the index and report elapsed time of each phase.
+ *
+ * @param	index		groonga index to be searched.
+ * @param	query		query given to @@ operator.
+ * @return	(phase, duration in msec, detail)
  */
 Datum
-groonga_score(PG_FUNCTION_ARGS)
+groonga_explain(PG_FUNCTION_ARGS)
 {
-	Oid				tableoid = PG_GETARG_OID(0);
-	ItemPointer		ctid = (ItemPointer) DatumGetPointer(PG_GETARG_DATUM(1));
-	int32			score = 0;
-	GrnScanDesc	   *desc;
+	Oid					relid = PG_GETARG_OID(0);
+	Datum				query = PG_GETARG_DATUM(1);
+	Relation			index;
+	GrnScanDesc		   *desc;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	int					i;
+	char				bytes[64];
+	char				hits[64];
 
-	/*
-	 * FIXME: 行が更新されていた場合、このままでは正しく動作しない。
-	 * 渡される ctid はインデックスされた ctid から更新鎖を辿ったものである
-	 * 可能性があり、ctid の一致条件だけでは判定に失敗する場合がある。
-	 * この際、新ctid => 旧ctid という辿り方はできないため、鎖を検索するのも難しい。
-	 * ctid の代わりに、更新しても変化しない一意の ROWID が必要かもしれない。
-	 */
-	for (desc = grnScanDescs; desc; desc = desc->next)
+	tupstore = GrnMaterialize(fcinfo, &tupdesc);
+
+	index = GrnOpenIndex(relid, AccessShareLock);
+	GrnCheckSelectPrivilege(index);
+
+	desc = GrnQueryScan(index, query, true);
+
+	snprintf(bytes, sizeof(bytes), INT64_FORMAT " bytes", desc->nbytes);
+	snprintf(hits, sizeof(hits), INT64_FORMAT " hits", desc->num);
+
+	for (i = 0; i < 6; i++)
 	{
-		if (desc->tableoid == tableoid)
-			score += GrnScore(desc, ctid);
+		static const char *phases[] =
+		{
+			"build", "search", "transfer", "parse", "sort", "total"
+		};
+		const double	durations[] =
+		{
+			desc->timing.build,
+			desc->timing.search,
+			desc->timing.transfer,
+			desc->timing.parse,
+			desc->timing.sort,
+			GrnScanTotalTime(&desc->timing)
+		};
+		const char	   *details[] =
+		{
+			desc->command, NULL, bytes, hits, NULL, NULL
+		};
+		Datum			values[3];
+		bool			nulls[3];
+
+		values[0] = CStringGetTextDatum(phases[i]);
+		values[1] = Float8GetDatum(durations[i]);
+		values[2] = (details[i] ? CStringGetTextDatum(details[i]) : (Datum) 0);
+		nulls[0] = nulls[1] = false;
+		nulls[2] = (details[i] == NULL);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
 	}
 
-	PG_RETURN_INT32(score);
-}
-
-/**
- * groonga.insert() -- aminsert
- */
-Datum
-groonga_insert(PG_FUNCTION_ARGS)
-{
-	Relation	index = (Relation) PG_GETARG_POINTER(0);
-	Datum	   *values = (Datum *) PG_GETARG_POINTER(1);
-	bool	   *nulls = (bool *) PG_GETARG_POINTER(2);
-	ItemPointer	ctid = (ItemPointer) PG_GETARG_POINTER(3);
-#ifdef NOT_USED
-	Relation	heap = (Relation) PG_GETARG_POINTER(4);
-	bool		checkUnique = PG_GETARG_BOOL(5);
-#endif
-	grn_ctx	   *ctx = GrnOpen();
-	grn_obj	   *table = GrnLookupTable(ctx, index, ERROR);
+	GrnEndScan(desc);
+	index_close(index, AccessShareLock);
 
-	GrnLock(index, ExclusiveLock);
-	GrnInsert(ctx, index, table, values, nulls, ctid);
-	GrnUnlock(index, ExclusiveLock);
+	tuplestore_donestoring(tupstore);
 
-	PG_RETURN_BOOL(true);
+	return (Datum) 0;
 }
 
 /**
- * groonga.beginscan() -- ambeginscan
+ * groonga.count(index regclass, query groonga.query, exact bool) : bigint
+ *
+ * @param	index		groonga index to be searched.
+ * @param	query		query given to @@ operator.
+ * @param	exact		if false, the number of hits in the index is returned
+ *						without checking visibility of heap tuples.
+ * @return	number of matched rows.
  */
 Datum
-groonga_beginscan(PG_FUNCTION_ARGS)
+groonga_count(PG_FUNCTION_ARGS)
 {
-	Relation		index = (Relation) PG_GETARG_POINTER(0);
-	int				keysz = PG_GETARG_INT32(1);
-	ScanKey			key = (ScanKey) PG_GETARG_POINTER(2);
-	IndexScanDesc	scan;
+	Oid			relid = PG_GETARG_OID(0);
+	Datum		query = PG_GETARG_DATUM(1);
+	bool		exact = (PG_NARGS() > 2 ? PG_GETARG_BOOL(2) : true);
+	Relation	index;
+	int64		count;
 
-	scan = RelationGetIndexScan(index, keysz, key);
+	index = GrnOpenIndex(relid, AccessShareLock);
+	GrnCheckSelectPrivilege(index);
 
-	PG_RETURN_POINTER(scan);
+	if (exact)
+		count = GrnCountVisible(index, query);
+	else
+		count = GrnCountHits(index, query);
+
+	index_close(index, AccessShareLock);
+
+	PG_RETURN_INT64(count);
 }
 
 /**
- * groonga.gettuple() -- amgettuple
+ * groonga.drilldown(index regclass, query groonga.query, column text,
+ *                   max_groups integer) : SETOF (value, count)
+ *
+ * Group hits of the query by values of an indexed column in groonga.
+ * Heap tuples are not visited, so rows deleted but not vacuumed yet are
+ * also counted.
+ *
+ * @param	index		groonga index to be searched.
+ * @param	query		query given to @@ operator.
+ * @param	column		indexed column to group by.
+ * @param	max_groups	maximum number of groups; negative means all.
+ * @return	(value, count) in descending order of count.
  */
 Datum
-groonga_gettuple(PG_FUNCTION_ARGS)
+groonga_drilldown(PG_FUNCTION_ARGS)
 {
-	IndexScanDesc	scan = (IndexScanDesc) PG_GETARG_POINTER(0);
-	ScanDirection	dir = (ScanDirection) PG_GETARG_INT32(1);
-	GrnScanDesc	   *desc = (GrnScanDesc *) scan->opaque;
+	Oid					relid = PG_GETARG_OID(0);
+	text			   *query = PG_GETARG_TEXT_PP(1);
+	char			   *column = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	int32				max_groups = (PG_NARGS() > 3 ? PG_GETARG_INT32(3) : 10);
+	const char		   *attname;
+	Relation			index;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	StringInfoData		buf;
+	text			   *res;
+	grn_ctx			   *ctx;
+	const char		   *p;
+	int					attno;
+	LOCKTAG				tag;
 
-	if (desc == NULL)
+	tupstore = GrnMaterialize(fcinfo, &tupdesc);
+
+	index = GrnOpenIndex(relid, AccessShareLock);
+	GrnCheckSelectPrivilege(index);
+	GrnCheckQuerySupported(index);
+
+	for (attno = 1; attno <= RelationGetNumberOfAttributes(index); attno++)
 	{
-		scan->opaque = desc = GrnBeginScan(
-			scan->indexRelation, scan->numberOfKeys, scan->keyData);
+		if (strcmp(NameStr(RelationGetDescr(index)->attrs[attno - 1]->attname), column) == 0)
+			break;
 	}
+	if (attno > RelationGetNumberOfAttributes(index))
+		ereport(ERROR,
+			(errcode(ERRCODE_UNDEFINED_COLUMN),
+			 errmsg("groonga: column \"%s\" is not indexed by \"%s\"",
+				column, RelationGetRelationName(index))));
 
-	if (dir != ForwardScanDirection)
-		elog(ERROR, "groonga: only supports forward scans");
+	/* the name of the indexed column, not the argument, is sent to groonga */
+	attname = NameStr(RelationGetDescr(index)->attrs[attno - 1]->attname);
 
-	if (scan->kill_prior_tuple)
-	{
-		if (desc->table == NULL)
-			desc->table = GrnLookupTable(desc->ctx, scan->indexRelation, ERROR);
+	initStringInfo(&buf);
+	appendStringInfo(&buf,
+		"select --table t%u --output_columns _key --limit 0 --drilldown ",
+		index->rd_node.relNode);
+	appendStringEscaped(&buf, attname, strlen(attname));
+	appendStringInfo(&buf,
+		" --drilldown_output_columns _key,_nsubrecs "
+		"--drilldown_sortby -_nsubrecs,_key --drilldown_limit %d ",
+		max_groups < 0 ? -1 : max_groups);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(query), VARSIZE_ANY_EXHDR(query));
 
-		Assert(0 < desc->cursor);
+	ctx = GrnOpen();
+	GrnLock(index, AccessShareLock, &tag);
+	GrnCommand(ctx, buf.data, &res, NULL);
+	GrnUnlock(&tag, AccessShareLock);
 
-		GrnLock(scan->indexRelation, ExclusiveLock);
-		GrnDelete(desc->ctx, desc->table, &desc->ctid[desc->cursor - 1]);
-		GrnUnlock(scan->indexRelation, ExclusiveLock);
+	/*
+	 * [[[nhits],[columns]],[[ngroups],[columns],[value,count],...]]
+	 */
+	p = VARDATA(res);
+	if (!GrnJsonExpect(&p, '['))
+		goto error;
+	GrnJsonSkip(&p);
+	if (!GrnJsonExpect(&p, ',') || !GrnJsonExpect(&p, '['))
+		goto error;
+	GrnJsonSkip(&p);
+	if (!GrnJsonExpect(&p, ','))
+		goto error;
+	GrnJsonSkip(&p);
+
+	while (GrnJsonExpect(&p, ','))
+	{
+		Datum		values[2];
+		bool		nulls[2];
+		char	   *value;
+		char	   *count;
+
+		if (!GrnJsonExpect(&p, '['))
+			goto error;
+		value = GrnJsonScalar(&p);
+		if (!GrnJsonExpect(&p, ','))
+			goto error;
+		count = GrnJsonScalar(&p);
+		if (!GrnJsonExpect(&p, ']'))
+			goto error;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(value);
+		values[1] = Int64GetDatum(atoi64(count));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		pfree(value);
+		pfree(count);
 	}
 
-	while (desc->cursor < desc->num)
-	{
-		scan->xs_ctup.t_self = desc->ctid[desc->cursor++];
+	if (!GrnJsonExpect(&p, ']') || !GrnJsonExpect(&p, ']'))
+		goto error;
 
-#if PG_VERSION_NUM >= 80400
-		scan->xs_recheck = false;
-#endif
-		PG_RETURN_BOOL(true);
-	}
+	GrnFreeResult(res);
+	index_close(index, AccessShareLock);
 
-	PG_RETURN_BOOL(false);
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+
+error:
+	ereport(ERROR,
+		(errmsg("unexpected result: %s", VARDATA(res)),
+		 errcontext("query: %s", buf.data)));
+	return (Datum) 0;
 }
 
 /**
- * groonga.getbitmap() -- amgetbitmap
+ * groonga.complete(index regclass, prefix text, max_results integer) : SETOF record
+ *
+ * @param	prefix		prefix of terms, normalized as the index does.
+ * @return	terms in the lexicon starting with the prefix, in the order of
+ *			terms, and the number of postings of each term. Terms are
+ *			tokens of the tokenizer; whole values only with tokenizer=none.
  */
 Datum
-groonga_getbitmap(PG_FUNCTION_ARGS)
+groonga_complete(PG_FUNCTION_ARGS)
 {
-#if PG_VERSION_NUM >= 80400
-	IndexScanDesc	scan = (IndexScanDesc) PG_GETARG_POINTER(0);
-	TIDBitmap	   *tbm = (TIDBitmap *) PG_GETARG_POINTER(1);
-	GrnScanDesc	   *desc = (GrnScanDesc *) scan->opaque;
+	Oid					relid = PG_GETARG_OID(0);
+	text			   *prefix = PG_GETARG_TEXT_PP(1);
+	int32				max_results = (PG_NARGS() > 2 ? PG_GETARG_INT32(2) : 10);
+	Relation			index;
+	TupleDesc			tupdesc;
+	Tuplestorestate	   *tupstore;
+	const GrnOptions   *options;
+	grn_ctx			   *ctx;
+	grn_obj			   *keys;
+	grn_obj			   *column;
+	grn_obj				value;
+	grn_str			   *str = NULL;
+	grn_table_cursor   *cursor;
+	grn_id				id;
+	const char		   *key;
+	unsigned int		keylen;
+	int32				nresults = 0;
+	LOCKTAG				tag;
 
-	if (desc == NULL)
-	{
-		scan->opaque = desc = GrnBeginScan(
-			scan->indexRelation, scan->numberOfKeys, scan->keyData);
-	}
+	tupstore = GrnMaterialize(fcinfo, &tupdesc);
 
-	tbm_add_tuples(tbm, desc->ctid, desc->num, false);
+	index = GrnOpenIndex(relid, AccessShareLock);
+	GrnCheckSelectPrivilege(index);
 
-	PG_RETURN_INT64(desc->num);
-#else
-	IndexScanDesc scan = (IndexScanDesc) PG_GETARG_POINTER(0);
-	ItemPointer tids = (ItemPointer) PG_GETARG_POINTER(1);
-	int32		max_tids = PG_GETARG_INT32(2);
-	int32	   *returned_tids = (int32 *) PG_GETARG_POINTER(3);
+	/* hash lexicons cannot be searched by prefix */
+	options = GrnGetOptions(index);
+	if (options->lexicon == GrnLexiconHash)
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("groonga: cannot complete terms of index \"%s\" with lexicon=hash",
+				RelationGetRelationName(index))));
 
-	GrnScanDesc	   *desc = (GrnScanDesc *) scan->opaque;
-	int64			ntids;
+	ctx = GrnOpen();
+	GrnLock(index, AccessShareLock, &tag);
 
-	if (max_tids <= 0)			/* behave correctly in boundary case */
-		PG_RETURN_BOOL(true);
+	keys = GrnLookupIndex(ctx, index, ERROR);
+	column = grn_obj_column(ctx, keys,
+				GrnIndexColumnName, strlen(GrnIndexColumnName));
+	if (column == NULL)
+		elog(ERROR, "grn_obj_column: \"%s\" not found", GrnIndexColumnName);
 
-	if (desc == NULL)
+	key = VARDATA_ANY(prefix);
+	keylen = VARSIZE_ANY_EXHDR(prefix);
+	if (options->normalize)
 	{
-		scan->opaque = desc = GrnBeginScan(
-			scan->indexRelation, scan->numberOfKeys, scan->keyData);
+		str = grn_str_open(ctx, key, keylen, GRN_STR_NORMALIZE);
+		if (str == NULL)
+			elog(ERROR, "grn_str_open: %s", ctx->errbuf);
+		key = str->norm;
+		keylen = str->norm_blen;
 	}
 
-	ntids = Min(max_tids, desc->num - desc->cursor);
-	memcpy(tids, desc->ctid + desc->cursor, ntids * sizeof(ItemPointerData));
+	cursor = grn_table_cursor_open(ctx, keys, key, keylen, NULL, 0,
+				0, -1, GRN_CURSOR_PREFIX);
+	if (cursor == NULL)
+		elog(ERROR, "grn_table_cursor_open: %s", ctx->errbuf);
 
-	*returned_tids = ntids;
-	desc->cursor += ntids;
-	PG_RETURN_BOOL(desc->cursor < desc->num);
-#endif
-}
+	/* the value of an index column is the number of postings */
+	GRN_UINT32_INIT(&value, 0);
+	while ((max_results < 0 || nresults < max_results) &&
+		   (id = grn_table_cursor_next(ctx, cursor)) != GRN_ID_NIL)
+	{
+		Datum		values[2];
+		bool		nulls[2];
+		void	   *term;
+		int			termlen;
 
-/**
- * groonga.rescan() -- amrescan
- *
- * この段階ではスキャンキーがまだ与えられていない場合がある。
- * まだ検索を行わなず、後から gettuple または getbitmap で検索する。
- */
-Datum
-groonga_rescan(PG_FUNCTION_ARGS)
-{
-	IndexScanDesc	scan = (IndexScanDesc) PG_GETARG_POINTER(0);
-	ScanKey			keys = (ScanKey) PG_GETARG_POINTER(1);
-	GrnScanDesc	   *desc = (GrnScanDesc *) scan->opaque;
+		GRN_BULK_REWIND(&value);
+		grn_obj_get_value(ctx, column, id, &value);
 
-	if (desc != NULL)
-	{
-		GrnEndScan(desc);
-		scan->opaque = NULL;
+		/* skip terms left behind by deleted rows */
+		if (GRN_UINT32_VALUE(&value) == 0)
+			continue;
+
+		termlen = grn_table_cursor_get_key(ctx, cursor, &term);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = PointerGetDatum(cstring_to_text_with_len(term, termlen));
+		values[1] = Int64GetDatum(GRN_UINT32_VALUE(&value));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		nresults++;
 	}
+	grn_obj_close(ctx, &value);
+	grn_table_cursor_close(ctx, cursor);
+	if (str != NULL)
+		grn_str_close(ctx, str);
 
-	if (keys && scan->numberOfKeys > 0)
-		memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
+	GrnUnlock(&tag, AccessShareLock);
+	index_close(index, AccessShareLock);
 
-	PG_RETURN_VOID();
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
 }
 
+/* width large enough to cover whole documents */
+#define GrnHighlightWidth	((int) (MaxAllocSize / 4))
+
 /**
- * groonga.endscan() -- amendscan
+ * groonga.snippet(doc text, keywords text, width integer, max_results integer,
+ *                 open_tag text, close_tag text, index regclass) : text[]
+ *
+ * @param	doc			document to be summarized.
+ * @param	keywords	space-separated keywords to be tagged.
+ * @param	index		if given, keywords are normalized as the index does.
+ * @return	HTML-escaped snippets around the keywords.
  */
 Datum
-groonga_endscan(PG_FUNCTION_ARGS)
+groonga_snippet(PG_FUNCTION_ARGS)
 {
-	IndexScanDesc	scan = (IndexScanDesc) PG_GETARG_POINTER(0);
-	GrnScanDesc	   *desc = (GrnScanDesc *) scan->opaque;
+	int			argc = PG_NARGS();
+	text	   *doc;
+	grn_ctx	   *ctx;
+	grn_snip   *snip;
+	unsigned int	nresults;
+	unsigned int	max_tagged_len;
+	unsigned int	i;
+	Datum	   *elems;
+	char	   *result;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		PG_RETURN_NULL();
 
-	if (desc != NULL)
-		GrnEndScan(desc);
+	doc = PG_GETARG_TEXT_PP(0);
+	snip = GrnSnipOpen(fcinfo,
+		GRN_SNIP_SKIP_LEADING_SPACES,
+		(argc > 2 && !PG_ARGISNULL(2) ? PG_GETARG_INT32(2) : 200),
+		(argc > 3 && !PG_ARGISNULL(3) ? PG_GETARG_INT32(3) : 3),
+		text_to_cstring(PG_GETARG_TEXT_PP(1)),
+		(argc > 4 && !PG_ARGISNULL(4) ? text_to_cstring(PG_GETARG_TEXT_PP(4)) : "<b>"),
+		(argc > 5 && !PG_ARGISNULL(5) ? text_to_cstring(PG_GETARG_TEXT_PP(5)) : "</b>"),
+		(argc > 6 && !PG_ARGISNULL(6) ? PG_GETARG_OID(6) : InvalidOid));
 
-	PG_RETURN_VOID();
+	ctx = GrnOpen();
+	if (grn_snip_exec(ctx, snip, VARDATA_ANY(doc), VARSIZE_ANY_EXHDR(doc),
+					  &nresults, &max_tagged_len) != GRN_SUCCESS)
+		elog(ERROR, "grn_snip_exec: %s", ctx->errbuf);
+
+	if (nresults == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(TEXTOID));
+
+	elems = (Datum *) palloc(sizeof(Datum) * nresults);
+	result = (char *) palloc(max_tagged_len + 1);
+	for (i = 0; i < nresults; i++)
+	{
+		unsigned int	len;
+
+		if (grn_snip_get_result(ctx, snip, i, result, &len) != GRN_SUCCESS)
+			elog(ERROR, "grn_snip_get_result: %s", ctx->errbuf);
+		elems[i] = PointerGetDatum(cstring_to_text_with_len(result, len));
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, nresults, TEXTOID, -1, false, 'i'));
 }
 
 /**
- * groonga.build() -- ambuild
+ * groonga.highlight(doc text, keywords text, open_tag text, close_tag text,
+ *                   index regclass) : text
+ *
+ * @return	HTML-escaped whole document with tagged keywords.
  */
 Datum
-groonga_build(PG_FUNCTION_ARGS)
+groonga_highlight(PG_FUNCTION_ARGS)
 {
-	Relation			heap = (Relation) PG_GETARG_POINTER(0);
-	Relation			index = (Relation) PG_GETARG_POINTER(1);
-	IndexInfo		   *indexInfo = (IndexInfo *) PG_GETARG_POINTER(2);
-	IndexBuildResult   *result;
-	GrnBuildState		state;
+	int			argc = PG_NARGS();
+	text	   *doc;
+	grn_ctx	   *ctx;
+	grn_snip   *snip;
+	unsigned int	nresults;
+	unsigned int	max_tagged_len;
+	StringInfoData	buf;
 
-	if (indexInfo->ii_Unique)
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("groonga: do not support unique index")));
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		PG_RETURN_NULL();
 
-	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
-	
-	PG_TRY();
-	{
-		state.ctx = GrnOpen();
-		initStringInfo(&state.buf);
+	doc = PG_GETARG_TEXT_PP(0);
+	snip = GrnSnipOpen(fcinfo, 0, GrnHighlightWidth, 1,
+		text_to_cstring(PG_GETARG_TEXT_PP(1)),
+		(argc > 2 && !PG_ARGISNULL(2) ? text_to_cstring(PG_GETARG_TEXT_PP(2)) : "<b>"),
+		(argc > 3 && !PG_ARGISNULL(3) ? text_to_cstring(PG_GETARG_TEXT_PP(3)) : "</b>"),
+		(argc > 4 && !PG_ARGISNULL(4) ? PG_GETARG_OID(4) : InvalidOid));
 
-		state.table = GrnCreate(state.ctx, index);
+	ctx = GrnOpen();
+	if (grn_snip_exec(ctx, snip, VARDATA_ANY(doc), VARSIZE_ANY_EXHDR(doc),
+					  &nresults, &max_tagged_len) != GRN_SUCCESS)
+		elog(ERROR, "grn_snip_exec: %s", ctx->errbuf);
 
-		result->heap_tuples = result->index_tuples =
-			IndexBuildHeapScan(heap, index, indexInfo, true, GrnBuildCallback, &state);
+	initStringInfo(&buf);
+	if (nresults > 0)
+	{
+		unsigned int	len;
+
+		enlargeStringInfo(&buf, max_tagged_len + 1);
+		if (grn_snip_get_result(ctx, snip, 0, buf.data, &len) != GRN_SUCCESS)
+			elog(ERROR, "grn_snip_get_result: %s", ctx->errbuf);
+		buf.len = len;
+		buf.data[len] = '\0';
 	}
-	PG_CATCH();
+	else
 	{
-		GrnDrop(state.ctx, index);
-		PG_RE_THROW();
+		/* no keywords found; escape as snippets are */
+		appendHtmlEscaped(&buf, VARDATA_ANY(doc), VARSIZE_ANY_EXHDR(doc));
 	}
-	PG_END_TRY();
 
-	PG_RETURN_POINTER(result);
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
 }
 
-/**
- * groonga.bulkdelete() -- ambulkdelete
+/*
+ * GrnSnipOpen -- returns a snip object compiled from the keywords. The
+ * object is cached in fn_extra and reused while the arguments are the same
+ * in the transaction.
  */
-Datum
-groonga_bulkdelete(PG_FUNCTION_ARGS)
+static grn_snip *
+GrnSnipOpen(FunctionCallInfo fcinfo, int flags, int width, int max_results,
+			const char *keywords, const char *open_tag, const char *close_tag,
+			Oid indexid)
 {
-	IndexVacuumInfo		   *info = (IndexVacuumInfo *) PG_GETARG_POINTER(0);
-	IndexBulkDeleteResult  *stats = (IndexBulkDeleteResult *) PG_GETARG_POINTER(1);
-	IndexBulkDeleteCallback	callback = (IndexBulkDeleteCallback) PG_GETARG_POINTER(2);
-	void				   *callback_state = (void *) PG_GETARG_POINTER(3);
+	GrnSnipCache   *cache = (GrnSnipCache *) fcinfo->flinfo->fn_extra;
+	grn_ctx		   *ctx;
+	grn_snip	   *snip;
+	MemoryContext	oldcontext;
+	const char	   *kw;
+
+	if (cache != NULL &&
+		cache->generation == grnSnipGeneration &&
+		cache->flags == flags &&
+		cache->width == width &&
+		cache->max_results == max_results &&
+		cache->indexid == indexid &&
+		strcmp(cache->keywords, keywords) == 0 &&
+		strcmp(cache->open_tag, open_tag) == 0 &&
+		strcmp(cache->close_tag, close_tag) == 0)
+		return cache->snip;
+
+	if (width <= 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("groonga: width must be positive")));
+	if (max_results <= 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("groonga: max_results must be positive")));
 
-	Relation			index = info->index;
-	grn_ctx			   *ctx = GrnOpen();
-	grn_obj			   *table = GrnLookupTable(ctx, index, WARNING);
-	grn_table_cursor   *cursor;
-	double				tuples_removed;
+	if (OidIsValid(indexid))
+	{
+		Relation	index = GrnOpenIndex(indexid, AccessShareLock);
 
-	if (stats == NULL)
-		stats = GrnBulkDeleteResult(info, ctx, table);
+		if (GrnGetOptions(index)->normalize)
+			flags |= GRN_SNIP_NORMALIZE;
+		index_close(index, AccessShareLock);
+	}
+	else
+		flags |= GRN_SNIP_NORMALIZE;
 
-	if (table == NULL || callback == NULL)
-		PG_RETURN_POINTER(stats);
+	ctx = GrnOpen();
+	snip = grn_snip_open(ctx, flags | GRN_SNIP_COPY_TAG, width, max_results,
+						 open_tag, strlen(open_tag), close_tag, strlen(close_tag),
+						 GRN_SNIP_MAPPING_HTML_ESCAPE);
+	if (snip == NULL)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("groonga: grn_snip_open failed: %s", ctx->errbuf)));
 
-	tuples_removed = 0;
+	/* register the snip first so that it is closed even on error */
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	grnSnips = lappend(grnSnips, snip);
+	MemoryContextSwitchTo(oldcontext);
 
-	cursor = grn_table_cursor_open(ctx, table, NULL, 0, NULL, 0, 0, -1, 0);
-	if (cursor == NULL)
-		elog(ERROR, "grn_table_cursor_open: %s", ctx->errbuf);
+	for (kw = keywords; *kw; )
+	{
+		const char *end;
+
+		while (isspace((unsigned char) *kw))
+			kw++;
+		for (end = kw; *end && !isspace((unsigned char) *end); end++)
+			;
+		if (end > kw &&
+			grn_snip_add_cond(ctx, snip, kw, end - kw, NULL, 0, NULL, 0) != GRN_SUCCESS)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("groonga: grn_snip_add_cond failed: %s", ctx->errbuf)));
+		kw = end;
+	}
 
-	PG_TRY();
+	/* the previous snip is no longer used */
+	if (cache != NULL && cache->generation == grnSnipGeneration)
 	{
-		while (grn_table_cursor_next(ctx, cursor) != GRN_ID_NIL)
-		{
-			int64		   *rowkey;
-			int				keysize;
-			ItemPointerData	ctid;
+		grnSnips = list_delete_ptr(grnSnips, cache->snip);
+		grn_snip_close(ctx, cache->snip);
+	}
 
-			CHECK_FOR_INTERRUPTS();
+	if (cache == NULL)
+		cache = (GrnSnipCache *) MemoryContextAllocZero(
+			fcinfo->flinfo->fn_mcxt, sizeof(GrnSnipCache));
+	else
+	{
+		pfree(cache->keywords);
+		pfree(cache->open_tag);
+		pfree(cache->close_tag);
+	}
 
-			keysize = grn_table_cursor_get_key(ctx, cursor, (void**) &rowkey);
-			if (keysize != sizeof(int64))
-				elog(ERROR, "groonga: unexpected keysize = %d", keysize);
+	cache->generation = grnSnipGeneration;
+	cache->flags = flags & ~GRN_SNIP_NORMALIZE;
+	cache->width = width;
+	cache->max_results = max_results;
+	cache->indexid = indexid;
+	cache->keywords = MemoryContextStrdup(fcinfo->flinfo->fn_mcxt, keywords);
+	cache->open_tag = MemoryContextStrdup(fcinfo->flinfo->fn_mcxt, open_tag);
+	cache->close_tag = MemoryContextStrdup(fcinfo->flinfo->fn_mcxt, close_tag);
+	cache->snip = snip;
+	fcinfo->flinfo->fn_extra = cache;
+
+	return snip;
+}
 
-			ctid = Int64ToCtid(*rowkey);
-			if (callback(&ctid, callback_state))
-			{
-				GrnLock(index, ExclusiveLock);
-				GrnDelete(ctx, table, &ctid);
-				GrnUnlock(index, ExclusiveLock);
+/*
+ * Close all snips opened in the transaction and invalidate caches.
+ */
+static void
+GrnSnipCloseAll(void)
+{
+	ListCell   *cell;
 
-				tuples_removed += 1;
-			}
+	if (grnSnips == NIL)
+		return;
+
+	foreach (cell, grnSnips)
+		grn_snip_close(&grnContext, (grn_snip *) lfirst(cell));
+	list_free(grnSnips);
+	grnSnips = NIL;
+	grnSnipGeneration++;
+}
+
+static void
+appendHtmlEscaped(StringInfo buf, const char *str, int len)
+{
+	int		i;
+
+	for (i = 0; i < len; i++)
+	{
+		switch (str[i])
+		{
+		case '<': appendStringInfoString(buf, "&lt;"); break;
+		case '>': appendStringInfoString(buf, "&gt;"); break;
+		case '&': appendStringInfoString(buf, "&amp;"); break;
+		case '"': appendStringInfoString(buf, "&quot;"); break;
+		default: appendStringInfoChar(buf, str[i]); break;
 		}
-		grn_table_cursor_close(ctx, cursor);
 	}
-	PG_CATCH();
+}
+
+static bool
+contains_internal(
+	const char *doc, unsigned doclen,
+	const char *key, unsigned keylen)
+{
+	grn_ctx	   *ctx = GrnOpen();
+	grn_query  *q;
+	grn_rc		rc;
+	int			found;
+	int			score;
+
+	q = grn_query_open(ctx, key, keylen, GRN_OP_AND, 32);
+	rc = grn_query_scan(ctx, q, &doc, &doclen, 1,
+			GRN_QUERY_SCAN_NORMALIZE, &found, &score);
+	if (rc)
 	{
-		grn_table_cursor_close(ctx, cursor);
-		PG_RE_THROW();
+		char *err = pstrdup(ctx->errbuf);
+		grn_query_close(ctx, q);
+		elog(ERROR, "grn_query_scan() failed: %s", err);
 	}
-	PG_END_TRY();
+	grn_query_close(ctx, q);
 
-	stats->tuples_removed = tuples_removed;
+	/*
+	 * FIXME: We cannot return score values with groonga.score() on seq scan.
+	 */
+	return found && score;
+}
 
-	PG_RETURN_POINTER(stats);
+/**
+ * groonga.contains(doc text, key text) : bool
+ */
+Datum
+groonga_contains(PG_FUNCTION_ARGS)
+{
+	text	   *doc = PG_GETARG_TEXT_PP(0);
+	text	   *key = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_BOOL(contains_internal(
+		VARDATA_ANY(doc), VARSIZE_ANY_EXHDR(doc),
+		VARDATA_ANY(key), VARSIZE_ANY_EXHDR(key)));
 }
 
 /**
- * groonga.vacuumcleanup() -- amvacuumcleanup
+ * groonga.contains(doc bpchar, key bpchar) : bool
  */
 Datum
-groonga_vacuumcleanup(PG_FUNCTION_ARGS)
+groonga_contains_bpchar(PG_FUNCTION_ARGS)
 {
-	IndexVacuumInfo *info = (IndexVacuumInfo *) PG_GETARG_POINTER(0);
-	IndexBulkDeleteResult *stats = (IndexBulkDeleteResult *) PG_GETARG_POINTER(1);
+	BpChar	   *doc = PG_GETARG_BPCHAR_PP(0);
+	BpChar	   *key = PG_GETARG_BPCHAR_PP(1);
 
-	if (stats == NULL)
-	{
-		Relation	index = info->index;
-		grn_ctx	   *ctx = GrnOpen();
-		grn_obj	   *table = GrnLookupTable(ctx, index, WARNING);
+	PG_RETURN_BOOL(contains_internal(
+		VARDATA_ANY(doc), bpchar_size(doc),
+		VARDATA_ANY(key), bpchar_size(key)));
+}
 
-		stats = GrnBulkDeleteResult(info, ctx, table);
+/*
+ * prefix_internal -- true if the normalized document starts with the
+ * normalized prefix.
+ */
+static bool
+prefix_internal(
+	const char *doc, unsigned doclen,
+	const char *prefix, unsigned prefixlen)
+{
+	grn_ctx	   *ctx = GrnOpen();
+	grn_str	   *d;
+	grn_str	   *p;
+	bool		result;
+
+	if ((d = grn_str_open(ctx, doc, doclen, GRN_STR_NORMALIZE)) == NULL)
+		elog(ERROR, "grn_str_open: %s", ctx->errbuf);
+	if ((p = grn_str_open(ctx, prefix, prefixlen, GRN_STR_NORMALIZE)) == NULL)
+	{
+		char *err = pstrdup(ctx->errbuf);
+		grn_str_close(ctx, d);
+		elog(ERROR, "grn_str_open: %s", err);
 	}
 
-	PG_RETURN_POINTER(stats);
+	result = (p->norm_blen <= d->norm_blen &&
+			  memcmp(d->norm, p->norm, p->norm_blen) == 0);
+
+	grn_str_close(ctx, p);
+	grn_str_close(ctx, d);
+
+	return result;
 }
 
 /**
- * groonga.costestimate() -- amcostestimate
+ * groonga.prefix(doc text, prefix text) : bool
  */
 Datum
-groonga_costestimate(PG_FUNCTION_ARGS)
+groonga_prefix(PG_FUNCTION_ARGS)
 {
-	/*
-	 * We cannot use genericcostestimate because it is a static funciton.
-	 * Use gistcostestimate instead, which just calls genericcostestimate.
-	 */
-	return gistcostestimate(fcinfo);
+	text	   *doc = PG_GETARG_TEXT_PP(0);
+	text	   *prefix = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_BOOL(prefix_internal(
+		VARDATA_ANY(doc), VARSIZE_ANY_EXHDR(doc),
+		VARDATA_ANY(prefix), VARSIZE_ANY_EXHDR(prefix)));
 }
 
 /**
- * groonga.options() -- amoptions
+ * groonga.prefix(doc bpchar, prefix bpchar) : bool
  */
 Datum
-groonga_options(PG_FUNCTION_ARGS)
+groonga_prefix_bpchar(PG_FUNCTION_ARGS)
 {
-	return (Datum) 0;
+	BpChar	   *doc = PG_GETARG_BPCHAR_PP(0);
+	BpChar	   *prefix = PG_GETARG_BPCHAR_PP(1);
+
+	PG_RETURN_BOOL(prefix_internal(
+		VARDATA_ANY(doc), bpchar_size(doc),
+		VARDATA_ANY(prefix), bpchar_size(prefix)));
 }
 
-static void
-GrnBuildCallback(
-	Relation	index,
-	HeapTuple	htup,
-	Datum	   *values,
-	bool	   *nulls,
-	bool		tupleIsAlive,
-	void	   *context)
+/*
+ * distance_internal -- 1 minus the Dice coefficient of the bigrams of
+ * the normalized strings.
+ */
+static double
+distance_internal(
+	const char *doc, unsigned doclen,
+	const char *key, unsigned keylen)
 {
-	GrnBuildState  *state = (GrnBuildState *) context;
+	grn_ctx	   *ctx = GrnOpen();
+	GrnGrams	d;
+	GrnGrams	k;
+	double		distance;
 
-	/*
-	 * No lock required here because the caller must hold an exclusive lock
-	 * on the postgres' index relation.
-	 */
-	GrnInsert(state->ctx, index, state->table, values, nulls, &htup->t_self);
+	GrnBigrams(ctx, doc, doclen, &d);
+	GrnBigrams(ctx, key, keylen, &k);
+	distance = GrnDistance(&d, &k);
+	GrnFreeGrams(&d);
+	GrnFreeGrams(&k);
+
+	return distance;
 }
 
-static GrnScanDesc *
+/**
+ * groonga.distance(doc text, key text) : float8
+ *
+ * @return	0 for the same strings and 1 for strings sharing no bigrams.
+ */
+Datum
+groonga_distance(PG_FUNCTION_ARGS)
+{
+	text	   *doc = PG_GETARG_TEXT_PP(0);
+	text	   *key = PG_GETARG_TEXT_PP(1);
+
+	PG_RETURN_FLOAT8(distance_internal(
+		VARDATA_ANY(doc), VARSIZE_ANY_EXHDR(doc),
+		VARDATA_ANY(key), VARSIZE_ANY_EXHDR(key)));
+}
+
+/**
+ * groonga.distance(doc bpchar, key bpchar) : float8
+ */
+Datum
+groonga_distance_bpchar(PG_FUNCTION_ARGS)
+{
+	BpChar	   *doc = PG_GETARG_BPCHAR_PP(0);
+	BpChar	   *key = PG_GETARG_BPCHAR_PP(1);
+
+	PG_RETURN_FLOAT8(distance_internal(
+		VARDATA_ANY(doc), bpchar_size(doc),
+		VARDATA_ANY(key), bpchar_size(key)));
+}
+
+static int
+GrnGramCmp(const void *lhs, const void *rhs)
+{
+	return strcmp(*(char * const *) lhs, *(char * const *) rhs);
+}
+
+/*
+ * GrnBigrams -- extract bigrams from the normalized string, in the same way
+ * as the lexicon of tokenizer=substring does. Blanks separate words and a
+ * word of one character is a gram by itself.
+ */
+static void
+GrnBigrams(grn_ctx *ctx, const char *str, int len, GrnGrams *grams)
+{
+	grn_str	   *norm;
+	const char *begin;
+	const char *end;
+	const char *s;
+	int			n;
+	int			m;
+
+	if ((norm = grn_str_open(ctx, str, len, GRN_STR_NORMALIZE)) == NULL)
+		elog(ERROR, "grn_str_open: %s", ctx->errbuf);
+
+	begin = norm->norm;
+	end = begin + norm->norm_blen;
+	grams->grams = (char **) palloc(sizeof(char *) * (norm->norm_blen + 1));
+	n = 0;
+	grams->num = 0;
+	for (s = begin; s < end; s += pg_mblen(s))
+	{
+		int		glen = pg_mblen(s);
+
+		if (*s == ' ')
+			continue;
+		if (s + glen < end && s[glen] != ' ')
+			glen += pg_mblen(s + glen);
+		else if (s > begin && s[-1] != ' ')
+			continue;	/* the last character of a word */
+
+		grams->grams[n] = (char *) palloc(glen + 1);
+		memcpy(grams->grams[n], s, glen);
+		grams->grams[n][glen] = '\0';
+		n++;
+	}
+	grn_str_close(ctx, norm);
+
+	/* sort and remove duplicates */
+	qsort(grams->grams, n, sizeof(char *), GrnGramCmp);
+	for (m = 0; m < n; m++)
+	{
+		if (grams->num > 0 &&
+			strcmp(grams->grams[m], grams->grams[grams->num - 1]) == 0)
+			pfree(grams->grams[m]);
+		else
+			grams->grams[grams->num++] = grams->grams[m];
+	}
+}
+
+static void
+GrnFreeGrams(GrnGrams *grams)
+{
+	int		i;
+
+	for (i = 0; i < grams->num; i++)
+		pfree(grams->grams[i]);
+	pfree(grams->grams);
+}
+
+/*
+ * GrnDistance -- 1 minus the Dice coefficient of two sets of grams.
+ */
+static double
+GrnDistance(const GrnGrams *lhs, const GrnGrams *rhs)
+{
+	int		i = 0;
+	int		j = 0;
+	int		common = 0;
+
+	if (lhs->num + rhs->num == 0)
+		return 1.0;
+
+	while (i < lhs->num && j < rhs->num)
+	{
+		int		cmp = strcmp(lhs->grams[i], rhs->grams[j]);
+
+		if (cmp == 0)
+		{
+			common++;
+			i++;
+			j++;
+		}
+		else if (cmp < 0)
+			i++;
+		else
+			j++;
+	}
+
+	return 1.0 - 2.0 * common / (lhs->num + rhs->num);
+}
+
+Datum
+groonga_match(PG_FUNCTION_ARGS)
+{
+#ifdef NOT_USED
+	text	   *doc = PG_GETARG_TEXT_PP(0);
+	text	   *query = PG_GETARG_TEXT_PP(1);
+#endif
+
+	elog(ERROR,
+		"groonga: operator @@ (doc, query) is available only in index scans");
+
+	PG_RETURN_BOOL(false);
+}
+
+/**
+ * groonga.score(tableoid, ctid) : int32
+ *
+ * @param	tableoid	tableoid of the heap
+ * @param	ctid		ctid of heap tuple
+ * @return	score of the row in the query.
+ */
+Datum
+groonga_score(PG_FUNCTION_ARGS)
+{
+	Oid				tableoid = PG_GETARG_OID(0);
+	ItemPointer		ctid = (ItemPointer) DatumGetPointer(PG_GETARG_DATUM(1));
+	int32			score = 0;
+	GrnScanDesc	   *desc;
+
+	/*
+	 * FIXME: 行が更新されていた場合、このままでは正しく動作しない。
+	 * 渡される ctid はインデックスされた ctid から更新鎖を辿ったものである
+	 * 可能性があり、ctid の一致条件だけでは判定に失敗する場合がある。
+	 * この際、新ctid => 旧ctid という辿り方はできないため、鎖を検索するのも難しい。
+	 * ctid の代わりに、更新しても変化しない一意の ROWID が必要かもしれない。
+	 */
+	for (desc = grnScanDescs; desc; desc = desc->next)
+	{
+		if (desc->tableoid == tableoid)
+			score += GrnScore(desc, ctid);
+	}
+
+	PG_RETURN_INT32(score);
+}
+
+/**
+ * groonga.insert() -- aminsert
+ */
+Datum
+groonga_insert(PG_FUNCTION_ARGS)
+{
+	Relation	index = (Relation) PG_GETARG_POINTER(0);
+	Datum	   *values = (Datum *) PG_GETARG_POINTER(1);
+	bool	   *nulls = (bool *) PG_GETARG_POINTER(2);
+	ItemPointer	ctid = (ItemPointer) PG_GETARG_POINTER(3);
+#ifdef NOT_USED
+	Relation	heap = (Relation) PG_GETARG_POINTER(4);
+	bool		checkUnique = PG_GETARG_BOOL(5);
+#endif
+	grn_ctx	   *ctx = GrnOpen();
+	grn_obj	   *table;
+	LOCKTAG		tag;
+
+	/* catch up with the change log after promotion */
+	(void) GrnReplay(ctx, index);
+	table = GrnLookupTable(ctx, index, ERROR);
+
+	GrnLock(index, ExclusiveLock, &tag);
+	GrnInsert(ctx, index, table, values, nulls, ctid);
+	GrnUnlock(&tag, ExclusiveLock);
+
+	/*
+	 * Logged at the end of the statement; deletes of the ctid cannot be
+	 * logged before, because the tuple is not dead until the transaction
+	 * ends.
+	 */
+	if (GrnWalEnabled(index))
+		GrnWalAppend(index, GrnWalInsert, ctid);
+
+	GrnStatInsert(index);
+	GrnCacheInvalidate(index);
+
+	PG_RETURN_BOOL(true);
+}
+
+/**
+ * groonga.beginscan() -- ambeginscan
+ */
+Datum
+groonga_beginscan(PG_FUNCTION_ARGS)
+{
+	Relation		index = (Relation) PG_GETARG_POINTER(0);
+	int				keysz = PG_GETARG_INT32(1);
+#if PG_VERSION_NUM >= 90100
+	int				norderbys = PG_GETARG_INT32(2);
+#else
+	ScanKey			key = (ScanKey) PG_GETARG_POINTER(2);
+#endif
+	IndexScanDesc	scan;
+
+#if PG_VERSION_NUM >= 90100
+	scan = RelationGetIndexScan(index, keysz, norderbys);
+#else
+	scan = RelationGetIndexScan(index, keysz, key);
+#endif
+
+	PG_RETURN_POINTER(scan);
+}
+
+/**
+ * groonga.gettuple() -- amgettuple
+ */
+Datum
+groonga_gettuple(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc	scan = (IndexScanDesc) PG_GETARG_POINTER(0);
+	ScanDirection	dir = (ScanDirection) PG_GETARG_INT32(1);
+	GrnScanDesc	   *desc = (GrnScanDesc *) scan->opaque;
+	LOCKTAG			tag;
+
+	if (desc == NULL)
+	{
+		scan->opaque = desc = GrnBeginIndexScan(scan);
+	}
+
+	if (dir != ForwardScanDirection)
+		elog(ERROR, "groonga: only supports forward scans");
+
+	if (scan->kill_prior_tuple)
+	{
+		int64	prior;
+
+		Assert(0 < desc->cursor);
+		prior = desc->cursor - 1;
+		if (desc->order != NULL)
+			prior = desc->order[prior];
+
+		/*
+		 * Deleting rows of dead tuples is only a hint, so skip it rather
+		 * than wait for groonga.optimize() or VACUUM. The table is looked
+		 * up under the lock because optimize might have replaced it.
+		 */
+		GrnLockTag(scan->indexRelation, &tag);
+		if (LockAcquire(&tag, ExclusiveLock, false, true) != LOCKACQUIRE_NOT_AVAIL)
+		{
+			desc->table = GrnLookupTable(desc->ctx, scan->indexRelation, ERROR);
+			GrnDelete(desc->ctx, desc->table, &desc->ctid[prior]);
+			if (GrnWalEnabled(scan->indexRelation))
+			{
+				GrnWalAppend(scan->indexRelation, GrnWalDelete, &desc->ctid[prior]);
+				GrnWalFlush(scan->indexRelation);
+			}
+			GrnUnlock(&tag, ExclusiveLock);
+
+			GrnStatDelete(scan->indexRelation, 1);
+			GrnCacheInvalidate(scan->indexRelation);
+		}
+	}
+
+	/* the nearest hits are exhausted; rank all of them */
+	if (desc->partial && desc->cursor >= desc->num)
+		GrnOrderRest(scan, desc);
+
+	while (desc->cursor < desc->num)
+	{
+		/* hits ordered by distance are not prefetched */
+		if (desc->order != NULL)
+			scan->xs_ctup.t_self = desc->ctid[desc->order[desc->cursor++]];
+		else
+		{
+			GrnPrefetch(scan, desc);
+			scan->xs_ctup.t_self = desc->ctid[desc->cursor++];
+		}
+
+#if PG_VERSION_NUM >= 80400
+		scan->xs_recheck = desc->recheck;
+#endif
+		PG_RETURN_BOOL(true);
+	}
+
+	PG_RETURN_BOOL(false);
+}
+
+/*
+ * Issue read-ahead requests for heap blocks of upcoming hits. ctids are
+ * sorted, so we keep up to effective_io_concurrency distinct blocks
+ * prefetched ahead of the cursor, as bitmap heap scans do.
+ */
+static void
+GrnPrefetch(IndexScanDesc scan, GrnScanDesc *desc)
+{
+#ifdef USE_PREFETCH
+	BlockNumber		blkno;
+
+	if (target_prefetch_pages <= 0 || scan->heapRelation == NULL)
+		return;
+
+	/* the block under the cursor is being read now */
+	blkno = ItemPointerGetBlockNumber(&desc->ctid[desc->cursor]);
+	if (desc->prefetch_pages > 0 && desc->cursor < desc->prefetch &&
+		(desc->cursor == 0 ||
+		 blkno != ItemPointerGetBlockNumber(&desc->ctid[desc->cursor - 1])))
+		desc->prefetch_pages--;
+
+	while (desc->prefetch_pages < target_prefetch_pages &&
+		   desc->prefetch < desc->num)
+	{
+		blkno = ItemPointerGetBlockNumber(&desc->ctid[desc->prefetch++]);
+		if (blkno == desc->prefetch_block)
+			continue;
+
+		desc->prefetch_block = blkno;
+		desc->prefetch_pages++;
+		PrefetchBuffer(scan->heapRelation, MAIN_FORKNUM, blkno);
+	}
+#endif
+}
+
+/**
+ * groonga.getbitmap() -- amgetbitmap
+ */
+Datum
+groonga_getbitmap(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 80400
+	IndexScanDesc	scan = (IndexScanDesc) PG_GETARG_POINTER(0);
+	TIDBitmap	   *tbm = (TIDBitmap *) PG_GETARG_POINTER(1);
+	GrnScanDesc	   *desc = (GrnScanDesc *) scan->opaque;
+
+	if (desc == NULL)
+	{
+		scan->opaque = desc = GrnBeginIndexScan(scan);
+	}
+
+	tbm_add_tuples(tbm, desc->ctid, desc->num, desc->recheck);
+
+	PG_RETURN_INT64(desc->num);
+#else
+	IndexScanDesc scan = (IndexScanDesc) PG_GETARG_POINTER(0);
+	ItemPointer tids = (ItemPointer) PG_GETARG_POINTER(1);
+	int32		max_tids = PG_GETARG_INT32(2);
+	int32	   *returned_tids = (int32 *) PG_GETARG_POINTER(3);
+
+	GrnScanDesc	   *desc = (GrnScanDesc *) scan->opaque;
+	int64			ntids;
+
+	if (max_tids <= 0)			/* behave correctly in boundary case */
+		PG_RETURN_BOOL(true);
+
+	if (desc == NULL)
+	{
+		scan->opaque = desc = GrnBeginIndexScan(scan);
+	}
+
+	ntids = Min(max_tids, desc->num - desc->cursor);
+	memcpy(tids, desc->ctid + desc->cursor, ntids * sizeof(ItemPointerData));
+
+	*returned_tids = ntids;
+	desc->cursor += ntids;
+	PG_RETURN_BOOL(desc->cursor < desc->num);
+#endif
+}
+
+/**
+ * groonga.rescan() -- amrescan
+ *
+ * この段階ではスキャンキーがまだ与えられていない場合がある。
+ * まだ検索を行わなず、後から gettuple または getbitmap で検索する。
+ */
+Datum
+groonga_rescan(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc	scan = (IndexScanDesc) PG_GETARG_POINTER(0);
+	ScanKey			keys = (ScanKey) PG_GETARG_POINTER(1);
+#if PG_VERSION_NUM >= 90100
+	ScanKey			orderbys = (ScanKey) PG_GETARG_POINTER(3);
+#endif
+	GrnScanDesc	   *desc = (GrnScanDesc *) scan->opaque;
+
+	if (desc != NULL)
+	{
+		GrnEndScan(desc);
+		scan->opaque = NULL;
+	}
+
+	if (keys && scan->numberOfKeys > 0)
+		memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
+#if PG_VERSION_NUM >= 90100
+	if (orderbys && scan->numberOfOrderBys > 0)
+		memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+#endif
+
+	PG_RETURN_VOID();
+}
+
+/**
+ * groonga.endscan() -- amendscan
+ */
+Datum
+groonga_endscan(PG_FUNCTION_ARGS)
+{
+	IndexScanDesc	scan = (IndexScanDesc) PG_GETARG_POINTER(0);
+	GrnScanDesc	   *desc = (GrnScanDesc *) scan->opaque;
+
+	if (desc != NULL)
+		GrnEndScan(desc);
+
+	PG_RETURN_VOID();
+}
+
+/**
+ * groonga.build() -- ambuild
+ */
+Datum
+groonga_build(PG_FUNCTION_ARGS)
+{
+	Relation			heap = (Relation) PG_GETARG_POINTER(0);
+	Relation			index = (Relation) PG_GETARG_POINTER(1);
+	IndexInfo		   *indexInfo = (IndexInfo *) PG_GETARG_POINTER(2);
+	IndexBuildResult   *result;
+	GrnBuildState		state;
+
+	if (indexInfo->ii_Unique)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("groonga: do not support unique index")));
+
+	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
+	
+	PG_TRY();
+	{
+		state.ctx = GrnOpen();
+		initStringInfo(&state.buf);
+
+		state.table = GrnCreate(state.ctx, index, NULL);
+
+		result->heap_tuples = result->index_tuples =
+			IndexBuildHeapScan(heap, index, indexInfo, true, GrnBuildCallback, &state);
+
+		/* standbys rebuild their objects in the new generation */
+		if (GrnGetOptions(index)->wal)
+			GrnWalRestart(index);
+	}
+	PG_CATCH();
+	{
+		GrnDrop(state.ctx, index);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	PG_RETURN_POINTER(result);
+}
+
+/**
+ * groonga.bulkdelete() -- ambulkdelete
+ */
+Datum
+groonga_bulkdelete(PG_FUNCTION_ARGS)
+{
+	IndexVacuumInfo		   *info = (IndexVacuumInfo *) PG_GETARG_POINTER(0);
+	IndexBulkDeleteResult  *stats = (IndexBulkDeleteResult *) PG_GETARG_POINTER(1);
+	IndexBulkDeleteCallback	callback = (IndexBulkDeleteCallback) PG_GETARG_POINTER(2);
+	void				   *callback_state = (void *) PG_GETARG_POINTER(3);
+
+	Relation			index = info->index;
+	grn_ctx			   *ctx = GrnOpen();
+	grn_obj			   *table;
+	double				tuples_removed;
+	BlockNumber		   *ranges;
+	int					nranges;
+	BlockNumber			ndirty;
+	LOCKTAG				tag;
+
+	(void) GrnReplay(ctx, index);
+	table = GrnLookupTable(ctx, index, WARNING);
+
+	if (stats == NULL)
+		stats = GrnBulkDeleteResult(info, ctx, table);
+
+	if (table == NULL || callback == NULL)
+		PG_RETURN_POINTER(stats);
+
+	tuples_removed = 0;
+
+	nranges = GrnDirtyRanges(info, &ranges, &ndirty);
+	if (nranges >= 0 &&
+		(GrnGetOptions(index)->rowkey == GrnRowKeyPat ||
+		 (double) ndirty * MaxHeapTuplesPerPage < grn_table_size(ctx, table)))
+		elog(DEBUG1, "groonga: vacuuming \"%s\" checks rows in %u heap blocks not all-visible",
+			RelationGetRelationName(index), ndirty);
+	else
+		elog(DEBUG1, "groonga: vacuuming \"%s\" checks all rows",
+			RelationGetRelationName(index));
+
+	if (nranges >= 0 && GrnGetOptions(index)->rowkey == GrnRowKeyPat)
+	{
+		int		i;
+
+		/* keys are ordered by ctid; scan only the ranges of dirty blocks */
+		for (i = 0; i < nranges; i++)
+		{
+			int64	minkey = ((int64) ranges[i * 2]) << 16;
+			int64	maxkey = ((int64) ranges[i * 2 + 1]) << 16 | 0xFFFF;
+
+			tuples_removed += GrnBulkDeleteCursor(ctx, index, table,
+				grn_table_cursor_open(ctx, table, &minkey, sizeof(minkey),
+					&maxkey, sizeof(maxkey), 0, -1, GRN_CURSOR_ASCENDING),
+				callback, callback_state);
+		}
+	}
+	else if (nranges >= 0 &&
+			 (double) ndirty * MaxHeapTuplesPerPage < grn_table_size(ctx, table))
+	{
+		int		i;
+
+		/* probe every possible ctid in dirty blocks */
+		for (i = 0; i < nranges; i++)
+		{
+			BlockNumber		blkno;
+
+			for (blkno = ranges[i * 2]; blkno <= ranges[i * 2 + 1]; blkno++)
+			{
+				OffsetNumber	offnum;
+
+				CHECK_FOR_INTERRUPTS();
+
+				for (offnum = FirstOffsetNumber; offnum <= MaxHeapTuplesPerPage; offnum++)
+				{
+					ItemPointerData	ctid;
+					int64			rowkey;
+
+					ItemPointerSet(&ctid, blkno, offnum);
+					rowkey = CtidToInt64(&ctid);
+					if (grn_table_get(ctx, table, &rowkey, sizeof(rowkey)) != GRN_ID_NIL &&
+						callback(&ctid, callback_state))
+					{
+						GrnLock(index, ExclusiveLock, &tag);
+						GrnDelete(ctx, table, &ctid);
+						if (GrnWalEnabled(index))
+							GrnWalAppend(index, GrnWalDelete, &ctid);
+						GrnUnlock(&tag, ExclusiveLock);
+
+						tuples_removed += 1;
+					}
+				}
+			}
+		}
+	}
+	else
+	{
+		tuples_removed = GrnBulkDeleteCursor(ctx, index, table,
+			grn_table_cursor_open(ctx, table, NULL, 0, NULL, 0, 0, -1, 0),
+			callback, callback_state);
+	}
+
+	if (nranges > 0)
+		pfree(ranges);
+
+	/*
+	 * Deletes are logged in batches. Heap tuples are not removed until
+	 * index vacuuming finishes, so their ctids cannot be reused until then.
+	 */
+	if (GrnWalEnabled(index))
+		GrnWalFlush(index);
+
+	stats->tuples_removed = tuples_removed;
+	GrnStatDelete(index, (int64) tuples_removed);
+	if (tuples_removed > 0)
+		GrnCacheInvalidate(index);
+
+	PG_RETURN_POINTER(stats);
+}
+
+/*
+ * GrnBulkDeleteCursor -- delete rows under the cursor if callback says so.
+ */
+static double
+GrnBulkDeleteCursor(
+	grn_ctx				   *ctx,
+	Relation				index,
+	grn_obj				   *table,
+	grn_table_cursor	   *cursor,
+	IndexBulkDeleteCallback	callback,
+	void				   *callback_state)
+{
+	double		tuples_removed = 0;
+	LOCKTAG		tag;
+
+	if (cursor == NULL)
+		elog(ERROR, "grn_table_cursor_open: %s", ctx->errbuf);
+
+	PG_TRY();
+	{
+		while (grn_table_cursor_next(ctx, cursor) != GRN_ID_NIL)
+		{
+			int64		   *rowkey;
+			int				keysize;
+			ItemPointerData	ctid;
+
+			CHECK_FOR_INTERRUPTS();
+
+			keysize = grn_table_cursor_get_key(ctx, cursor, (void**) &rowkey);
+			if (keysize != sizeof(int64))
+				elog(ERROR, "groonga: unexpected keysize = %d", keysize);
+
+			ctid = Int64ToCtid(*rowkey);
+			if (callback(&ctid, callback_state))
+			{
+				GrnLock(index, ExclusiveLock, &tag);
+				GrnDelete(ctx, table, &ctid);
+				if (GrnWalEnabled(index))
+					GrnWalAppend(index, GrnWalDelete, &ctid);
+				GrnUnlock(&tag, ExclusiveLock);
+
+				tuples_removed += 1;
+			}
+		}
+		grn_table_cursor_close(ctx, cursor);
+	}
+	PG_CATCH();
+	{
+		grn_table_cursor_close(ctx, cursor);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	return tuples_removed;
+}
+
+/*
+ * GrnDirtyRanges -- ranges of heap blocks that might have dead tuples.
+ *
+ * Blocks set in the visibility map have no dead tuples, because VACUUM
+ * doesn't set the bit for blocks in which it has collected dead tuples.
+ * Returns the number of ranges, with [start, end] pairs in *ranges and
+ * the number of dirty blocks in *ndirty, or -1 if all rows should be
+ * visited.
+ */
+static int
+GrnDirtyRanges(IndexVacuumInfo *info, BlockNumber **ranges, BlockNumber *ndirty)
+{
+#if PG_VERSION_NUM >= 80400
+	Relation		heap;
+	BlockNumber		nblocks;
+	BlockNumber		blkno;
+	Buffer			vmbuffer = InvalidBuffer;
+	int				nranges = 0;
+	int				maxranges = 64;
+
+	*ranges = NULL;
+	*ndirty = 0;
+
+#if PG_VERSION_NUM < 90000
+	/* old VACUUM FULL moves tuples and doesn't maintain the map */
+	if (info->vacuum_full)
+		return -1;
+#endif
+
+	heap = heap_open(info->index->rd_index->indrelid, NoLock);
+	nblocks = RelationGetNumberOfBlocks(heap);
+	*ranges = (BlockNumber *) palloc(sizeof(BlockNumber) * 2 * maxranges);
+
+	for (blkno = 0; blkno < nblocks; blkno++)
+	{
+		if (visibilitymap_test(heap, blkno, &vmbuffer))
+			continue;
+
+		(*ndirty)++;
+		if (nranges > 0 && (*ranges)[nranges * 2 - 1] == blkno - 1)
+		{
+			(*ranges)[nranges * 2 - 1] = blkno;
+			continue;
+		}
+
+		if (nranges >= maxranges)
+		{
+			maxranges *= 2;
+			*ranges = (BlockNumber *) repalloc(*ranges,
+							sizeof(BlockNumber) * 2 * maxranges);
+		}
+		(*ranges)[nranges * 2] = (*ranges)[nranges * 2 + 1] = blkno;
+		nranges++;
+	}
+
+	if (BufferIsValid(vmbuffer))
+		ReleaseBuffer(vmbuffer);
+	heap_close(heap, NoLock);
+
+	/* not worth restricting if most of blocks are dirty */
+	if (*ndirty > nblocks / 2)
+	{
+		pfree(*ranges);
+		return -1;
+	}
+
+	if (nranges == 0)
+		pfree(*ranges);
+	return nranges;
+#else
+	/* no visibility map */
+	return -1;
+#endif
+}
+
+/**
+ * groonga.vacuumcleanup() -- amvacuumcleanup
+ */
+Datum
+groonga_vacuumcleanup(PG_FUNCTION_ARGS)
+{
+	IndexVacuumInfo *info = (IndexVacuumInfo *) PG_GETARG_POINTER(0);
+	IndexBulkDeleteResult *stats = (IndexBulkDeleteResult *) PG_GETARG_POINTER(1);
+
+	if (stats == NULL)
+	{
+		Relation	index = info->index;
+		grn_ctx	   *ctx = GrnOpen();
+		grn_obj	   *table = GrnLookupTable(ctx, index, WARNING);
+
+		stats = GrnBulkDeleteResult(info, ctx, table);
+	}
+	else if (grnOptimizeThreshold > 0 && GrnGetOptions(info->index)->store)
+	{
+		/*
+		 * Some rows were removed in bulkdelete. Rewrite the index if
+		 * the lexicon has too many entries without postings.
+		 */
+		Relation	index = info->index;
+		grn_ctx	   *ctx = GrnOpen();
+		double		fragmentation = GrnFragmentation(ctx, index);
+
+		if (fragmentation >= grnOptimizeThreshold)
+		{
+			ereport(info->message_level,
+				(errmsg("groonga: optimizing index \"%s\" (%.1f%% fragmented)",
+					RelationGetRelationName(index), fragmentation * 100)));
+			stats->num_index_tuples = GrnOptimize(ctx, index);
+		}
+	}
+
+	/*
+	 * Restart the change log when it has more records than rows in the
+	 * index; standbys rebuild from the heap faster than they replay it.
+	 */
+	if (GrnGetOptions(info->index)->wal)
+	{
+		GrnWalPosition	latest;
+
+		if (GrnWalLatest(info->index, &latest) &&
+			latest.nrecords > stats->num_index_tuples)
+		{
+			ereport(info->message_level,
+				(errmsg("groonga: restarting change log of index \"%s\" (%lld records)",
+					RelationGetRelationName(info->index), (long long) latest.nrecords)));
+			GrnWalRestart(info->index);
+		}
+	}
+
+	PG_RETURN_POINTER(stats);
+}
+
+/**
+ * groonga.costestimate() -- amcostestimate
+ */
+Datum
+groonga_costestimate(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 90100
+	IndexOptInfo   *info = (IndexOptInfo *) PG_GETARG_POINTER(1);
+	List		   *indexQuals = (List *) PG_GETARG_POINTER(2);
+	List		   *indexOrderBys = (List *) PG_GETARG_POINTER(3);
+	Cost		   *indexStartupCost = (Cost *) PG_GETARG_POINTER(5);
+	Cost		   *indexTotalCost = (Cost *) PG_GETARG_POINTER(6);
+	Selectivity	   *indexSelectivity = (Selectivity *) PG_GETARG_POINTER(7);
+	Relation		index;
+	bool			nearest;
+	double			nhits;
+	double			ncandidates;
+	Cost			cost;
+#endif
+
+	/*
+	 * We cannot use genericcostestimate because it is a static funciton.
+	 * Use gistcostestimate instead, which just calls genericcostestimate.
+	 */
+	gistcostestimate(fcinfo);
+
+#if PG_VERSION_NUM >= 90100
+	if (indexOrderBys == NIL)
+		PG_RETURN_VOID();
+
+	/*
+	 * ORDER BY <~> computes distances of the hits before returning the
+	 * first row. Without conditions, GrnOrderNearest computes only those of
+	 * the candidates at first, but all hits are ranked when more are read.
+	 */
+	index = index_open(info->indexoid, NoLock);
+	nearest = (indexQuals == NIL && GrnCanOrderNearest(GrnGetOptions(index)));
+	index_close(index, NoLock);
+
+	nhits = Max(info->tuples * *indexSelectivity, 1.0);
+	ncandidates = (nearest ? Min(nhits, GrnSimilarCandidates) : nhits);
+	cost = GrnSimilarCost * cpu_operator_cost;
+
+	if (nearest)
+	{
+		*indexStartupCost += ncandidates * cost;
+		*indexTotalCost += (ncandidates + nhits) * cost;
+	}
+	else
+	{
+		*indexTotalCost += nhits * cost;
+		*indexStartupCost = *indexTotalCost;
+	}
+#endif
+
+	PG_RETURN_VOID();
+}
+
+/**
+ * groonga.options() -- amoptions
+ */
+Datum
+groonga_options(PG_FUNCTION_ARGS)
+{
+	Datum		reloptions = PG_GETARG_DATUM(0);
+	bool		validate = PG_GETARG_BOOL(1);
+	GrnOptions *result;
+
+	result = GrnParseOptions(reloptions, validate);
+	if (result)
+		PG_RETURN_BYTEA_P(result);
+	PG_RETURN_NULL();
+}
+
+static void
+GrnBuildCallback(
+	Relation	index,
+	HeapTuple	htup,
+	Datum	   *values,
+	bool	   *nulls,
+	bool		tupleIsAlive,
+	void	   *context)
+{
+	GrnBuildState  *state = (GrnBuildState *) context;
+
+	/*
+	 * No lock required here because the caller must hold an exclusive lock
+	 * on the postgres' index relation.
+	 */
+	GrnInsert(state->ctx, index, state->table, values, nulls, &htup->t_self);
+}
+
+static GrnScanDesc *
 GrnBeginScan(
 	Relation index,
 	int nkeys,
-	const ScanKeyData keys[/*nkeys*/])
+	const ScanKeyData keys[/*nkeys*/],
+	int norderbys,
+	const ScanKeyData orderbys[/*norderbys*/],
+	bool limited)
 {
 	StringInfoData	buf;
 	TupleDesc		tupdesc = RelationGetDescr(index);
 	int				i;
-	text		   *res;
 	grn_ctx		   *ctx;
 	bool			isQuery;
 	bool			needs_terminator = false;
-	char		   *token;
+	bool			recheck = false;
+	StringInfoData	filter;
+	GrnScanDesc	   *desc;
+	GrnScanTiming	timing;
+	instr_time		lap;
+
+	INSTR_TIME_SET_CURRENT(lap);
+	memset(&timing, 0, sizeof(timing));
 
 	isQuery = (nkeys > 0 && keys[0].sk_strategy == GrnQueryStrategyNumber);
 	if (isQuery && nkeys != 1)
 		elog(ERROR, "groonga: cannot use multiple query keys in the same query");
 
 	ctx = GrnOpen();
+	(void) GrnReplay(ctx, index);
 
-	/* TODO: rewrite the code with DB API */
+	/*
+	 * TODO: rewrite the code with DB API
+	 *
+	 * Results are sorted by ctid after parsing rather than with
+	 * "--sortby _key", so that each phase can be timed separately.
+	 */
 	initStringInfo(&buf);
 	appendStringInfo(&buf,
-		"select --table t%u --sortby _key --output_columns _key,_score --limit -1 ",
+		"select --table t%u --output_columns _key,_score ",
 		index->rd_node.relNode);
 
+	/* geo conditions are ANDed in --filter */
+	initStringInfo(&filter);
+
 	for (i = 0; i < nkeys; i++)
 	{
 		const char *attname;
@@ -728,40 +2383,245 @@ GrnBeginScan(
 			const char *str;
 			int			len;
 
-			static const char *operators[] =
+			static const char *operators[] =
+			{
+				":<",
+				":<=",
+				":",
+				":>=",
+				":>",
+				":!",
+				":@"
+			};
+
+			if (isQuery)
+				elog(ERROR, "groonga: cannot use both query and non-query keys in the same scan");
+
+			/*
+			 * Without positions, groonga matches documents that contain
+			 * all tokens of the keyword in any order.
+			 */
+			if (keys[i].sk_strategy == GrnContainStrategyNumber &&
+				!GrnGetOptions(index)->with_position)
+				recheck = true;
+
+			/*
+			 * Without stored values, postings of deleted rows are never
+			 * removed and might point to rows inserted later. Values to
+			 * compare are not in groonga either, so the key doesn't narrow
+			 * the search and every row is rechecked.
+			 */
+			if (!GrnGetOptions(index)->store && GrnIsTextColumn(index, attno + 1))
+			{
+				recheck = true;
+				if (keys[i].sk_strategy != GrnContainStrategyNumber)
+					break;
+			}
+
+			GrnAppendConjunction(&buf, &needs_terminator);
+
+			attname = NameStr(tupdesc->attrs[attno]->attname);
+			str = GrnGetValue(index, attno + 1, keys[i].sk_argument, &len);
+
+			/* attname:{op}value */
+			appendStringInfoString(&buf, attname);
+			appendStringInfoString(&buf, operators[keys[i].sk_strategy - 1]);
+			appendStringEscaped(&buf, str, len);
+			break;
+		}
+		case GrnLikeStrategyNumber:
+		case GrnILikeStrategyNumber:
+		case GrnRegexStrategyNumber:
+		case GrnIRegexStrategyNumber:
+		{
+			text		   *pattern = DatumGetTextPP(keys[i].sk_argument);
+			GrnOptions	   *options = GrnGetOptions(index);
+			bool			icase;
+			List		   *literals;
+			ListCell	   *cell;
+
+			if (isQuery)
+				elog(ERROR, "groonga: cannot use both query and non-query keys in the same scan");
+
+			/* patterns are always rechecked with the heap tuple */
+			recheck = true;
+
+			/*
+			 * Case-insensitive patterns need normalized lexicons too.
+			 * Otherwise the key doesn't narrow the search and every row
+			 * is rechecked.
+			 */
+			icase = (keys[i].sk_strategy == GrnILikeStrategyNumber ||
+					 keys[i].sk_strategy == GrnIRegexStrategyNumber);
+			if (!GrnCanFindSubstring(options->tokenizer) ||
+				(icase && !options->normalize))
+				break;
+
+			if (keys[i].sk_strategy == GrnLikeStrategyNumber ||
+				keys[i].sk_strategy == GrnILikeStrategyNumber)
+				literals = GrnLikeLiterals(VARDATA_ANY(pattern),
+										   VARSIZE_ANY_EXHDR(pattern));
+			else
+				literals = GrnRegexLiterals(VARDATA_ANY(pattern),
+											VARSIZE_ANY_EXHDR(pattern));
+
+			/* every literal must be contained */
+			attname = NameStr(tupdesc->attrs[attno]->attname);
+			foreach (cell, literals)
+			{
+				const char *literal = (const char *) lfirst(cell);
+
+				GrnAppendConjunction(&buf, &needs_terminator);
+				appendStringInfoString(&buf, attname);
+				appendStringInfoString(&buf, ":@");
+				appendStringEscaped(&buf, literal, strlen(literal));
+			}
+			list_free_deep(literals);
+			break;
+		}
+		case GrnPrefixStrategyNumber:
+		{
+			const char *str;
+			int			len;
+
+			if (isQuery)
+				elog(ERROR, "groonga: cannot use both query and non-query keys in the same scan");
+
+			/* the key doesn't narrow the search unless GrnCanFindPrefix */
+			recheck = true;
+			if (!GrnCanFindPrefix(GrnGetOptions(index)))
+				break;
+
+			str = GrnGetValue(index, attno + 1, keys[i].sk_argument, &len);
+			if (len == 0)
+				break;	/* every row matches */
+
+			/* attname:^value */
+			GrnAppendConjunction(&buf, &needs_terminator);
+			attname = NameStr(tupdesc->attrs[attno]->attname);
+			appendStringInfoString(&buf, attname);
+			appendStringInfoString(&buf, ":^");
+			appendStringEscaped(&buf, str, len);
+			break;
+		}
+		case GrnOverlapStrategyNumber:
+		case GrnContainsAllStrategyNumber:
+		{
+			ArrayType  *array = DatumGetArrayTypeP(keys[i].sk_argument);
+			Oid			elemtype = ARR_ELEMTYPE(array);
+			int16		typlen;
+			bool		typbyval;
+			char		typalign;
+			Oid			outfunc;
+			bool		isvarlena;
+			Datum	   *elems;
+			bool	   *nulls;
+			int			nelems;
+			int			n;
+			bool		overlap;
+			bool		first = true;
+
+			if (isQuery)
+				elog(ERROR, "groonga: cannot use both query and non-query keys in the same scan");
+
+			/* lexicons might be normalized */
+			recheck = true;
+
+			get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+			deconstruct_array(array, elemtype, typlen, typbyval, typalign,
+							  &elems, &nulls, &nelems);
+			getTypeOutputInfo(elemtype, &outfunc, &isvarlena);
+
+			/*
+			 * && needs any of the elements in a conjunction, and @> needs
+			 * each of them in separate conjunctions. NULL elements never
+			 * match, so @> with them and && without others find nothing;
+			 * row keys are never negative.
+			 */
+			overlap = (keys[i].sk_strategy == GrnOverlapStrategyNumber);
+			attname = NameStr(tupdesc->attrs[attno]->attname);
+			for (n = 0; n < nelems; n++)
 			{
-				":<",
-				":<=",
-				":",
-				":>=",
-				":>",
-				":!",
-				":@"
-			};
+				char   *str;
+
+				if (nulls[n])
+				{
+					if (overlap)
+						continue;
+					GrnAppendConjunction(&buf, &needs_terminator);
+					appendStringInfoString(&buf, "_key:-1");
+					break;
+				}
+
+				/* attname:@element */
+				if (!overlap || first)
+					GrnAppendConjunction(&buf, &needs_terminator);
+				else
+					appendStringInfoString(&buf, " OR ");
+				first = false;
+
+				str = OidOutputFunctionCall(outfunc, elems[n]);
+				appendStringInfoString(&buf, attname);
+				appendStringInfoString(&buf, ":@");
+				appendStringEscaped(&buf, str, strlen(str));
+				pfree(str);
+			}
+			if (overlap && first)
+			{
+				GrnAppendConjunction(&buf, &needs_terminator);
+				appendStringInfoString(&buf, "_key:-1");
+			}
+
+			pfree(elems);
+			pfree(nulls);
+			break;
+		}
+		case GrnInBoxStrategyNumber:
+		case GrnInCircleStrategyNumber:
+		{
+			BOX			box;
 
 			if (isQuery)
 				elog(ERROR, "groonga: cannot use both query and non-query keys in the same scan");
 
-			if (i > 0)
-				appendStringInfoString(&buf, ")+(");
+			/*
+			 * A circle is searched as its bounding box, because groonga
+			 * measures radius in meters on the earth while postgres does
+			 * in degrees on the plane. Boundaries are also rechecked since
+			 * groonga rounds coordinates to milliseconds.
+			 */
+			recheck = true;
+			if (keys[i].sk_strategy == GrnInBoxStrategyNumber)
+				box = *DatumGetBoxP(keys[i].sk_argument);
 			else
 			{
-				appendStringInfoString(&buf, "--query \"(");
-				needs_terminator = true;
+				CIRCLE *circle = DatumGetCircleP(keys[i].sk_argument);
+
+				box.high.x = circle->center.x + circle->radius;
+				box.high.y = circle->center.y + circle->radius;
+				box.low.x = circle->center.x - circle->radius;
+				box.low.y = circle->center.y - circle->radius;
 			}
 
-			attname = NameStr(tupdesc->attrs[attno]->attname);
-			str = GrnGetValue(index, attno + 1, keys[i].sk_argument, &len);
+			if (filter.len > 0)
+				appendStringInfoString(&filter, " && ");
 
-			/* attname:{op}value */
-			appendStringInfoString(&buf, attname);
-			appendStringInfoString(&buf, operators[keys[i].sk_strategy - 1]);
-			appendStringEscaped(&buf, str, len);
+			/* geo_in_rectangle(attname, "top_left", "bottom_right") */
+			attname = NameStr(tupdesc->attrs[attno]->attname);
+			appendStringInfo(&filter, "geo_in_rectangle(%s, \\\"", attname);
+			appendGeoPoint(&filter, box.low.x, box.high.y);
+			appendStringInfoString(&filter, "\\\", \\\"");
+			appendGeoPoint(&filter, box.high.x, box.low.y);
+			appendStringInfoString(&filter, "\\\")");
 			break;
 		}
 		case GrnQueryStrategyNumber:
 		{
 			text *key = DatumGetTextPP(keys[i].sk_argument);
+
+			/* queries cannot be rechecked */
+			GrnCheckQuerySupported(index);
+
 			appendBinaryStringInfo(&buf, VARDATA_ANY(key), VARSIZE_ANY_EXHDR(key));
 			break;
 		}
@@ -772,18 +2632,621 @@ GrnBeginScan(
 
 	if (needs_terminator)
 		appendStringInfoString(&buf, ")\"");
+	if (filter.len > 0)
+		appendStringInfo(&buf, " --filter \"%s\"", filter.data);
 
-#ifdef NOT_USED
-	GrnLock(index, ShareLock);
+	/*
+	 * With groonga.max_hits, at most that many rows are transferred and
+	 * GrnParseHits fails if more rows matched. Only searches narrowed by
+	 * conditions are limited; scans of every row, e.g. for patterns that
+	 * the lexicon cannot narrow or for ORDER BY alone, are rechecked or
+	 * ranked by postgres, and internal callers need all rows.
+	 */
+	if (limited && grnMaxHits > 0 &&
+		(isQuery || needs_terminator || filter.len > 0))
+		appendStringInfo(&buf, " --limit %d", grnMaxHits);
+	else
+	{
+		limited = false;
+		appendStringInfoString(&buf, " --limit -1");
+	}
+	pfree(filter.data);
+
+	timing.build = GrnLap(&lap);
+
+	desc = (GrnScanDesc *) palloc(sizeof(GrnScanDesc));
+	desc->ctx = ctx;
+	desc->table = NULL;
+	desc->cursor = 0;
+	desc->recheck = recheck;
+	desc->tableoid = index->rd_index->indrelid;
+	desc->command = buf.data;
+	desc->nbytes = 0;
+	desc->prefetch = 0;
+	desc->prefetch_block = InvalidBlockNumber;
+	desc->prefetch_pages = 0;
+	desc->order = NULL;
+	desc->reserved = 0;
+	desc->partial = false;
+	desc->max_hits = (limited ? grnMaxHits : 0);
+
+	if (norderbys > 1)
+		elog(ERROR, "groonga: cannot use multiple ORDER BY keys in the same scan");
+
+	/*
+	 * ORDER BY <~> without conditions would rank every row of the table
+	 * before returning the first one, so only the nearest are loaded first.
+	 */
+	if (nkeys == 0 && norderbys > 0 &&
+		GrnOrderNearest(index, desc, &orderbys[0]))
+		timing.sort = GrnLap(&lap);
+	else
+	{
+		GrnSearch(index, desc, &timing, &lap);
+		if (norderbys > 0)
+		{
+			GrnOrderHits(index, desc, &orderbys[0]);
+			timing.sort += GrnLap(&lap);
+		}
+	}
+
+	desc->timing = timing;
+
+	/* register the desc into the global list */
+	desc->next = grnScanDescs;
+	grnScanDescs = desc;
+
+	GrnStatScan(index, desc->num, desc->nbytes,
+		timing.search + timing.transfer, GrnScanTotalTime(&timing));
+
+	if (grnLogMinDuration >= 0 &&
+		GrnScanTotalTime(&timing) >= grnLogMinDuration)
+		ereport(LOG,
+			(errmsg("groonga: duration: %.3f ms  hits: " INT64_FORMAT "  command: %s",
+				GrnScanTotalTime(&timing), desc->num, desc->command),
+			 errdetail("build: %.3f ms, search: %.3f ms, transfer: %.3f ms, parse: %.3f ms, sort: %.3f ms",
+				timing.build, timing.search, timing.transfer,
+				timing.parse, timing.sort)));
+
+	return desc;
+}
+
+/*
+ * Append a separator of conditions in --query, or open the option.
+ */
+static void
+GrnAppendConjunction(StringInfo buf, bool *needs_terminator)
+{
+	if (*needs_terminator)
+		appendStringInfoString(buf, ")+(");
+	else
+	{
+		appendStringInfoString(buf, "--query \"(");
+		*needs_terminator = true;
+	}
+}
+
+/*
+ * Any substring can be found only with n-gram tokenizers that split every
+ * character class. Others keep runs of alphabets, digits or symbols as
+ * single tokens, so a part of a word cannot be found.
+ */
+static bool
+GrnCanFindSubstring(const char *tokenizer)
+{
+	return strncmp(tokenizer, "Token", 5) == 0 &&
+		   strstr(tokenizer, "gramSplitSymbolAlphaDigit") != NULL;
+}
+
+/*
+ * A prefix of whole values can be found only in patricia trie lexicons of
+ * untokenized values. Tokenized lexicons have terms starting in the middle
+ * of values, and prefixes longer than a token or containing separators are
+ * not in them. &^ always normalizes, so the lexicon must be normalized too.
+ */
+static bool
+GrnCanFindPrefix(const GrnOptions *options)
+{
+	return strcmp(options->tokenizer, "none") == 0 &&
+		   options->lexicon == GrnLexiconPat &&
+		   options->normalize;
+}
+
+/*
+ * GrnLikeLiterals -- returns the literal parts between wildcards of a LIKE
+ * pattern.
+ */
+static List *
+GrnLikeLiterals(const char *str, int len)
+{
+	List		   *literals = NIL;
+	StringInfoData	literal;
+	int				n;
+
+	initStringInfo(&literal);
+	for (n = 0; n <= len; n++)
+	{
+		if (n == len || str[n] == '%' || str[n] == '_')
+		{
+			if (literal.len > 0)
+			{
+				literals = lappend(literals, pstrdup(literal.data));
+				resetStringInfo(&literal);
+			}
+			continue;
+		}
+		if (str[n] == '\\' && n + 1 < len)
+			n++;
+		appendStringInfoChar(&literal, str[n]);
+	}
+	pfree(literal.data);
+
+	return literals;
+}
+
+/*
+ * GrnRegexLiterals -- returns literal strings that every string matching
+ * the regular expression must contain.
+ *
+ * The extraction is conservative; anything not understood only ends the
+ * current literal. Groups and bracket expressions are skipped as a whole,
+ * and a quantified atom is dropped from the literal unless it is required
+ * at least once. Top-level alternations and embedded options make the
+ * whole pattern unusable, and no literal is returned then.
+ */
+static List *
+GrnRegexLiterals(const char *str, int len)
+{
+	List		   *literals = NIL;
+	StringInfoData	literal;
+	int				last = -1;		/* start of the last atom in literal */
+	int				n;
+
+	/* director prefix or embedded options might change the syntax */
+	if ((len >= 3 && strncmp(str, "***", 3) == 0) ||
+		(len >= 2 && strncmp(str, "(?", 2) == 0 &&
+		 (len < 3 || (str[2] != ':' && str[2] != '=' && str[2] != '!'))))
+		return NIL;
+
+	initStringInfo(&literal);
+	for (n = 0; n < len;)
+	{
+		char	c = str[n];
+
+		switch (c)
+		{
+			case '|':
+				/* any alternative might match; give up */
+				pfree(literal.data);
+				list_free_deep(literals);
+				return NIL;
+
+			case '*':
+			case '?':
+			case '{':
+				/* the previous atom is optional */
+				if (last >= 0)
+					literal.len = last;
+				literal.data[literal.len] = '\0';
+				GrnRegexFlush(&literals, &literal);
+				last = -1;
+				if (c == '{')
+				{
+					while (n < len && str[n] != '}')
+						n++;
+				}
+				n++;
+				break;
+
+			case '(':
+			{
+				int		depth = 0;
+
+				/* skip the group; alternations inside are harmless */
+				GrnRegexFlush(&literals, &literal);
+				last = -1;
+				for (; n < len; n++)
+				{
+					if (str[n] == '\\')
+						n++;
+					else if (str[n] == '[')
+						n = GrnRegexSkipBracket(str, len, n) - 1;
+					else if (str[n] == '(')
+						depth++;
+					else if (str[n] == ')' && --depth == 0)
+						break;
+				}
+				n++;
+				break;
+			}
+
+			case '[':
+				GrnRegexFlush(&literals, &literal);
+				last = -1;
+				n = GrnRegexSkipBracket(str, len, n);
+				break;
+
+			case '\\':
+				if (n + 1 < len && !isalnum((unsigned char) str[n + 1]))
+				{
+					/* an escaped punctuation is an ordinary character */
+					last = literal.len;
+					n++;
+					appendBinaryStringInfo(&literal, str + n, pg_mblen(str + n));
+					n += pg_mblen(str + n);
+				}
+				else
+				{
+					/* class shorthands, constraints or back references */
+					GrnRegexFlush(&literals, &literal);
+					last = -1;
+					n += 2;
+				}
+				break;
+
+			case '+':
+				/* the previous atom is required at least once */
+				GrnRegexFlush(&literals, &literal);
+				last = -1;
+				n++;
+				break;
+
+			case '.':
+			case '^':
+			case '$':
+			case ')':
+			case '}':
+				GrnRegexFlush(&literals, &literal);
+				last = -1;
+				n++;
+				break;
+
+			default:
+				last = literal.len;
+				appendBinaryStringInfo(&literal, str + n, pg_mblen(str + n));
+				n += pg_mblen(str + n);
+				break;
+		}
+	}
+	GrnRegexFlush(&literals, &literal);
+	pfree(literal.data);
+
+	return literals;
+}
+
+/*
+ * Move a non-empty literal into the list.
+ */
+static void
+GrnRegexFlush(List **literals, StringInfo literal)
+{
+	if (literal->len > 0)
+	{
+		*literals = lappend(*literals, pstrdup(literal->data));
+		resetStringInfo(literal);
+	}
+}
+
+/*
+ * Returns the position next to the bracket expression starting at str[n].
+ */
+static int
+GrnRegexSkipBracket(const char *str, int len, int n)
+{
+	n++;							/* '[' */
+	if (n < len && str[n] == '^')
+		n++;
+	if (n < len && str[n] == ']')	/* a leading ']' is an ordinary member */
+		n++;
+	while (n < len && str[n] != ']')
+	{
+		/* backslashes are escapes in bracket expressions of AREs */
+		if (str[n] == '\\')
+		{
+			n += 2;
+			continue;
+		}
+		/* [:class:], [.coll.] and [=equiv=] may contain ']' */
+		if (str[n] == '[' && n + 1 < len &&
+			(str[n + 1] == ':' || str[n + 1] == '.' || str[n + 1] == '='))
+		{
+			char	delim = str[n + 1];
+
+			for (n += 2; n + 1 < len; n++)
+			{
+				if (str[n] == delim && str[n + 1] == ']')
+					break;
+			}
+			n += 2;
+		}
+		else
+			n++;
+	}
+	return n + 1;
+}
+
+/*
+ * GrnCountHits -- returns the number of hits in groonga without receiving
+ * the rowkeys. Rows deleted but not vacuumed yet are also counted.
+ */
+static int64
+GrnCountHits(Relation index, Datum query)
+{
+	text		   *key = DatumGetTextPP(query);
+	StringInfoData	buf;
+	text		   *res;
+	grn_ctx		   *ctx;
+	char		   *token;
+	int64			count;
+	LOCKTAG			tag;
+
+	GrnCheckQuerySupported(index);
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf,
+		"select --table t%u --output_columns _key --limit 0 ",
+		index->rd_node.relNode);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(key), VARSIZE_ANY_EXHDR(key));
+
+	ctx = GrnOpen();
+	GrnLock(index, AccessShareLock, &tag);
+	GrnCommand(ctx, buf.data, &res, NULL);
+	GrnUnlock(&tag, AccessShareLock);
+
+	if ((token = strtok(VARDATA(res), "[],")) == NULL)
+		ereport(ERROR,
+			(errmsg("unexpected result: NULL"),
+			 errcontext("query: %s", buf.data)));
+
+	count = atoi64(token);
+	GrnFreeResult(res);
+	pfree(buf.data);
+
+	return count;
+}
+
+/*
+ * GrnCountVisible -- returns the number of hits visible to the active
+ * snapshot. Only tuples in pages not marked as all-visible in the
+ * visibility map are fetched from the heap.
+ */
+static int64
+GrnCountVisible(Relation index, Datum query)
+{
+	GrnScanDesc	   *desc;
+	Relation		heap;
+	Snapshot		snapshot;
+	BlockNumber		lastblk = InvalidBlockNumber;
+	bool			all_visible = false;
+	int64			count = 0;
+	int64			i;
+#if PG_VERSION_NUM >= 80400
+	Buffer			vmbuffer = InvalidBuffer;
+
+	snapshot = GetActiveSnapshot();
+#else
+	snapshot = ActiveSnapshot;
 #endif
-	GrnCommand(ctx, buf.data, &res);
-#ifdef NOT_USED
-	GrnUnlock(index, ShareLock);
+
+	desc = GrnQueryScan(index, query, false);
+	heap = heap_open(index->rd_index->indrelid, AccessShareLock);
+
+	for (i = 0; i < desc->num; i++)
+	{
+		ItemPointerData	tid = desc->ctid[i];
+		BlockNumber		blkno = ItemPointerGetBlockNumber(&tid);
+		bool			all_dead;
+
+		/* ctids are sorted, so each block is tested only once */
+		if (blkno != lastblk)
+		{
+			CHECK_FOR_INTERRUPTS();
+#if PG_VERSION_NUM >= 80400
+			all_visible = visibilitymap_test(heap, blkno, &vmbuffer);
+#endif
+			lastblk = blkno;
+		}
+
+		if (all_visible || heap_hot_search(&tid, heap, snapshot, &all_dead))
+			count++;
+	}
+
+#if PG_VERSION_NUM >= 80400
+	if (BufferIsValid(vmbuffer))
+		ReleaseBuffer(vmbuffer);
 #endif
+	heap_close(heap, AccessShareLock);
+	GrnEndScan(desc);
+
+	return count;
+}
+
+/*
+ * Minimal JSON scanner for groonga command results.
+ *
+ * GrnJsonExpect consumes the character c if it comes next.
+ */
+static bool
+GrnJsonExpect(const char **p, char c)
+{
+	while (isspace((unsigned char) **p))
+		(*p)++;
+	if (**p != c)
+		return false;
+	(*p)++;
+	return true;
+}
+
+/*
+ * GrnJsonHex4 -- decode 4 hex digits of a \u escape.
+ */
+static pg_wchar
+GrnJsonHex4(const char *s)
+{
+	pg_wchar	code = 0;
+	int			i;
+
+	for (i = 0; i < 4; i++)
+	{
+		int		c = (unsigned char) s[i];
+
+		if (c >= '0' && c <= '9')
+			code = (code << 4) + (c - '0');
+		else if (c >= 'a' && c <= 'f')
+			code = (code << 4) + (c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			code = (code << 4) + (c - 'A' + 10);
+		else
+			elog(ERROR, "groonga: invalid escape in result");
+	}
+	return code;
+}
+
+/*
+ * GrnJsonScalar -- returns a palloc'd string or literal. Escape sequences
+ * in strings are decoded; \u escapes are converted into the server
+ * encoding.
+ */
+static char *
+GrnJsonScalar(const char **p)
+{
+	StringInfoData	buf;
+	const char	   *s;
+
+	initStringInfo(&buf);
+
+	if (GrnJsonExpect(p, '"'))
+	{
+		for (s = *p; *s != '"'; s++)
+		{
+			if (*s == '\0')
+				elog(ERROR, "groonga: unterminated string in result");
+			if (*s != '\\')
+			{
+				appendStringInfoChar(&buf, *s);
+				continue;
+			}
+
+			switch (*++s)
+			{
+			case 'b': appendStringInfoChar(&buf, '\b'); break;
+			case 'f': appendStringInfoChar(&buf, '\f'); break;
+			case 'n': appendStringInfoChar(&buf, '\n'); break;
+			case 'r': appendStringInfoChar(&buf, '\r'); break;
+			case 't': appendStringInfoChar(&buf, '\t'); break;
+			case 'u':
+			{
+				pg_wchar		code = GrnJsonHex4(s + 1);
+				unsigned char	utf8[8];
+				char		   *converted;
+				int				len;
+
+				s += 4;
+
+				/* a character out of BMP is encoded in a surrogate pair */
+				if (code >= 0xD800 && code <= 0xDBFF)
+				{
+					pg_wchar	low;
+
+					if (s[1] != '\\' || s[2] != 'u' ||
+						(low = GrnJsonHex4(s + 3)) < 0xDC00 || low > 0xDFFF)
+						elog(ERROR, "groonga: invalid escape in result");
+					code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+					s += 6;
+				}
+				else if (code >= 0xDC00 && code <= 0xDFFF)
+					elog(ERROR, "groonga: invalid escape in result");
+
+				if (code < 0x80)
+				{
+					appendStringInfoChar(&buf, (char) code);
+					break;
+				}
+
+				unicode_to_utf8(code, utf8);
+				len = pg_utf_mblen(utf8);
+				utf8[len] = '\0';
+				converted = (char *) pg_any_to_server((char *) utf8, len, PG_UTF8);
+				appendStringInfoString(&buf, converted);
+				if (converted != (char *) utf8)
+					pfree(converted);
+				break;
+			}
+			case '\0':
+				elog(ERROR, "groonga: unterminated string in result");
+				break;
+			default:
+				appendStringInfoChar(&buf, *s);
+				break;
+			}
+		}
+		*p = s + 1;
+	}
+	else
+	{
+		for (s = *p; *s && !isspace((unsigned char) *s) &&
+					 *s != ',' && *s != ']' && *s != '}'; s++)
+			appendStringInfoChar(&buf, *s);
+		if (s == *p)
+			elog(ERROR, "groonga: unexpected character in result: \"%c\"", *s);
+		*p = s;
+	}
+
+	return buf.data;
+}
+
+/*
+ * GrnJsonSkip -- skip a value including nested arrays and objects.
+ */
+static void
+GrnJsonSkip(const char **p)
+{
+	char	close;
+
+	if (GrnJsonExpect(p, '['))
+		close = ']';
+	else if (GrnJsonExpect(p, '{'))
+		close = '}';
+	else
+	{
+		pfree(GrnJsonScalar(p));
+		return;
+	}
+
+	if (GrnJsonExpect(p, close))
+		return;
+	for (;;)
+	{
+		GrnJsonSkip(p);
+		if (GrnJsonExpect(p, close))
+			return;
+		if (!GrnJsonExpect(p, ',') && !GrnJsonExpect(p, ':'))
+			elog(ERROR, "groonga: unexpected character in result: \"%c\"", **p);
+	}
+}
+
+/*
+ * GrnParseHits -- parse the result of select command into desc, sorting
+ * the hits by ctid.
+ */
+static void
+GrnParseHits(GrnScanDesc *desc, text *res, GrnScanTiming *timing, instr_time *lap)
+{
+	char		   *token;
+
+	desc->nbytes = VARSIZE(res) - VARHDRSZ;
 
 	if ((token = strtok(VARDATA(res), "[],")) != NULL)
 	{
 		int64	nhits = atoi64(token);
+
+		if (desc->max_hits > 0 && nhits > desc->max_hits)
+			ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("groonga: search matched " INT64_FORMAT " rows, more than groonga.max_hits (%d)",
+					nhits, desc->max_hits),
+				 errhint("Narrow the search condition, or raise groonga.max_hits.")));
+
 		if ((token = strtok(NULL, "[],")) != NULL &&
 			strcmp(token, "\"_key\"") == 0 &&
 			(token = strtok(NULL, "[],")) != NULL &&
@@ -793,57 +3256,58 @@ GrnBeginScan(
 			(token = strtok(NULL, "[],")) != NULL &&
 			strcmp(token, "\"Int32\"") == 0)
 		{
-			GrnScanDesc	   *desc;
+			GrnHit		   *hits;
 			int64			m, n;
+			bool			sorted = true;
 
-			desc = (GrnScanDesc *) palloc(sizeof(GrnScanDesc));
-			desc->ctx = ctx;
-			desc->table = NULL;
-			desc->cursor = 0;
-			desc->tableoid = index->rd_index->indrelid;
+			desc->reserved = nhits * (sizeof(ItemPointerData) + sizeof(int32));
+			GrnMemoryReserve(desc->reserved);
 			desc->ctid = (ItemPointer) palloc(sizeof(ItemPointerData) * nhits);
 			desc->score = (int32 *) palloc(sizeof(int32) * nhits);
 
+			hits = (GrnHit *) palloc(sizeof(GrnHit) * nhits);
 			for (m = n = 0; n < nhits; n++)
 			{
 				const char *ctid = strtok(NULL, "[],");
+				const char *score = strtok(NULL, "[],");
 				int64		v;
 
+				if ((n & 0xFFFF) == 0)
+					CHECK_FOR_INTERRUPTS();
+
 				/*
 				 * groonga インデックスに対して並行して削除処理が走った場合、
 				 * key が返却されない場合があるもよう。不正な TID なので避ける。
 				 */
 				if ((v = atoi64(ctid)) == 0)
-				{
-					if (desc->score != NULL)
-						(void) strtok(NULL, "[],");
 					continue;
-				}
-
-				desc->ctid[m] = Int64ToCtid(v);
-				if (desc->score != NULL)
-				{
-					const char *score = strtok(NULL, "[],");
-					desc->score[m] = atoi(score);
-				}
 
+				hits[m].key = v;
+				hits[m].score = atoi(score);
+				if (m > 0 && hits[m - 1].key > v)
+					sorted = false;
 				m++;
 			}
 			desc->num = m;
+			timing->parse = GrnLap(lap);
 
-			/* register the desc into the global list */
-			desc->next = grnScanDescs;
-			grnScanDescs = desc;
-
-			pfree(buf.data);
-			return desc;
+			/* groonga returns hits in the order of record ids */
+			if (!sorted)
+				qsort(hits, m, sizeof(GrnHit), GrnHitCmp);
+			for (n = 0; n < m; n++)
+			{
+				desc->ctid[n] = Int64ToCtid(hits[n].key);
+				desc->score[n] = hits[n].score;
+			}
+			pfree(hits);
+			timing->sort = GrnLap(lap);
+			return;
 		}
 	}
-	
+
 	ereport(ERROR,
 		(errmsg("unexpected result: %s", token ? token : "NULL"),
-		 errcontext("query: %s", buf.data)));
-	return NULL;
+		 errcontext("query: %s", desc->command)));
 }
 
 static void
@@ -861,11 +3325,525 @@ GrnEndScan(GrnScanDesc *desc)
 		}
 	}
 
+	GrnMemoryRelease(desc->reserved);
 	pfree(desc->ctid);
 	pfree(desc->score);
+	pfree(desc->command);
+	if (desc->order != NULL)
+		pfree(desc->order);
 	pfree(desc);
 }
 
+/*
+ * GrnQueryScan -- search the index with a groonga.query outside of scans.
+ * groonga.max_hits applies if limited.
+ */
+static GrnScanDesc *
+GrnQueryScan(Relation index, Datum query, bool limited)
+{
+	ScanKeyData	key;
+
+	/* GrnBeginScan uses only the following fields */
+	memset(&key, 0, sizeof(key));
+	key.sk_attno = 1;
+	key.sk_strategy = GrnQueryStrategyNumber;
+	key.sk_argument = query;
+
+	return GrnBeginScan(index, 1, &key, 0, NULL, limited);
+}
+
+/*
+ * GrnBeginIndexScan -- search the index with keys of an index scan.
+ */
+static GrnScanDesc *
+GrnBeginIndexScan(IndexScanDesc scan)
+{
+#if PG_VERSION_NUM >= 90100
+	return GrnBeginScan(scan->indexRelation,
+		scan->numberOfKeys, scan->keyData,
+		scan->numberOfOrderBys, scan->orderByData, true);
+#else
+	return GrnBeginScan(scan->indexRelation,
+		scan->numberOfKeys, scan->keyData, 0, NULL, true);
+#endif
+}
+
+static int
+GrnRankedHitKeyCmp(const void *lhs, const void *rhs)
+{
+	int64	l = ((const GrnRankedHit *) lhs)->key;
+	int64	r = ((const GrnRankedHit *) rhs)->key;
+
+	if (l < r)
+		return -1;
+	else if (l > r)
+		return +1;
+	else
+		return 0;
+}
+
+/* by distance, and then by index in the ctid order */
+static int
+GrnRankedHitCmp(const void *lhs, const void *rhs)
+{
+	const GrnRankedHit *l = (const GrnRankedHit *) lhs;
+	const GrnRankedHit *r = (const GrnRankedHit *) rhs;
+
+	if (l->distance < r->distance)
+		return -1;
+	else if (l->distance > r->distance)
+		return +1;
+	else if (l->key < r->key)
+		return -1;
+	else if (l->key > r->key)
+		return +1;
+	else
+		return 0;
+}
+
+/*
+ * GrnSearch -- run the command of the scan, or look up its results in the
+ * cache, and load the hits into the desc.
+ */
+static void
+GrnSearch(Relation index, GrnScanDesc *desc, GrnScanTiming *timing, instr_time *lap)
+{
+	text	   *res;
+	LOCKTAG		tag;
+
+	if (GrnCacheLookup(index, desc->command, &desc->ctid, &desc->score, &desc->num))
+	{
+		/* served from the result cache without touching groonga */
+		timing->search = GrnLap(lap);
+		desc->reserved = desc->num * (sizeof(ItemPointerData) + sizeof(int32));
+		GrnMemoryReserve(desc->reserved);
+	}
+	else
+	{
+		uint64		version = GrnCacheBegin(index);
+
+		/*
+		 * AccessShareLock doesn't conflict with inserts and deletes. It only
+		 * prevents the objects from being swapped by GrnOptimize during search.
+		 */
+		GrnLock(index, AccessShareLock, &tag);
+		GrnCommand(desc->ctx, desc->command, &res, timing);
+		GrnUnlock(&tag, AccessShareLock);
+
+		(void) GrnLap(lap);
+		GrnParseHits(desc, res, timing, lap);
+		GrnFreeResult(res);
+
+		GrnCacheStore(index, desc->command, version,
+			desc->ctid, desc->score, desc->num);
+	}
+}
+
+/*
+ * GrnOrderHits -- sort the hits by the distance to the ORDER BY key.
+ *
+ * PostgreSQL doesn't recheck the order of index scans, so distances are
+ * computed exactly as groonga.distance() does. groonga only finds the
+ * candidates sharing at least one bigram with the key; the other hits have
+ * the maximum distance 1 and follow in the order of ctid.
+ */
+static void
+GrnOrderHits(Relation index, GrnScanDesc *desc, const ScanKeyData *orderby)
+{
+	TupleDesc			tupdesc = RelationGetDescr(index);
+	const GrnOptions   *options = GrnGetOptions(index);
+	int					attno = orderby->sk_attno - 1;
+	const char		   *attname;
+	const char		   *str;
+	int					len;
+	GrnGrams			key;
+	StringInfoData		buf;
+	text			   *res;
+	const char		   *p;
+	GrnRankedHit	   *candidates;
+	int64				ncandidates = 0;
+	int64				maxcandidates = 1024;
+	GrnRankedHit	   *ranks;
+	int64				n;
+	LOCKTAG				tag;
+
+	if (orderby->sk_strategy != GrnSimilarStrategyNumber)
+		elog(ERROR, "unexpected storategy number %d", orderby->sk_strategy);
+	if (attno < 0 || tupdesc->natts <= attno)
+		elog(ERROR, "invalid attno in scankey: %d", attno);
+
+	/* distances are computed from the values stored in groonga */
+	if (!options->store)
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("groonga: <~> operator is not supported for index \"%s\" with store=off",
+				RelationGetRelationName(index))));
+
+	attname = NameStr(tupdesc->attrs[attno]->attname);
+	str = GrnGetValue(index, attno + 1, orderby->sk_argument, &len);
+	GrnBigrams(desc->ctx, str, len, &key);
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf,
+		"select --table t%u --output_columns _key,%s --limit -1 ",
+		index->rd_node.relNode, attname);
+
+	/*
+	 * Rows sharing a bigram with the key can be found only when the lexicon
+	 * has normalized bigrams of every character class. Otherwise every row
+	 * is a candidate.
+	 */
+	if (GrnCanFindSubstring(options->tokenizer) && options->normalize &&
+		key.num > 0 && key.num <= GrnSimilarMaxGrams)
+	{
+		appendStringInfoString(&buf, "--query \"");
+		for (n = 0; n < key.num; n++)
+		{
+			if (n > 0)
+				appendStringInfoString(&buf, " OR ");
+			appendStringInfoString(&buf, attname);
+			appendStringInfoString(&buf, ":@");
+			appendStringEscaped(&buf, key.grams[n], strlen(key.grams[n]));
+		}
+		appendStringInfoChar(&buf, '"');
+	}
+
+	GrnLock(index, AccessShareLock, &tag);
+	GrnCommand(desc->ctx, buf.data, &res, NULL);
+	GrnUnlock(&tag, AccessShareLock);
+
+	/*
+	 * [[[ncandidates],[columns],[rowkey,value],...]]
+	 */
+	candidates = palloc(sizeof(GrnRankedHit) * maxcandidates);
+	p = VARDATA(res);
+	if (!GrnJsonExpect(&p, '[') || !GrnJsonExpect(&p, '['))
+		goto error;
+	GrnJsonSkip(&p);
+	if (!GrnJsonExpect(&p, ','))
+		goto error;
+	GrnJsonSkip(&p);
+	while (GrnJsonExpect(&p, ','))
+	{
+		char	   *rowkey;
+		char	   *value;
+		GrnGrams	grams;
+
+		if (!GrnJsonExpect(&p, '['))
+			goto error;
+		rowkey = GrnJsonScalar(&p);
+		if (!GrnJsonExpect(&p, ','))
+			goto error;
+		value = GrnJsonScalar(&p);
+		if (!GrnJsonExpect(&p, ']'))
+			goto error;
+
+		if (ncandidates >= maxcandidates)
+		{
+			maxcandidates *= 2;
+			candidates = repalloc(candidates, sizeof(GrnRankedHit) * maxcandidates);
+		}
+		GrnBigrams(desc->ctx, value, strlen(value), &grams);
+		candidates[ncandidates].key = atoi64(rowkey);
+		candidates[ncandidates].distance = GrnDistance(&key, &grams);
+		ncandidates++;
+
+		GrnFreeGrams(&grams);
+		pfree(rowkey);
+		pfree(value);
+	}
+	if (!GrnJsonExpect(&p, ']') || !GrnJsonExpect(&p, ']'))
+		goto error;
+
+	/* look up candidates by rowkey */
+	qsort(candidates, ncandidates, sizeof(GrnRankedHit), GrnRankedHitKeyCmp);
+
+	ranks = palloc(sizeof(GrnRankedHit) * Max(desc->num, 1));
+	for (n = 0; n < desc->num; n++)
+	{
+		GrnRankedHit	rowkey;
+		GrnRankedHit   *candidate;
+
+		rowkey.key = CtidToInt64(&desc->ctid[n]);
+		candidate = (GrnRankedHit *) bsearch(&rowkey, candidates, ncandidates,
+							sizeof(GrnRankedHit), GrnRankedHitKeyCmp);
+		ranks[n].key = n;
+		ranks[n].distance = (candidate ? candidate->distance : 1.0);
+	}
+	qsort(ranks, desc->num, sizeof(GrnRankedHit), GrnRankedHitCmp);
+
+	desc->order = palloc(sizeof(int64) * Max(desc->num, 1));
+	for (n = 0; n < desc->num; n++)
+		desc->order[n] = ranks[n].key;
+
+	pfree(ranks);
+	pfree(candidates);
+	GrnFreeResult(res);
+	pfree(buf.data);
+	GrnFreeGrams(&key);
+	return;
+
+error:
+	ereport(ERROR,
+		(errmsg("unexpected result: %s", VARDATA(res)),
+		 errcontext("query: %s", buf.data)));
+}
+
+/*
+ * Candidates of ORDER BY <~> can be narrowed in groonga only when the
+ * lexicon has normalized bigrams of every character class.
+ */
+static bool
+GrnCanOrderNearest(const GrnOptions *options)
+{
+	return GrnCanFindSubstring(options->tokenizer) && options->normalize &&
+		   options->store;
+}
+
+/*
+ * GrnOrderNearest -- load only the nearest rows to the ORDER BY key.
+ *
+ * groonga returns GrnSimilarCandidates rows with the highest scores for
+ * the bigrams of the key. The score of a row is at least the number of
+ * bigrams c shared with the key, and the other rows have scores not higher
+ * than the lowest one s, so their distances are at least
+ * 1 - 2s / (|key| + s). Candidates nearer than that bound are returned
+ * first; GrnOrderRest ranks all rows when more are fetched.
+ *
+ * @return	false if candidates cannot be narrowed in groonga.
+ */
+static bool
+GrnOrderNearest(Relation index, GrnScanDesc *desc, const ScanKeyData *orderby)
+{
+	TupleDesc			tupdesc = RelationGetDescr(index);
+	const GrnOptions   *options = GrnGetOptions(index);
+	int					attno = orderby->sk_attno - 1;
+	const char		   *attname;
+	const char		   *str;
+	int					len;
+	GrnGrams			key;
+	StringInfoData		buf;
+	text			   *res;
+	const char		   *p;
+	char			   *token;
+	int64				nhits;
+	int32				score = 0;
+	double				bound;
+	GrnRankedHit	   *candidates;
+	int64				ncandidates = 0;
+	int64				n;
+	LOCKTAG				tag;
+
+	if (orderby->sk_strategy != GrnSimilarStrategyNumber ||
+		attno < 0 || tupdesc->natts <= attno ||
+		!GrnCanOrderNearest(options))
+		return false;
+
+	str = GrnGetValue(index, attno + 1, orderby->sk_argument, &len);
+	GrnBigrams(desc->ctx, str, len, &key);
+	if (key.num == 0 || key.num > GrnSimilarMaxGrams)
+	{
+		GrnFreeGrams(&key);
+		return false;
+	}
+
+	attname = NameStr(tupdesc->attrs[attno]->attname);
+	initStringInfo(&buf);
+	appendStringInfo(&buf,
+		"select --table t%u --output_columns _key,_score,%s "
+		"--sortby -_score --limit %d --query \"",
+		index->rd_node.relNode, attname, GrnSimilarCandidates);
+	for (n = 0; n < key.num; n++)
+	{
+		if (n > 0)
+			appendStringInfoString(&buf, " OR ");
+		appendStringInfoString(&buf, attname);
+		appendStringInfoString(&buf, ":@");
+		appendStringEscaped(&buf, key.grams[n], strlen(key.grams[n]));
+	}
+	appendStringInfoChar(&buf, '"');
+
+	GrnLock(index, AccessShareLock, &tag);
+	GrnCommand(desc->ctx, buf.data, &res, NULL);
+	GrnUnlock(&tag, AccessShareLock);
+
+	/*
+	 * [[[nhits],[columns],[rowkey,score,value],...]]
+	 */
+	candidates = palloc(sizeof(GrnRankedHit) * GrnSimilarCandidates);
+	p = VARDATA(res);
+	if (!GrnJsonExpect(&p, '[') || !GrnJsonExpect(&p, '[') ||
+		!GrnJsonExpect(&p, '['))
+		goto error;
+	token = GrnJsonScalar(&p);
+	nhits = atoi64(token);
+	pfree(token);
+	if (!GrnJsonExpect(&p, ']') || !GrnJsonExpect(&p, ','))
+		goto error;
+	GrnJsonSkip(&p);
+	while (GrnJsonExpect(&p, ','))
+	{
+		char	   *rowkey;
+		char	   *value;
+		GrnGrams	grams;
+
+		if (!GrnJsonExpect(&p, '['))
+			goto error;
+		rowkey = GrnJsonScalar(&p);
+		if (!GrnJsonExpect(&p, ','))
+			goto error;
+		token = GrnJsonScalar(&p);
+		score = atoi(token);
+		pfree(token);
+		if (!GrnJsonExpect(&p, ','))
+			goto error;
+		value = GrnJsonScalar(&p);
+		if (!GrnJsonExpect(&p, ']') || ncandidates >= GrnSimilarCandidates)
+			goto error;
+
+		GrnBigrams(desc->ctx, value, strlen(value), &grams);
+		candidates[ncandidates].key = atoi64(rowkey);
+		candidates[ncandidates].distance = GrnDistance(&key, &grams);
+		if (candidates[ncandidates].key != 0)
+			ncandidates++;
+
+		GrnFreeGrams(&grams);
+		pfree(rowkey);
+		pfree(value);
+	}
+	if (!GrnJsonExpect(&p, ']') || !GrnJsonExpect(&p, ']'))
+		goto error;
+
+	/* rows not sharing any bigram have the distance 1 */
+	if (nhits <= ncandidates)
+		bound = 1.0;
+	else
+		bound = 1.0 - 2.0 * score / (key.num + score);
+
+	/* keep the candidates nearer than the bound, in the ctid order */
+	qsort(candidates, ncandidates, sizeof(GrnRankedHit), GrnRankedHitKeyCmp);
+	desc->reserved = ncandidates * (sizeof(ItemPointerData) + sizeof(int32) + sizeof(int64));
+	GrnMemoryReserve(desc->reserved);
+	desc->ctid = palloc(sizeof(ItemPointerData) * Max(ncandidates, 1));
+	desc->score = palloc0(sizeof(int32) * Max(ncandidates, 1));
+	desc->num = 0;
+	for (n = 0; n < ncandidates; n++)
+	{
+		if (candidates[n].distance >= bound)
+			continue;
+		desc->ctid[desc->num] = Int64ToCtid(candidates[n].key);
+		candidates[desc->num].key = desc->num;
+		candidates[desc->num].distance = candidates[n].distance;
+		desc->num++;
+	}
+
+	/* ties are returned in the ctid order as GrnOrderHits does */
+	qsort(candidates, desc->num, sizeof(GrnRankedHit), GrnRankedHitCmp);
+	desc->order = palloc(sizeof(int64) * Max(desc->num, 1));
+	for (n = 0; n < desc->num; n++)
+		desc->order[n] = candidates[n].key;
+	desc->partial = true;
+
+	pfree(candidates);
+	GrnFreeResult(res);
+	pfree(buf.data);
+	GrnFreeGrams(&key);
+	return true;
+
+error:
+	ereport(ERROR,
+		(errmsg("unexpected result: %s", VARDATA(res)),
+		 errcontext("query: %s", buf.data)));
+	return false;
+}
+
+/*
+ * GrnOrderRest -- replace the nearest hits loaded by GrnOrderNearest with
+ * all hits of the scan ranked by GrnOrderHits, except those returned.
+ */
+static void
+GrnOrderRest(IndexScanDesc scan, GrnScanDesc *desc)
+{
+	ItemPointerData	   *returned = desc->ctid;
+	int64				nreturned = desc->num;
+	GrnScanTiming		timing;
+	instr_time			lap;
+	int64				m;
+	int64				n;
+	int64				k;
+
+	INSTR_TIME_SET_CURRENT(lap);
+	memset(&timing, 0, sizeof(timing));
+
+	pfree(desc->score);
+	pfree(desc->order);
+	GrnMemoryRelease(desc->reserved);
+	desc->reserved = 0;
+	desc->order = NULL;
+	desc->partial = false;
+
+	GrnSearch(scan->indexRelation, desc, &timing, &lap);
+
+	/* both are sorted by ctid */
+	for (m = n = k = 0; n < desc->num; n++)
+	{
+		int64	key = CtidToInt64(&desc->ctid[n]);
+
+		while (k < nreturned && CtidToInt64(&returned[k]) < key)
+			k++;
+		if (k < nreturned && CtidToInt64(&returned[k]) == key)
+			continue;
+		desc->ctid[m] = desc->ctid[n];
+		desc->score[m] = desc->score[n];
+		m++;
+	}
+	desc->num = m;
+	desc->cursor = 0;
+	pfree(returned);
+
+#if PG_VERSION_NUM >= 90100
+	GrnOrderHits(scan->indexRelation, desc, &scan->orderByData[0]);
+#endif
+}
+
+static double
+GrnScanTotalTime(const GrnScanTiming *timing)
+{
+	return timing->build + timing->search + timing->transfer +
+		   timing->parse + timing->sort;
+}
+
+/*
+ * GrnLap -- return msec elapsed since *lap, and restart the lap.
+ */
+static double
+GrnLap(instr_time *lap)
+{
+	instr_time	now;
+	instr_time	elapsed;
+
+	INSTR_TIME_SET_CURRENT(now);
+	elapsed = now;
+	INSTR_TIME_SUBTRACT(elapsed, *lap);
+	*lap = now;
+
+	return INSTR_TIME_GET_MILLISEC(elapsed);
+}
+
+static int
+GrnHitCmp(const void *lhs, const void *rhs)
+{
+	int64	l = ((const GrnHit *) lhs)->key;
+	int64	r = ((const GrnHit *) rhs)->key;
+
+	if (l < r)
+		return -1;
+	else if (l > r)
+		return +1;
+	else
+		return 0;
+}
+
 static grn_ctx *
 GrnOpen(void)
 {
@@ -874,6 +3852,7 @@ GrnOpen(void)
 		char		path[MAXPGPATH];
 		grn_obj	   *db;
 
+		GrnInit();
 		GRN_CTX_SET_ENCODING(&grnContext, GrnGetEncoding());
 		join_path_components(path, GetDatabasePath(
 			MyDatabaseId, DEFAULTTABLESPACE_OID), GrnDatabaseName);
@@ -893,44 +3872,193 @@ GrnOpen(void)
 	return &grnContext;
 }
 
+/*
+ * GrnInit -- initialize groonga in the backend. Backends which never use
+ * groonga indexes don't pay for it, and the postmaster never does even if
+ * the module is in shared_preload_libraries.
+ */
+static void
+GrnInit(void)
+{
+	if (grnInitialized)
+		return;
+
+	if (grn_init())
+		elog(ERROR, "grn_init() failed");
+	if (grn_ctx_init(&grnContext, GRN_CTX_USE_QL | GRN_CTX_BATCH_MODE))
+	{
+		grn_fin();
+		elog(ERROR, "grn_ctx_init() failed");
+	}
+
+	on_proc_exit(GrnOnProcExit, 0);
+	grnInitialized = true;
+}
+
+/**
+ * GrnCommand -- run a groonga command.
+ *
+ * @param	res		the result is returned if not NULL. All chunks are
+ *					concatenated and the data is null-terminated. The text
+ *					is counted in groonga.work_mem until GrnFreeResult.
+ * @param	timing	time for send and recv are returned if not NULL.
+ */
+static void
+GrnCommand(grn_ctx *ctx, const char *query, text **res, GrnScanTiming *timing)
+{
+	GrnAppendState	state;
+
+	if (res == NULL)
+	{
+		GrnCommandRecv(ctx, query, NULL, NULL, timing);
+		return;
+	}
+
+	/* reserve room for the varlena header */
+	initStringInfo(&state.buf);
+	state.buf.len = VARHDRSZ;
+	state.buf.data[state.buf.len] = '\0';
+	state.overflow = false;
+	state.reserved = 0;
+
+	GrnCommandRecv(ctx, query, GrnAppendChunk, &state, timing);
+
+	if (state.overflow)
+	{
+		GrnMemoryRelease(state.reserved);
+		pfree(state.buf.data);
+		GrnMemoryExceeded();
+	}
+	if (state.buf.len == VARHDRSZ)
+		ereport(ERROR,
+			(errmsg("groonga: query returned NULL"),
+			 errcontext("query: %s", query)));
+
+	*res = (text *) state.buf.data;
+	SET_VARSIZE(*res, state.buf.len);
+}
+
+/**
+ * GrnCommandRecv -- run a groonga command.
+ *
+ * @param	callback	called for each non-empty chunk of the result.
+ * @param	timing		time for send and recv are returned if not NULL.
+ */
 static void
-GrnCommand(grn_ctx *ctx, const char *query, text **res)
+GrnCommandRecv(grn_ctx *ctx, const char *query, GrnRecvCallback callback, void *arg, GrnScanTiming *timing)
 {
 	char		   *str;
 	unsigned int	len;
 	int				flags;
+	instr_time		lap;
 
-	if (res != NULL)
-		*res = NULL;
+	INSTR_TIME_SET_CURRENT(lap);
+
+	/*
+	 * groonga cannot be interrupted while it runs the command, so cancel
+	 * requests and statement_timeout are handled before and after it. Not
+	 * between chunks, because the rest of the result would be returned to
+	 * the next command on the context.
+	 */
+	CHECK_FOR_INTERRUPTS();
 
 	if (grn_ctx_send(ctx, query, strlen(query), 0) != GRN_SUCCESS)
 		elog(ERROR, "grn_ctx_send: %s", ctx->errbuf);
 
+	if (timing != NULL)
+		timing->search = GrnLap(&lap);
+
 	do
 	{
 		flags = 0;
 		if (grn_ctx_recv(ctx, &str, &len, &flags))
 			elog(ERROR, "grn_ctx_recv() failed: %s", ctx->errbuf);
-		if (len > 0 && res != NULL)
-		{
-			if (*res != NULL)
-			{
-				elog(WARNING, "groonga: discard result");
-				pfree(*res);
-			}
+		if (len > 0 && callback != NULL)
+			callback(str, len, arg);
+	} while (flags & GRN_CTX_MORE);
+
+	if (timing != NULL)
+		timing->transfer = GrnLap(&lap);
+
+	CHECK_FOR_INTERRUPTS();
+}
+
+/*
+ * Chunks beyond groonga.work_mem are discarded, but all of them must be
+ * received; see GrnCommandRecv.
+ */
+static void
+GrnAppendChunk(const char *str, unsigned int len, void *arg)
+{
+	GrnAppendState *state = (GrnAppendState *) arg;
+
+	if (state->overflow)
+		return;
+	if (!GrnMemoryAvailable(len))
+	{
+		state->overflow = true;
+		return;
+	}
+	GrnMemoryReserve(len);
+	state->reserved += len;
+	appendBinaryStringInfo(&state->buf, str, len);
+}
+
+/*
+ * GrnFreeResult -- free a result of GrnCommand.
+ */
+static void
+GrnFreeResult(text *res)
+{
+	GrnMemoryRelease(VARSIZE(res) - VARHDRSZ);
+	pfree(res);
+}
+
+static void
+GrnPutChunk(const char *str, unsigned int len, void *arg)
+{
+	GrnChunkState  *state = (GrnChunkState *) arg;
+	int				valid;
+	int				rest;
+
+	/*
+	 * A multibyte character might be split between chunks. Its leading
+	 * bytes are kept until the next chunk, so that every chunk is valid text.
+	 */
+	if (state->partial.len > 0)
+	{
+		appendBinaryStringInfo(&state->partial, str, len);
+		str = state->partial.data;
+		len = state->partial.len;
+	}
+
+	valid = pg_mbcliplen(str, len, len);
+	if (valid > 0)
+		GrnPutText(state, str, valid);
+
+	rest = len - valid;
+	if (str == state->partial.data)
+	{
+		memmove(state->partial.data, str + valid, rest);
+		state->partial.len = rest;
+		state->partial.data[rest] = '\0';
+	}
+	else if (rest > 0)
+		appendBinaryStringInfo(&state->partial, str + valid, rest);
+}
 
-			/* same as cstring_to_text_with_len, but null-terminated */
-			*res= (text *) palloc(len + VARHDRSZ + 1);
-			SET_VARSIZE(*res, len + VARHDRSZ);
-			memcpy(VARDATA(*res), str, len);
-			VARDATA(*res)[len] = '\0';
-		}
-	} while (flags & GRN_CTX_MORE);
+static void
+GrnPutText(GrnChunkState *state, const char *str, int len)
+{
+	Datum			values[2];
+	bool			nulls[2];
 
-	if (res != NULL && *res == NULL)
-		ereport(ERROR,
-			(errmsg("groonga: query returned NULL"),
-			 errcontext("query: %s", query)));
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int32GetDatum(++state->seq);
+	values[1] = PointerGetDatum(cstring_to_text_with_len(str, len));
+
+	tuplestore_putvalues(state->tupstore, state->tupdesc, values, nulls);
+	pfree(DatumGetPointer(values[1]));
 }
 
 static void
@@ -943,10 +4071,14 @@ GrnInsert(
 	ItemPointer	ctid)
 {
 	TupleDesc	tupdesc = RelationGetDescr(index);
+	bool		store = GrnGetOptions(index)->store;
 	int64		rowkey = CtidToInt64(ctid);
 	grn_id		rowid;
 	grn_obj		obj_fix;
 	grn_obj		obj_var;
+	grn_obj		obj_vec;
+	grn_obj	   *ref = NULL;
+	int			section = 0;
 	int			i;
 
 	rowid = grn_table_add(ctx, table, &rowkey, sizeof(rowkey), NULL);
@@ -960,19 +4092,49 @@ GrnInsert(
 		grn_obj	   *column;
 		grn_obj	   *obj;
 
+		/* sections are numbered in the order of the source columns */
+		if (!store && GrnIsTextColumn(index, i + 1))
+			section++;
+
 		if (nulls[i])
 			continue;
 
+		if (GrnIsVectorColumn(index, i + 1))
+		{
+			/* the set function turns it into a vector of the elements */
+			GRN_OBJ_INIT(&obj_vec, GRN_BULK, 0, GrnGetType(index, i + 1));
+			obj = &obj_vec;
+		}
+		else
+		{
+			obj = (tupdesc->attrs[i]->attlen > 0 ? &obj_fix : &obj_var);
+			obj->header.domain = GrnGetType(index, i + 1);
+		}
+		GrnSetValue(index, i + 1, ctx, obj, values[i]);
+
+		if (!store && GrnIsTextColumn(index, i + 1))
+		{
+			/* feed the inverted index directly without storing the value */
+			if (ref == NULL)
+			{
+				grn_obj *keys = GrnLookupIndex(ctx, index, ERROR);
+
+				ref = grn_obj_column(ctx, keys, GrnIndexColumnName, strlen(GrnIndexColumnName));
+				if (ref == NULL)
+					elog(ERROR, "grn_obj_column: \"%s\" not found", GrnIndexColumnName);
+			}
+			if (grn_column_index_update(ctx, ref, rowid, section, NULL, obj) != GRN_SUCCESS)
+				elog(ERROR, "grn_column_index_update: %s", ctx->errbuf);
+			continue;
+		}
+
 		column = grn_obj_column(ctx, table, column_name, strlen(column_name));
 		if (column == NULL)
 			elog(ERROR, "grn_obj_column: \"%s\" not found", column_name);
 
-		obj = (tupdesc->attrs[i]->attlen > 0 ? &obj_fix : &obj_var);
-		index_getprocinfo(index, i + 1, GrnGetValueProc);
-
-		obj->header.domain = GrnGetType(index, i + 1);
-		GrnSetValue(index, i + 1, ctx, obj, values[i]);
 		grn_obj_set_value(ctx, column, rowid, obj, GRN_OBJ_SET);
+		if (obj == &obj_vec)
+			grn_obj_close(ctx, &obj_vec);
 	}
 
 	grn_obj_close(ctx, &obj_fix);
@@ -991,30 +4153,284 @@ GrnDelete(grn_ctx *ctx, grn_obj *table, ItemPointer ctid)
 	(void) grn_table_delete(ctx, table, &rowkey, sizeof(rowkey));
 }
 
+/*
+ * GrnReplay -- apply the change log of the index to the groonga database.
+ *
+ * Hot standbys have their own groonga files, which are not updated by WAL
+ * replay. They catch up with the log written by the primary here, before
+ * searches. A new generation of the log means the index was rebuilt on the
+ * primary, so the groonga objects are rebuilt from the heap. A promoted
+ * standby also catches up here before its first change to the index.
+ *
+ * @return	number of applied records.
+ */
+static int64
+GrnReplay(grn_ctx *ctx, Relation index)
+{
+	int64			napplied = 0;
+#if PG_VERSION_NUM >= 90000
+	GrnWalPosition	pos;
+	GrnWalPosition	latest;
+	GrnReplayState	state;
+	GrnWalRecord	records[64];
+	grn_obj		   *table;
+	int				nrecords;
+	int				i;
+	LOCKTAG			tag;
+	LOCKTAG			xtag;
+
+	if (!GrnGetOptions(index)->wal)
+		return 0;
+
+	/* quick check without locks; the primary has no position file */
+	if (!GrnWalReadPosition(index, &pos))
+	{
+		if (!RecoveryInProgress())
+			return 0;
+		pos.generation = 0;
+		pos.nrecords = 0;
+	}
+	if (!GrnWalLatest(index, &latest) ||
+		(pos.generation == latest.generation &&
+		 pos.nrecords == latest.nrecords))
+		return 0;
+
+	GrnLock(index, ExclusiveLock, &tag);
+
+	/* another backend might have applied the log while we were waiting */
+	if (!GrnWalReadPosition(index, &pos))
+	{
+		pos.generation = 0;
+		pos.nrecords = 0;
+	}
+	GrnWalLatest(index, &latest);
+
+	GrnReplayBegin(&state, index);
+
+	if (pos.generation != latest.generation)
+	{
+		/* searches must not see the objects while they are rebuilt */
+		GrnLock(index, AccessExclusiveLock, &xtag);
+		ereport(DEBUG1,
+			(errmsg("groonga: rebuilding index \"%s\" from heap",
+				RelationGetRelationName(index))));
+		GrnRebuild(ctx, index, &state);
+		GrnUnlock(&xtag, AccessExclusiveLock);
+		pos.generation = latest.generation;
+		pos.nrecords = 0;
+	}
+
+	table = GrnLookupTable(ctx, index, ERROR);
+	while ((nrecords = GrnWalRead(index, &pos, records, lengthof(records))) > 0)
+	{
+		for (i = 0; i < nrecords; i++)
+		{
+			CHECK_FOR_INTERRUPTS();
+
+			if (records[i].op == GrnWalDelete)
+				GrnDelete(ctx, table, &records[i].ctid);
+			else
+				GrnReplayInsert(ctx, index, table, &state, &records[i].ctid);
+		}
+		napplied += nrecords;
+	}
+
+	GrnReplayEnd(&state);
+
+	/* the position is meaningless after promotion */
+	GrnWalWritePosition(index, RecoveryInProgress() ? &pos : NULL);
+	GrnCacheInvalidate(index);
+
+	GrnUnlock(&tag, ExclusiveLock);
+#endif
+
+	return napplied;
+}
+
+/*
+ * GrnWalEnabled -- true if changes of the index are logged. Nothing is
+ * logged during recovery, where the log is read only.
+ */
+static bool
+GrnWalEnabled(Relation index)
+{
+#if PG_VERSION_NUM >= 90000
+	return GrnGetOptions(index)->wal && !RecoveryInProgress();
+#else
+	return false;
+#endif
+}
+
+#if PG_VERSION_NUM >= 90000
+static void
+GrnReplayBegin(GrnReplayState *state, Relation index)
+{
+	state->heap = heap_open(index->rd_index->indrelid, AccessShareLock);
+	state->indexInfo = BuildIndexInfo(index);
+	state->estate = CreateExecutorState();
+	state->slot = MakeSingleTupleTableSlot(RelationGetDescr(state->heap));
+	GetPerTupleExprContext(state->estate)->ecxt_scantuple = state->slot;
+	state->predicate = (List *)
+		ExecPrepareExpr((Expr *) state->indexInfo->ii_Predicate, state->estate);
+}
+
+static void
+GrnReplayEnd(GrnReplayState *state)
+{
+	ExecDropSingleTupleTableSlot(state->slot);
+	FreeExecutorState(state->estate);
+	heap_close(state->heap, AccessShareLock);
+}
+
+/*
+ * Index the heap tuple pointed by ctid. The tuple might have been updated
+ * in the same HOT chain or removed already; the first member of the chain
+ * has the same keys, and nothing is indexed for removed tuples.
+ */
+static void
+GrnReplayInsert(
+	grn_ctx		   *ctx,
+	Relation		index,
+	grn_obj		   *table,
+	GrnReplayState *state,
+	ItemPointer		ctid)
+{
+	HeapTupleData	tuple;
+	Buffer			buf;
+	bool			all_dead;
+
+	tuple.t_self = *ctid;
+	if (!heap_hot_search(&tuple.t_self, state->heap, SnapshotAny, &all_dead))
+		return;
+	if (!heap_fetch(state->heap, SnapshotAny, &tuple, &buf, false, NULL))
+		return;
+
+	GrnReplayTuple(ctx, index, table, state, &tuple, ctid, buf);
+	ReleaseBuffer(buf);
+}
+
+/*
+ * Compute index keys of the heap tuple like IndexBuildHeapScan and insert
+ * them with the ctid, which is the root of the HOT chain.
+ */
+static void
+GrnReplayTuple(
+	grn_ctx		   *ctx,
+	Relation		index,
+	grn_obj		   *table,
+	GrnReplayState *state,
+	HeapTuple		tuple,
+	ItemPointer		ctid,
+	Buffer			buf)
+{
+	ExprContext	   *econtext = GetPerTupleExprContext(state->estate);
+	Datum			values[INDEX_MAX_KEYS];
+	bool			isnull[INDEX_MAX_KEYS];
+	MemoryContext	oldcontext;
+
+	ResetExprContext(econtext);
+	oldcontext = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+
+	ExecStoreTuple(tuple, state->slot, buf, false);
+	if (state->predicate == NIL || ExecQual(state->predicate, econtext, false))
+	{
+		FormIndexDatum(state->indexInfo, state->slot, state->estate, values, isnull);
+		GrnInsert(ctx, index, table, values, isnull, ctid);
+	}
+	ExecClearTuple(state->slot);
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Recreate the groonga objects from all tuples in the heap. Dead tuples are
+ * indexed too, but they are never returned because the executor checks
+ * visibility, and the delete records remove them later.
+ */
+static void
+GrnRebuild(grn_ctx *ctx, Relation index, GrnReplayState *state)
+{
+	BlockNumber		nblocks = RelationGetNumberOfBlocks(state->heap);
+	BlockNumber		blkno;
+	grn_obj		   *table;
+
+	if (GrnLookupTable(ctx, index, DEBUG1) != NULL)
+		GrnDrop(ctx, index);
+	table = GrnCreate(ctx, index, NULL);
+
+	for (blkno = 0; blkno < nblocks; blkno++)
+	{
+		OffsetNumber	root_offsets[MaxHeapTuplesPerPage];
+		HeapTuple		tuples[MaxHeapTuplesPerPage];
+		ItemPointerData	roots[MaxHeapTuplesPerPage];
+		int				ntuples = 0;
+		Buffer			buf;
+		Page			page;
+		OffsetNumber	offnum;
+		OffsetNumber	maxoff;
+		int				i;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* copy tuples not to hold the content lock while computing keys */
+		buf = ReadBuffer(state->heap, blkno);
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		heap_get_root_tuples(page, root_offsets);
+		maxoff = PageGetMaxOffsetNumber(page);
+		for (offnum = FirstOffsetNumber; offnum <= maxoff; offnum++)
+		{
+			ItemId			lp = PageGetItemId(page, offnum);
+			HeapTupleData	tuple;
+
+			if (!ItemIdIsNormal(lp) ||
+				root_offsets[offnum - 1] == InvalidOffsetNumber)
+				continue;
+
+			tuple.t_data = (HeapTupleHeader) PageGetItem(page, lp);
+			tuple.t_len = ItemIdGetLength(lp);
+			tuple.t_tableOid = RelationGetRelid(state->heap);
+			ItemPointerSet(&tuple.t_self, blkno, offnum);
+
+			tuples[ntuples] = heap_copytuple(&tuple);
+			ItemPointerSet(&roots[ntuples], blkno, root_offsets[offnum - 1]);
+			ntuples++;
+		}
+		UnlockReleaseBuffer(buf);
+
+		for (i = 0; i < ntuples; i++)
+		{
+			GrnReplayTuple(ctx, index, table, state, tuples[i], &roots[i], InvalidBuffer);
+			heap_freetuple(tuples[i]);
+		}
+	}
+}
+#endif
+
 /**
  * GrnCreate
  *
  * @param	ctx
  * @param	index
+ * @param	suffix	appended to object names and paths, or NULL.
  * @return	created table object.
  */
 static grn_obj *
-GrnCreate(grn_ctx *ctx, Relation index)
+GrnCreate(grn_ctx *ctx, Relation index, const char *suffix)
 {
 	grn_obj	   *table;
 	grn_obj	   *column;
 	grn_obj		column_ids;
+	grn_obj		geo_column_ids;
 	int			num_text_columns;
+	int			num_geo_columns;
 	char		name[NAMEDATALEN];
 	int			i;
 	char	   *path;
 	char		segpath[MAXPGPATH];
 	TupleDesc	tupdesc;
-	Oid			relid = RelationGetRelid(index);
-	HeapTuple	indtup;
-	oidvector  *indclass;
-	bool		isnull;
 	Oid			relNode = index->rd_node.relNode;
+	const GrnOptions *options = GrnGetOptions(index);
 
 	/*
 	 * パスは、PostgreSQL と組み合わせて利用する場合には相対パスが良い。
@@ -1025,107 +4441,494 @@ GrnCreate(grn_ctx *ctx, Relation index)
 	 * Gronnga 単体で利用する場合は $PGDATA をカレントディレクトリとすべし。
 	 */
 	path = relpathperm(index->rd_node, MAIN_FORKNUM);
+	if (suffix == NULL)
+		suffix = "";
+
+	tupdesc = RelationGetDescr(index);
+
+	/*
+	 * CREATE TABLE {table} (_key Int64)
+	 *
+	 * A patricia trie keeps keys in the order of ctids, so that cursors
+	 * walk the heap in physical order and can be limited to block ranges.
+	 */
+	snprintf(name, sizeof(name), GrnTableNameFormat "%s", relNode, suffix);
+	sprintf(segpath, "%s%s.grn", path, suffix);
+	table = GrnCreateTable(ctx, name, segpath,
+				options->rowkey == GrnRowKeyPat ?
+					GRN_OBJ_TABLE_PAT_KEY : GRN_OBJ_TABLE_HASH_KEY,
+				grn_ctx_at(ctx, GRN_DB_INT64));
+
+	/* ALTER TABLE {table} ADD COLUMN */
+	num_text_columns = 0;
+	num_geo_columns = 0;
+	GRN_UINT32_INIT(&column_ids, 0);
+	GRN_UINT32_INIT(&geo_column_ids, 0);
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		const char	   *column_name = NameStr(tupdesc->attrs[i]->attname);
+		grn_obj_flags	flags = GRN_OBJ_COLUMN_SCALAR;
+
+		if (GrnIsVectorColumn(index, i + 1))
+			flags = GRN_OBJ_COLUMN_VECTOR;
+		else if (tupdesc->attrs[i]->attlen < 0)
+			flags |= GrnCompressFlags(options->compress);
+
+		/*
+		 * Columns are created even if values are not stored, because
+		 * groonga finds the inverted index through the source column.
+		 */
+		sprintf(segpath, "%s%s.grn.%d", path, suffix, i + 1);
+		column = GrnCreateColumn(ctx, table, column_name, segpath,
+			flags, grn_ctx_at(ctx, GrnGetType(index, i + 1)));
+
+		if (GrnIsTextColumn(index, i + 1))
+		{
+			num_text_columns++;
+			GRN_UINT32_PUT(ctx, &column_ids, grn_obj_id(ctx, column));
+		}
+		else if (GrnIsVectorColumn(index, i + 1))
+		{
+			grn_obj		   *keys;
+			grn_obj		   *ref;
+			grn_obj			source;
+			grn_builtin_type type = GrnGetType(index, i + 1);
+
+			/*
+			 * CREATE TABLE {vector index} (_key {element type})
+			 *
+			 * Each array has its own lexicon without tokenizers because
+			 * the key type is the element type, and elements are matched
+			 * as a whole.
+			 */
+			flags = GRN_OBJ_TABLE_PAT_KEY;
+			if (type == GRN_DB_SHORT_TEXT && options->normalize)
+				flags |= GRN_OBJ_KEY_NORMALIZE;
+			snprintf(name, sizeof(name), GrnVectorIndexNameFormat "%s",
+				relNode, i + 1, suffix);
+			sprintf(segpath, "%s%s.grn.v%d", path, suffix, i + 1);
+			keys = GrnCreateTable(ctx, name, segpath, flags,
+						grn_ctx_at(ctx, type));
+
+			/* ALTER TABLE {vector index} ADD COLUMN ref table */
+			sprintf(segpath, "%s%s.grn.v%dr", path, suffix, i + 1);
+			ref = GrnCreateColumn(ctx, keys, GrnIndexColumnName, segpath,
+				GRN_OBJ_COLUMN_INDEX, table);
+			GRN_UINT32_INIT(&source, 0);
+			GRN_UINT32_PUT(ctx, &source, grn_obj_id(ctx, column));
+			grn_obj_set_info(ctx, ref, GRN_INFO_SOURCE, &source);
+			grn_obj_close(ctx, &source);
+		}
+		else if (GrnGetType(index, i + 1) == GRN_DB_WGS84_GEO_POINT)
+		{
+			num_geo_columns++;
+			GRN_UINT32_PUT(ctx, &geo_column_ids, grn_obj_id(ctx, column));
+		}
+	}
+
+	if (num_text_columns > 0)
+	{
+		grn_obj		   *keys;
+		grn_obj_flags	flags;
+
+		switch (options->lexicon)
+		{
+#ifdef GRN_OBJ_TABLE_DAT_KEY
+		case GrnLexiconDat:
+			flags = GRN_OBJ_TABLE_DAT_KEY;
+			break;
+#endif
+		case GrnLexiconHash:
+			flags = GRN_OBJ_TABLE_HASH_KEY;
+			break;
+		default:
+			flags = GRN_OBJ_TABLE_PAT_KEY;
+			break;
+		}
+		if (options->normalize)
+			flags |= GRN_OBJ_KEY_NORMALIZE;
+
+		/* CREATE TABLE {index} (_key ShortText) */
+		snprintf(name, sizeof(name), GrnIndexNameFormat "%s", relNode, suffix);
+		sprintf(segpath, "%s%s.grn.i", path, suffix);
+		keys = GrnCreateTable(ctx, name, segpath, flags,
+					grn_ctx_at(ctx, GRN_DB_SHORT_TEXT));
+
+		if (strcmp(options->tokenizer, "none") != 0)
+		{
+			grn_obj	   *tokenizer;
+
+			tokenizer = grn_ctx_get(ctx, options->tokenizer, strlen(options->tokenizer));
+			if (tokenizer == NULL)
+				elog(ERROR, "groonga: tokenizer \"%s\" not found", options->tokenizer);
+			grn_obj_set_info(ctx, keys, GRN_INFO_DEFAULT_TOKENIZER, tokenizer);
+		}
+
+		/* sections are required only to distinguish multiple columns */
+		flags = GRN_OBJ_COLUMN_INDEX;
+		if (options->with_position)
+			flags |= GRN_OBJ_WITH_POSITION;
+		if (num_text_columns > 1)
+			flags |= GRN_OBJ_WITH_SECTION;
+
+		/* ALTER TABLE {index} ADD COLUMN ref table */
+		sprintf(segpath, "%s%s.grn.r", path, suffix);
+		column = GrnCreateColumn(ctx, keys, GrnIndexColumnName, segpath,
+			flags, table);
+		grn_obj_set_info(ctx, column, GRN_INFO_SOURCE, &column_ids);
+	}
+
+	if (num_geo_columns > 0)
+	{
+		grn_obj		   *keys;
+		grn_obj_flags	flags;
+
+		/* CREATE TABLE {geo index} (_key WGS84GeoPoint) */
+		snprintf(name, sizeof(name), GrnGeoIndexNameFormat "%s", relNode, suffix);
+		sprintf(segpath, "%s%s.grn.g", path, suffix);
+		keys = GrnCreateTable(ctx, name, segpath, GRN_OBJ_TABLE_PAT_KEY,
+					grn_ctx_at(ctx, GRN_DB_WGS84_GEO_POINT));
+
+		flags = GRN_OBJ_COLUMN_INDEX;
+		if (num_geo_columns > 1)
+			flags |= GRN_OBJ_WITH_SECTION;
+
+		/* ALTER TABLE {geo index} ADD COLUMN ref table */
+		sprintf(segpath, "%s%s.grn.gr", path, suffix);
+		column = GrnCreateColumn(ctx, keys, GrnIndexColumnName, segpath,
+			flags, table);
+		grn_obj_set_info(ctx, column, GRN_INFO_SOURCE, &geo_column_ids);
+	}
+
+	grn_obj_close(ctx, &column_ids);
+	grn_obj_close(ctx, &geo_column_ids);
+
+	return table;
+}
+
+/**
+ * GrnDrop -- drop groonga table and index for the relation.
+ *
+ * Emit WARNING messages if failed to drop objects.
+ */
+static void
+GrnDrop(grn_ctx *ctx, Relation index)
+{
+	grn_obj *obj;
+	int		i;
+
+	if ((obj = GrnLookupIndex(ctx, index, WARNING)) != NULL)
+	{
+		if (grn_obj_remove(ctx, obj))
+			elog(WARNING,
+				"grn_obj_remove(index for %s) failed: %s",
+				RelationGetRelationName(index), ctx->errbuf);
+	}
+
+	if ((obj = GrnLookupGeoIndex(ctx, index, DEBUG1)) != NULL)
+	{
+		if (grn_obj_remove(ctx, obj))
+			elog(WARNING,
+				"grn_obj_remove(geo index for %s) failed: %s",
+				RelationGetRelationName(index), ctx->errbuf);
+	}
+
+	for (i = 0; i < RelationGetNumberOfAttributes(index); i++)
+	{
+		if (!GrnIsVectorColumn(index, i + 1))
+			continue;
+		if ((obj = GrnLookupVectorIndex(ctx, index, i + 1, WARNING)) != NULL)
+		{
+			if (grn_obj_remove(ctx, obj))
+				elog(WARNING,
+					"grn_obj_remove(vector index for %s) failed: %s",
+					RelationGetRelationName(index), ctx->errbuf);
+		}
+	}
+
+	if ((obj = GrnLookupTable(ctx, index, WARNING)) != NULL)
+	{
+		if (grn_obj_remove(ctx, obj))
+			elog(WARNING,
+				"grn_obj_remove(table for %s) failed: %s",
+				RelationGetRelationName(index), ctx->errbuf);
+	}
+}
+
+/*
+ * GrnObjectNames -- fill names of groonga objects for the index with the
+ * suffix, in the order to be dropped: lexicons before the table.
+ *
+ * @return	number of names; 3 + number of attributes.
+ */
+static int
+GrnObjectNames(Relation index, const char *suffix, char (*names)[NAMEDATALEN])
+{
+	Oid		relNode = index->rd_node.relNode;
+	int		n = 0;
+	int		i;
+
+	snprintf(names[n++], NAMEDATALEN, GrnIndexNameFormat "%s", relNode, suffix);
+	snprintf(names[n++], NAMEDATALEN, GrnGeoIndexNameFormat "%s", relNode, suffix);
+	for (i = 0; i < RelationGetNumberOfAttributes(index); i++)
+		snprintf(names[n++], NAMEDATALEN, GrnVectorIndexNameFormat "%s",
+			relNode, i + 1, suffix);
+	snprintf(names[n++], NAMEDATALEN, GrnTableNameFormat "%s", relNode, suffix);
+
+	return n;
+}
+
+/*
+ * GrnRenameObject -- rename a groonga object if exists.
+ *
+ * @return	false if failed; the reason is in ctx->errbuf.
+ */
+static bool
+GrnRenameObject(grn_ctx *ctx, const char *from, const char *to)
+{
+	grn_obj	   *obj;
+
+	if ((obj = grn_ctx_get(ctx, from, strlen(from))) == NULL)
+		return true;
+	return grn_table_rename(ctx, obj, to, strlen(to)) == GRN_SUCCESS;
+}
+
+/*
+ * GrnRemoveObjects -- remove groonga objects with the names if exist.
+ */
+static void
+GrnRemoveObjects(grn_ctx *ctx, char (*names)[NAMEDATALEN], int nnames)
+{
+	grn_obj	   *obj;
+	int			k;
+
+	for (k = 0; k < nnames; k++)
+	{
+		if ((obj = grn_ctx_get(ctx, names[k], strlen(names[k]))) != NULL &&
+			grn_obj_remove(ctx, obj))
+			elog(WARNING, "grn_obj_remove(%s) failed: %s", names[k], ctx->errbuf);
+	}
+}
+
+/**
+ * GrnOptimize -- rewrite groonga objects for the index into fresh segments.
+ *
+ * Rows are copied from the current table into new objects, which replace
+ * the old ones under a short AccessExclusiveLock. ExclusiveLock is held
+ * during the copy: inserts, VACUUM and other optimizers wait for it, and
+ * index scans skip deleting rows of dead tuples. Searches can run
+ * concurrently until the swap. Terms which no longer have postings are not
+ * copied into the new lexicon.
+ *
+ * The current objects are renamed aside before the new ones are renamed
+ * into place, and dropped only after both succeeded, so a failure leaves
+ * the index with the old objects.
+ *
+ * @return	number of rows copied.
+ */
+static int64
+GrnOptimize(grn_ctx *ctx, Relation index)
+{
+	TupleDesc	tupdesc = RelationGetDescr(index);
+	grn_obj	   *src;
+	grn_obj	   *dst;
+	grn_obj	  **src_columns;
+	grn_obj	  **dst_columns;
+	char		suffix[32];
+	char		aside[40];
+	char	  (*current_names)[NAMEDATALEN];
+	char	  (*aside_names)[NAMEDATALEN];
+	char	  (*new_names)[NAMEDATALEN];
+	int			nnames;
+	int			nrenamed;
+	int			k;
+	int64		nrows = 0;
+	int			i;
+	struct timeval	tv;
+	LOCKTAG		tag;
+	LOCKTAG		xtag;
+
+	/* the inverted index cannot be rebuilt from the groonga table */
+	if (!GrnGetOptions(index)->store)
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("groonga: cannot optimize index \"%s\" with store=off",
+				RelationGetRelationName(index)),
+			 errhint("Use REINDEX instead.")));
+
+	/* new segments must not conflict with the current ones */
+	gettimeofday(&tv, NULL);
+	snprintf(suffix, sizeof(suffix), "_%lx_%lx", (long) tv.tv_sec, (long) tv.tv_usec);
+	snprintf(aside, sizeof(aside), "%s_old", suffix);
+	src_columns = (grn_obj **) palloc(sizeof(grn_obj *) * tupdesc->natts);
+	dst_columns = (grn_obj **) palloc(sizeof(grn_obj *) * tupdesc->natts);
+
+	nnames = 3 + tupdesc->natts;
+	current_names = palloc(NAMEDATALEN * nnames);
+	aside_names = palloc(NAMEDATALEN * nnames);
+	new_names = palloc(NAMEDATALEN * nnames);
+	GrnObjectNames(index, "", current_names);
+	GrnObjectNames(index, aside, aside_names);
+	GrnObjectNames(index, suffix, new_names);
+
+	/* block inserts, deletes and other optimizers until swapped */
+	GrnLock(index, ExclusiveLock, &tag);
+
+	src = GrnLookupTable(ctx, index, ERROR);
+	dst = GrnCreate(ctx, index, suffix);
+
+	PG_TRY();
+	{
+		grn_table_cursor   *cursor;
+		grn_obj				value;
+		grn_id				id;
 
-	tupdesc = RelationGetDescr(index);
+		for (i = 0; i < tupdesc->natts; i++)
+		{
+			const char *column_name = NameStr(tupdesc->attrs[i]->attname);
 
-	indtup = SearchSysCache1(INDEXRELID, ObjectIdGetDatum(relid));
-	if (!HeapTupleIsValid(indtup))
-		elog(ERROR, "cache lookup failed for relation %u", relid);
-	indclass = (oidvector *) DatumGetPointer(SysCacheGetAttr(
-				INDEXRELID, indtup, Anum_pg_index_indclass, &isnull));
-	Assert(!isnull);
-
-	relpathperm(index->rd_node, MAIN_FORKNUM);
-	/* CREATE TABLE {table} (_key Int64) */
-	snprintf(name, sizeof(name), GrnTableNameFormat, relNode);
-	sprintf(segpath, "%s.grn", path);
-	table = GrnCreateTable(ctx, name, segpath,
-				GRN_OBJ_TABLE_HASH_KEY,
-				grn_ctx_at(ctx, GRN_DB_INT64));
+			src_columns[i] = grn_obj_column(ctx, src, column_name, strlen(column_name));
+			dst_columns[i] = grn_obj_column(ctx, dst, column_name, strlen(column_name));
+			if (src_columns[i] == NULL || dst_columns[i] == NULL)
+				elog(ERROR, "grn_obj_column: \"%s\" not found", column_name);
+		}
 
-	/* ALTER TABLE {table} ADD COLUMN */
-	num_text_columns = 0;
-	GRN_UINT32_INIT(&column_ids, 0);
-	for (i = 0; i < tupdesc->natts; i++)
+		cursor = grn_table_cursor_open(ctx, src, NULL, 0, NULL, 0, 0, -1, 0);
+		if (cursor == NULL)
+			elog(ERROR, "grn_table_cursor_open: %s", ctx->errbuf);
+
+		while ((id = grn_table_cursor_next(ctx, cursor)) != GRN_ID_NIL)
+		{
+			void	   *rowkey;
+			int			keysize;
+			grn_id		rowid;
+
+			CHECK_FOR_INTERRUPTS();
+
+			keysize = grn_table_cursor_get_key(ctx, cursor, &rowkey);
+			rowid = grn_table_add(ctx, dst, rowkey, keysize, NULL);
+
+			for (i = 0; i < tupdesc->natts; i++)
+			{
+				/* vectors cannot be rewound, so use a fresh object */
+				GRN_VOID_INIT(&value);
+				grn_obj_get_value(ctx, src_columns[i], id, &value);
+				if (value.header.type == GRN_VECTOR ?
+					grn_vector_size(ctx, &value) > 0 :
+					GRN_BULK_VSIZE(&value) > 0)
+					grn_obj_set_value(ctx, dst_columns[i], rowid, &value, GRN_OBJ_SET);
+				grn_obj_close(ctx, &value);
+			}
+			nrows++;
+		}
+		grn_table_cursor_close(ctx, cursor);
+	}
+	PG_CATCH();
 	{
-		const char *column_name = NameStr(tupdesc->attrs[i]->attname);
-		Oid			typid;
-		Oid			opfamily;
-		Oid			oprid;
+		GrnRemoveObjects(ctx, new_names, nnames);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
-		sprintf(segpath, "%s.grn.%d", path, i + 1);
-		column = GrnCreateColumn(ctx, table, column_name, segpath,
-			GRN_OBJ_COLUMN_SCALAR,
-			grn_ctx_at(ctx, GrnGetType(index, i + 1)));
+	/* swap the objects; wait for running searches */
+	GrnLock(index, AccessExclusiveLock, &xtag);
 
-		/*
-		 * GrnContainStrategyNumber (%% 演算子) を扱う列に対して転置表を作成する。
-		 * get_opfamily_member() に渡す型は、型列の型ではなく opclass の opcintype
-		 * であることに注意。特に varchar は、内部的には text として処理されている。
-		 */
-		opfamily = get_opclass_family(indclass->values[i]);
-		typid = get_opclass_input_type(indclass->values[i]);
-		oprid = get_opfamily_member(opfamily, typid, typid, GrnContainStrategyNumber);
-		if (oprid != InvalidOid)
+	nrenamed = 0;
+	PG_TRY();
+	{
+		for (k = 0; k < nnames; k++, nrenamed++)
 		{
-			num_text_columns++;
-			GRN_UINT32_PUT(ctx, &column_ids, grn_obj_id(ctx, column));
+			if (!GrnRenameObject(ctx, current_names[k], aside_names[k]))
+				elog(ERROR, "grn_table_rename(%s): %s", aside_names[k], ctx->errbuf);
+		}
+		for (k = 0; k < nnames; k++, nrenamed++)
+		{
+			if (!GrnRenameObject(ctx, new_names[k], current_names[k]))
+				elog(ERROR, "grn_table_rename(%s): %s", current_names[k], ctx->errbuf);
 		}
 	}
-
-	if (num_text_columns > 0)
+	PG_CATCH();
 	{
-		grn_obj	   *keys;
-
-		/* CREATE TABLE {index} (_key ShortText) */
-		snprintf(name, sizeof(name), GrnIndexNameFormat, relNode);
-		sprintf(segpath, "%s.grn.i", path);
-		keys = GrnCreateTable(ctx, name, segpath,
-					GRN_OBJ_TABLE_PAT_KEY | GRN_OBJ_KEY_NORMALIZE,
-					grn_ctx_at(ctx, GRN_DB_SHORT_TEXT));
-		grn_obj_set_info(ctx, keys, GRN_INFO_DEFAULT_TOKENIZER,
-			grn_ctx_at(ctx, GRN_DB_BIGRAM));
+		/* undo the renames in reverse order, and drop the new objects */
+		while (nrenamed-- > 0)
+		{
+			const char *from;
+			const char *to;
 
-		/* ALTER TABLE {index} ADD COLUMN ref table */
-		sprintf(segpath, "%s.grn.r", path);
-		column = GrnCreateColumn(ctx, keys, "ref", segpath,
-			GRN_OBJ_COLUMN_INDEX | GRN_OBJ_WITH_POSITION | GRN_OBJ_WITH_SECTION,
-			table);
-		grn_obj_set_info(ctx, column, GRN_INFO_SOURCE, &column_ids);
+			if (nrenamed >= nnames)
+			{
+				from = current_names[nrenamed - nnames];
+				to = new_names[nrenamed - nnames];
+			}
+			else
+			{
+				from = aside_names[nrenamed];
+				to = current_names[nrenamed];
+			}
+			if (!GrnRenameObject(ctx, from, to))
+				elog(WARNING, "grn_table_rename(%s): %s", to, ctx->errbuf);
+		}
+		GrnRemoveObjects(ctx, new_names, nnames);
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
 
-	grn_obj_close(ctx, &column_ids);
+	GrnRemoveObjects(ctx, aside_names, nnames);
 
-	ReleaseSysCache(indtup);
+	GrnUnlock(&xtag, AccessExclusiveLock);
+	GrnUnlock(&tag, ExclusiveLock);
 
-	return table;
+	pfree(current_names);
+	pfree(aside_names);
+	pfree(new_names);
+	pfree(src_columns);
+	pfree(dst_columns);
+
+	return nrows;
 }
 
 /**
- * GrnDrop -- drop groonga table and index for the relation.
+ * GrnFragmentation -- ratio of lexicon entries without postings.
  *
- * Emit WARNING messages if failed to drop objects.
+ * Such entries are left behind when all rows having the term are deleted.
  */
-static void
-GrnDrop(grn_ctx *ctx, Relation index)
+static double
+GrnFragmentation(grn_ctx *ctx, Relation index)
 {
-	grn_obj *obj;
+	grn_obj			   *keys;
+	grn_obj			   *column;
+	grn_obj				value;
+	grn_table_cursor   *cursor;
+	grn_id				id;
+	int64				total = 0;
+	int64				dead = 0;
 
-	if ((obj = GrnLookupIndex(ctx, index, WARNING)) != NULL)
-	{
-		if (grn_obj_remove(ctx, obj))
-			elog(WARNING,
-				"grn_obj_remove(index for %s) failed: %s",
-				RelationGetRelationName(index), ctx->errbuf);
-	}
+	if ((keys = GrnLookupIndex(ctx, index, DEBUG1)) == NULL)
+		return 0;	/* no text columns */
 
-	if ((obj = GrnLookupTable(ctx, index, WARNING)) != NULL)
+	column = grn_obj_column(ctx, keys,
+				GrnIndexColumnName, strlen(GrnIndexColumnName));
+	if (column == NULL)
+		elog(ERROR, "grn_obj_column: \"%s\" not found", GrnIndexColumnName);
+
+	cursor = grn_table_cursor_open(ctx, keys, NULL, 0, NULL, 0, 0, -1, 0);
+	if (cursor == NULL)
+		elog(ERROR, "grn_table_cursor_open: %s", ctx->errbuf);
+
+	/* the value of an index column is the number of postings */
+	GRN_UINT32_INIT(&value, 0);
+	while ((id = grn_table_cursor_next(ctx, cursor)) != GRN_ID_NIL)
 	{
-		if (grn_obj_remove(ctx, obj))
-			elog(WARNING,
-				"grn_obj_remove(table for %s) failed: %s",
-				RelationGetRelationName(index), ctx->errbuf);
+		GRN_BULK_REWIND(&value);
+		grn_obj_get_value(ctx, column, id, &value);
+		if (GRN_UINT32_VALUE(&value) == 0)
+			dead++;
+		total++;
 	}
+	grn_obj_close(ctx, &value);
+	grn_table_cursor_close(ctx, cursor);
+
+	return total > 0 ? (double) dead / total : 0;
 }
 
 static grn_obj *
@@ -1239,24 +5042,423 @@ GrnLookupIndex(grn_ctx *ctx, Relation index, int elevel)
 	return GrnLookup(ctx, index_name, elevel);
 }
 
+static grn_obj *
+GrnLookupGeoIndex(grn_ctx *ctx, Relation index, int elevel)
+{
+	char		index_name[NAMEDATALEN];
+
+	snprintf(index_name, sizeof(index_name),
+		GrnGeoIndexNameFormat, index->rd_node.relNode);
+	return GrnLookup(ctx, index_name, elevel);
+}
+
+static grn_obj *
+GrnLookupVectorIndex(grn_ctx *ctx, Relation index, int attnum, int elevel)
+{
+	char		index_name[NAMEDATALEN];
+
+	snprintf(index_name, sizeof(index_name),
+		GrnVectorIndexNameFormat, index->rd_node.relNode, attnum);
+	return GrnLookup(ctx, index_name, elevel);
+}
+
+/*
+ * Open a groonga index given by users, e.g. groonga.optimize(regclass).
+ */
+static Relation
+GrnOpenIndex(Oid relid, LOCKMODE mode)
+{
+	Relation	index = index_open(relid, mode);
+
+	if (strcmp(NameStr(index->rd_am->amname), "groonga") != 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+			 errmsg("\"%s\" is not a groonga index",
+				RelationGetRelationName(index))));
+
+	return index;
+}
+
+/*
+ * GrnParseOptions -- parse reloptions of the form {"name=value", ...}.
+ *
+ * Unknown options are ignored unless validate.
+ */
+static GrnOptions *
+GrnParseOptions(Datum reloptions, bool validate)
+{
+	GrnOptions *options;
+	Datum	   *elems;
+	int			nelems;
+	int			i;
+
+	options = (GrnOptions *) palloc0(sizeof(GrnOptions));
+	SET_VARSIZE(options, sizeof(GrnOptions));
+	strlcpy(options->tokenizer, "TokenBigram", NAMEDATALEN);
+	options->normalize = true;
+	options->with_position = true;
+	options->lexicon = GrnLexiconPat;
+	options->rowkey = GrnRowKeyHash;
+	options->store = true;
+	options->compress = GrnCompressNone;
+	options->wal = false;
+
+	if (reloptions == (Datum) 0)
+		return options;
+
+	deconstruct_array(DatumGetArrayTypeP(reloptions),
+					  TEXTOID, -1, false, 'i', &elems, NULL, &nelems);
+
+	for (i = 0; i < nelems; i++)
+	{
+		char	   *name = TextDatumGetCString(elems[i]);
+		char	   *value = strchr(name, '=');
+
+		if (value == NULL)
+		{
+			if (validate)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("groonga: invalid option \"%s\"", name)));
+			continue;
+		}
+		*value++ = '\0';
+
+		if (pg_strcasecmp(name, "tokenizer") == 0)
+		{
+			int		k;
+
+			static const char *tokenizers[][2] =
+			{
+				{ "TokenUnigram", "unigram" },
+				{ "TokenBigram", "bigram" },
+				{ "TokenTrigram", "trigram" },
+				{ "TokenDelimit", "delimit" },
+				{ "TokenMecab", "mecab" },
+				{ "TokenBigramSplitSymbolAlphaDigit", "substring" }
+			};
+
+			/* unquoted values are downcased; accept short names too */
+			for (k = 0; k < lengthof(tokenizers); k++)
+			{
+				if (pg_strcasecmp(value, tokenizers[k][0]) == 0 ||
+					pg_strcasecmp(value, tokenizers[k][1]) == 0)
+				{
+					value = (char *) tokenizers[k][0];
+					break;
+				}
+			}
+
+			if (strlen(value) >= NAMEDATALEN)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("groonga: tokenizer name is too long")));
+			strlcpy(options->tokenizer, value, NAMEDATALEN);
+
+			if (validate && strcmp(value, "none") != 0 &&
+				grn_ctx_get(GrnOpen(), value, strlen(value)) == NULL)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("groonga: tokenizer \"%s\" not found", value),
+					 errhint("Valid values are \"none\", \"unigram\", \"bigram\", \"trigram\", \"delimit\", \"mecab\", \"substring\" and names of groonga tokenizers.")));
+		}
+		else if (pg_strcasecmp(name, "normalizer") == 0)
+		{
+			if (pg_strcasecmp(value, "auto") == 0)
+				options->normalize = true;
+			else if (pg_strcasecmp(value, "none") == 0)
+				options->normalize = false;
+			else
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("groonga: invalid value for normalizer: \"%s\"", value),
+					 errhint("Valid values are \"auto\" and \"none\".")));
+		}
+		else if (pg_strcasecmp(name, "with_position") == 0)
+		{
+			options->with_position = GrnParseBool(name, value);
+#if PG_VERSION_NUM < 80400
+			/* recheck is fixed in operator classes */
+			if (!options->with_position && validate)
+				ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("groonga: with_position=off requires PostgreSQL 8.4 or later")));
+#endif
+		}
+		else if (pg_strcasecmp(name, "lexicon") == 0)
+		{
+			if (pg_strcasecmp(value, "pat") == 0)
+				options->lexicon = GrnLexiconPat;
+#ifdef GRN_OBJ_TABLE_DAT_KEY
+			else if (pg_strcasecmp(value, "dat") == 0)
+				options->lexicon = GrnLexiconDat;
+#endif
+			else if (pg_strcasecmp(value, "hash") == 0)
+				options->lexicon = GrnLexiconHash;
+			else
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("groonga: invalid value for lexicon: \"%s\"", value),
+#ifdef GRN_OBJ_TABLE_DAT_KEY
+					 errhint("Valid values are \"pat\", \"dat\" and \"hash\".")));
+#else
+					 errhint("Valid values are \"pat\" and \"hash\".")));
+#endif
+		}
+		else if (pg_strcasecmp(name, "rowkey") == 0)
+		{
+			if (pg_strcasecmp(value, "hash") == 0)
+				options->rowkey = GrnRowKeyHash;
+			else if (pg_strcasecmp(value, "pat") == 0)
+				options->rowkey = GrnRowKeyPat;
+			else
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("groonga: invalid value for rowkey: \"%s\"", value),
+					 errhint("Valid values are \"hash\" and \"pat\".")));
+		}
+		else if (pg_strcasecmp(name, "store") == 0)
+		{
+			options->store = GrnParseBool(name, value);
+#if PG_VERSION_NUM < 80400
+			/* recheck is fixed in operator classes */
+			if (!options->store && validate)
+				ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("groonga: store=off requires PostgreSQL 8.4 or later")));
+#endif
+		}
+		else if (pg_strcasecmp(name, "compress") == 0)
+		{
+			if (pg_strcasecmp(value, "none") == 0)
+				options->compress = GrnCompressNone;
+			else if (pg_strcasecmp(value, "zlib") == 0)
+				options->compress = GrnCompressZlib;
+			else if (pg_strcasecmp(value, "lzo") == 0)
+				options->compress = GrnCompressLzo;
+			else if (pg_strcasecmp(value, "lz4") == 0)
+				options->compress = GrnCompressLz4;
+			else if (pg_strcasecmp(value, "zstd") == 0)
+				options->compress = GrnCompressZstd;
+			else
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("groonga: invalid value for compress: \"%s\"", value),
+					 errhint("Valid values are \"none\", \"zlib\", \"lzo\", \"lz4\" and \"zstd\".")));
+
+			if (validate && options->compress != GrnCompressNone &&
+				GrnCompressFlags(options->compress) == 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("groonga: compress=%s is not supported by this version of groonga", value)));
+		}
+		else if (pg_strcasecmp(name, "wal") == 0)
+		{
+			options->wal = GrnParseBool(name, value);
+#if PG_VERSION_NUM < 90000
+			/* no standbys accept queries */
+			if (options->wal && validate)
+				ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("groonga: wal=on requires PostgreSQL 9.0 or later")));
+#endif
+		}
+		else if (validate)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("groonga: unrecognized option \"%s\"", name)));
+
+		pfree(name);
+	}
+
+	pfree(elems);
+
+	return options;
+}
+
+/*
+ * GrnGetOptions -- options of the index, or defaults.
+ */
+static const GrnOptions *
+GrnGetOptions(Relation index)
+{
+	static GrnOptions  *defaults = NULL;
+
+	if (index->rd_options != NULL)
+		return (const GrnOptions *) index->rd_options;
+
+	if (defaults == NULL)
+	{
+		MemoryContext	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		defaults = GrnParseOptions((Datum) 0, false);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	return defaults;
+}
+
+/*
+ * GrnCompressFlags -- column flags for the compression, or 0 if groonga
+ * doesn't support it.
+ */
+static grn_obj_flags
+GrnCompressFlags(GrnCompressType compress)
+{
+	switch (compress)
+	{
+#ifdef GRN_OBJ_COMPRESS_ZLIB
+	case GrnCompressZlib:
+		return GRN_OBJ_COMPRESS_ZLIB;
+#endif
+#ifdef GRN_OBJ_COMPRESS_LZO
+	case GrnCompressLzo:
+		return GRN_OBJ_COMPRESS_LZO;
+#endif
+#ifdef GRN_OBJ_COMPRESS_LZ4
+	case GrnCompressLz4:
+		return GRN_OBJ_COMPRESS_LZ4;
+#endif
+#ifdef GRN_OBJ_COMPRESS_ZSTD
+	case GrnCompressZstd:
+		return GRN_OBJ_COMPRESS_ZSTD;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/*
+ * GrnIsTextColumn -- true if the column is full-text indexed.
+ *
+ * GrnContainStrategyNumber (%% 演算子) を扱う列に対して転置表を作成する。
+ * get_opfamily_member() に渡す型は、型列の型ではなく opclass の opcintype
+ * であることに注意。特に varchar は、内部的には text として処理されている。
+ */
+static bool
+GrnIsTextColumn(Relation index, int attnum)
+{
+	Oid		opfamily = index->rd_opfamily[attnum - 1];
+	Oid		typid = index->rd_opcintype[attnum - 1];
+
+	return get_opfamily_member(opfamily, typid, typid,
+							   GrnContainStrategyNumber) != InvalidOid;
+}
+
+/*
+ * GrnIsVectorColumn -- true if the column is an array stored in a vector.
+ */
+static bool
+GrnIsVectorColumn(Relation index, int attnum)
+{
+	TupleDesc	tupdesc = RelationGetDescr(index);
+
+	return type_is_array(tupdesc->attrs[attnum - 1]->atttypid);
+}
+
+static bool
+GrnParseBool(const char *name, const char *value)
+{
+	if (pg_strcasecmp(value, "on") == 0 ||
+		pg_strcasecmp(value, "true") == 0 ||
+		pg_strcasecmp(value, "yes") == 0 ||
+		strcmp(value, "1") == 0)
+		return true;
+	if (pg_strcasecmp(value, "off") == 0 ||
+		pg_strcasecmp(value, "false") == 0 ||
+		pg_strcasecmp(value, "no") == 0 ||
+		strcmp(value, "0") == 0)
+		return false;
+
+	ereport(ERROR,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		 errmsg("groonga: invalid value for %s: \"%s\"", name, value),
+		 errhint("Valid values are \"on\" and \"off\".")));
+	return false;	/* keep compiler quiet */
+}
+
 static void
-GrnLock(Relation index, LOCKMODE mode)
+GrnCheckSelectPrivilege(Relation index)
 {
-	const RelFileNode *rnode = &index->rd_node;
-	LockDatabaseObject(rnode->spcNode,
-					   rnode->dbNode,
-					   rnode->relNode,
-					   mode);
+	Oid				relid = index->rd_index->indrelid;
+	AclResult		aclresult;
+
+	aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_CLASS, get_rel_name(relid));
+}
+
+/*
+ * GrnCheckQuerySupported -- groonga queries are evaluated only by groonga,
+ * where stale postings of store=off indexes might match rows inserted later.
+ */
+static void
+GrnCheckQuerySupported(Relation index)
+{
+	if (!GrnGetOptions(index)->store)
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("groonga: @@ operator is not supported for index \"%s\" with store=off",
+				RelationGetRelationName(index)),
+			 errhint("Use %%%% operator instead.")));
+}
+
+static void
+GrnLock(Relation index, LOCKMODE mode, LOCKTAG *tag)
+{
+	instr_time	start;
+	instr_time	duration;
+
+	/* try without waiting at first */
+	GrnLockTag(index, tag);
+	if (LockAcquire(tag, mode, false, true) != LOCKACQUIRE_NOT_AVAIL)
+		return;
+
+	INSTR_TIME_SET_CURRENT(start);
+	(void) LockAcquire(tag, mode, false, false);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	GrnStatLockWait(index, INSTR_TIME_GET_MILLISEC(duration));
+}
+
+/*
+ * GrnUnlock -- release the lock with the tag filled by GrnLock. The tag is
+ * not computed again, because the backend might have been promoted since.
+ */
+static void
+GrnUnlock(const LOCKTAG *tag, LOCKMODE mode)
+{
+	LockRelease(tag, mode, false);
 }
 
+/*
+ * GrnLockTag -- same tag as LockDatabaseObject. Hot standbys use an advisory
+ * lock tag instead, because object locks stronger than RowExclusiveLock are
+ * not allowed during recovery. The 4th field is not used by SQL functions.
+ */
 static void
-GrnUnlock(Relation index, LOCKMODE mode)
+GrnLockTag(Relation index, LOCKTAG *tag)
 {
 	const RelFileNode *rnode = &index->rd_node;
-	UnlockDatabaseObject(rnode->spcNode,
-						 rnode->dbNode,
-						 rnode->relNode,
-						 mode);
+
+#if PG_VERSION_NUM >= 90000
+	if (RecoveryInProgress())
+	{
+		SET_LOCKTAG_ADVISORY(*tag,
+							 MyDatabaseId,
+							 rnode->spcNode,
+							 rnode->relNode,
+							 3);
+		return;
+	}
+#endif
+
+	SET_LOCKTAG_OBJECT(*tag,
+					   MyDatabaseId,
+					   rnode->spcNode,
+					   rnode->dbNode,
+					   rnode->relNode);
 }
 
 static grn_encoding
@@ -1319,6 +5521,20 @@ appendTextEscaped(StringInfo buf, const text *t)
 	appendStringEscaped(buf, VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t));
 }
 
+/*
+ * appendGeoPoint -- append "{latitude}x{longitude}" in milliseconds, where
+ * x is longitude and y is latitude in degrees. Out of range values are
+ * clamped; they cannot be stored in the index anyway.
+ */
+static void
+appendGeoPoint(StringInfo buf, double x, double y)
+{
+	x = Max(-180.0, Min(x, 180.0));
+	y = Max(-90.0, Min(y, 90.0));
+	appendStringInfo(buf, "%dx%d",
+		GrnDegreeToMsec(y), GrnDegreeToMsec(x));
+}
+
 static int64
 CtidToInt64(ItemPointer ctid)
 {
@@ -1365,6 +5581,10 @@ GrnXactCallback(XactEvent event, void *arg)
 	 * TODO: Test nested cursors and subtransactions.
 	 */
 	grnScanDescs = NULL;
+
+	GrnSnipCloseAll();
+	GrnMemoryReset();
+	GrnWalReset();
 }
 
 static void
@@ -1418,6 +5638,41 @@ GrnGetValue(Relation index, int attnum, Datum value, int *len)
 	return DatumGetCString(FunctionCall2(fn, value, PointerGetDatum(len)));
 }
 
+/*
+ * GrnMaterialize -- prepare a tuplestore for set-returning functions.
+ */
+Tuplestorestate *
+GrnMaterialize(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo	   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate	   *tupstore;
+	MemoryContext		oldcontext;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	*tupdesc = CreateTupleDescCopy(*tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
 int
 bpchar_size(const BpChar *arg)
 {
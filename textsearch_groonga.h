@@ -6,6 +6,10 @@
 #define TEXTSEARCH_GROONGA_H
 
 #include "fmgr.h"
+#include "access/tupdesc.h"
+#include "storage/itemptr.h"
+#include "utils/relcache.h"
+#include "utils/tuplestore.h"
 
 #ifndef PGDLLEXPORT
 #define PGDLLEXPORT
@@ -20,6 +24,16 @@
 #define GrnNotEqualStrategyNumber		6	/* operator <> (! in groonga) */
 #define GrnContainStrategyNumber		7	/* operator %% (@ in groonga) */
 #define GrnQueryStrategyNumber			8	/* match with query */
+#define GrnLikeStrategyNumber			9	/* operator ~~ (LIKE) */
+#define GrnILikeStrategyNumber			10	/* operator ~~* (ILIKE) */
+#define GrnRegexStrategyNumber			11	/* operator ~ */
+#define GrnIRegexStrategyNumber			12	/* operator ~* */
+#define GrnPrefixStrategyNumber			13	/* operator &^ (^ in groonga) */
+#define GrnSimilarStrategyNumber		14	/* operator <~> (ORDER BY) */
+#define GrnInBoxStrategyNumber			15	/* operator <@ (point, box) */
+#define GrnInCircleStrategyNumber		16	/* operator <@ (point, circle) */
+#define GrnOverlapStrategyNumber		17	/* operator && (anyarray, anyarray) */
+#define GrnContainsAllStrategyNumber	18	/* operator @> (anyarray, anyarray) */
 
 /* groonga support functions */
 #define GrnTypeOfProc					1
@@ -30,6 +44,31 @@
 #define GrnDatabaseName					"grn"
 #define GrnTableNameFormat				"t%u"
 #define GrnIndexNameFormat				"i%u"
+#define GrnGeoIndexNameFormat			"g%u"
+#define GrnVectorIndexNameFormat		"v%u_%d"	/* relnode, attnum */
+#define GrnIndexColumnName				"ref"
+
+/* geo points are stored in milliseconds of latitude and longitude */
+#define GrnDegreeToMsec(deg)			((int) rint((deg) * 3600 * 1000))
+
+/* operations in the change log */
+#define GrnWalInsert					1
+#define GrnWalDelete					2
+
+typedef struct GrnWalRecord
+{
+	ItemPointerData	ctid;
+	uint16			op;			/* GrnWalInsert or GrnWalDelete */
+} GrnWalRecord;
+
+typedef struct GrnWalPosition
+{
+	uint32			generation;	/* 0 if the log has never been applied */
+	int64			nrecords;	/* number of records in the generation */
+} GrnWalPosition;
+
+/* number of buckets in scan time histograms */
+#define GrnStatHistBuckets				6
 
 /* in textsearch_groonga.c */
 extern void PGDLLEXPORT _PG_init(void);
@@ -37,8 +76,22 @@ extern Datum PGDLLEXPORT groonga_query_in(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_query(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_purge(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_command(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_command_stream(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_optimize(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_prewarm(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_wal_replay(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_explain(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_count(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_drilldown(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_complete(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_snippet(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_highlight(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_contains(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_contains_bpchar(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_prefix(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_prefix_bpchar(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_distance(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_distance_bpchar(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_match(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_score(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_insert(PG_FUNCTION_ARGS);
@@ -54,6 +107,46 @@ extern Datum PGDLLEXPORT groonga_costestimate(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_options(PG_FUNCTION_ARGS);
 
 extern int bpchar_size(const BpChar *arg);
+extern Tuplestorestate *GrnMaterialize(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+
+/* in groonga_cache.c */
+extern void GrnCacheInit(void);
+extern bool GrnCacheLookup(Relation index, const char *command, ItemPointer *ctids, int32 **scores, int64 *num);
+extern uint64 GrnCacheBegin(Relation index);
+extern void GrnCacheStore(Relation index, const char *command, uint64 version, const ItemPointerData ctids[], const int32 scores[], int64 num);
+extern void GrnCacheInvalidate(Relation index);
+extern Datum PGDLLEXPORT groonga_cache_stat(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_cache_reset(PG_FUNCTION_ARGS);
+
+/* in groonga_memory.c */
+extern void GrnMemoryInit(void);
+extern bool GrnMemoryAvailable(int64 size);
+extern void GrnMemoryReserve(int64 size);
+extern void GrnMemoryRelease(int64 size);
+extern void GrnMemoryExceeded(void);
+extern void GrnMemoryReset(void);
+extern Datum PGDLLEXPORT groonga_memory_usage(PG_FUNCTION_ARGS);
+
+/* in groonga_stat.c */
+extern void GrnStatInit(void);
+extern void GrnStatScan(Relation index, int64 nhits, int64 nbytes, double command_time, double total_time);
+extern void GrnStatInsert(Relation index);
+extern void GrnStatDelete(Relation index, int64 ndeleted);
+extern void GrnStatLockWait(Relation index, double lock_time);
+extern Datum PGDLLEXPORT groonga_stat_indexes(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_stat_reset(PG_FUNCTION_ARGS);
+
+/* in groonga_wal.c */
+extern void GrnWalInit(void);
+extern void GrnWalAppend(Relation index, uint16 op, ItemPointer ctid);
+extern void GrnWalFlush(Relation index);
+extern void GrnWalFlushAll(void);
+extern void GrnWalReset(void);
+extern void GrnWalRestart(Relation index);
+extern bool GrnWalLatest(Relation index, GrnWalPosition *pos);
+extern int GrnWalRead(Relation index, GrnWalPosition *pos, GrnWalRecord *records, int max);
+extern bool GrnWalReadPosition(Relation index, GrnWalPosition *pos);
+extern void GrnWalWritePosition(Relation index, const GrnWalPosition *pos);
 
 /* in groonga_types.c */
 extern Datum PGDLLEXPORT groonga_typeof(PG_FUNCTION_ARGS);
@@ -67,6 +160,7 @@ extern Datum PGDLLEXPORT groonga_get_float4(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_get_float8(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_get_timestamp(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_get_timestamptz(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_get_point(PG_FUNCTION_ARGS);
 
 extern Datum PGDLLEXPORT groonga_set_text(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_set_bpchar(PG_FUNCTION_ARGS);
@@ -78,5 +172,7 @@ extern Datum PGDLLEXPORT groonga_set_float4(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_set_float8(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_set_timestamp(PG_FUNCTION_ARGS);
 extern Datum PGDLLEXPORT groonga_set_timestamptz(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_set_point(PG_FUNCTION_ARGS);
+extern Datum PGDLLEXPORT groonga_set_array(PG_FUNCTION_ARGS);
 
 #endif	/* TEXTSEARCH_GROONGA_H */
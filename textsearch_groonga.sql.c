@@ -89,6 +89,263 @@ CREATE FUNCTION groonga.command(query text)
 	AS 'MODULE_PATHNAME','groonga_command'
 	LANGUAGE C VOLATILE STRICT;
 
+CREATE FUNCTION groonga.command_stream(
+	IN query	text,
+	OUT seq		integer,
+	OUT chunk	text)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME','groonga_command_stream'
+	LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION groonga.optimize(index regclass)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME','groonga_optimize'
+	LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION groonga.prewarm(index regclass)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME','groonga_prewarm'
+	LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION groonga.wal_replay(index regclass)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME','groonga_wal_replay'
+	LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION groonga.explain(
+	IN  index			regclass,
+	IN  query			groonga.query,
+	OUT phase			text,
+	OUT duration		double precision,
+	OUT detail			text
+)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME','groonga_explain'
+	LANGUAGE C VOLATILE STRICT;
+
+#if PG_VERSION_NUM >= 80400
+CREATE FUNCTION groonga.count(
+		index			regclass,
+		query			groonga.query,
+		exact			boolean DEFAULT true
+	)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME','groonga_count'
+	LANGUAGE C VOLATILE STRICT;
+#else
+CREATE FUNCTION groonga.count(
+		index			regclass,
+		query			groonga.query,
+		exact			boolean
+	)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME','groonga_count'
+	LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION groonga.count(
+		index			regclass,
+		query			groonga.query
+	)
+	RETURNS bigint
+	AS 'MODULE_PATHNAME','groonga_count'
+	LANGUAGE C VOLATILE STRICT;
+#endif
+
+#if PG_VERSION_NUM >= 80400
+CREATE FUNCTION groonga.drilldown(
+	IN  index			regclass,
+	IN  query			groonga.query,
+	IN  column_name		text,
+	IN  max_groups		integer DEFAULT 10,
+	OUT value			text,
+	OUT count			bigint
+)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME','groonga_drilldown'
+	LANGUAGE C VOLATILE STRICT;
+#else
+CREATE FUNCTION groonga.drilldown(
+	IN  index			regclass,
+	IN  query			groonga.query,
+	IN  column_name		text,
+	IN  max_groups		integer,
+	OUT value			text,
+	OUT count			bigint
+)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME','groonga_drilldown'
+	LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION groonga.drilldown(
+	IN  index			regclass,
+	IN  query			groonga.query,
+	IN  column_name		text,
+	OUT value			text,
+	OUT count			bigint
+)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME','groonga_drilldown'
+	LANGUAGE C VOLATILE STRICT;
+#endif
+
+#if PG_VERSION_NUM >= 80400
+CREATE FUNCTION groonga.complete(
+	IN  index			regclass,
+	IN  prefix			text,
+	IN  max_results		integer DEFAULT 10,
+	OUT term			text,
+	OUT docs			bigint
+)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME','groonga_complete'
+	LANGUAGE C STABLE STRICT;
+#else
+CREATE FUNCTION groonga.complete(
+	IN  index			regclass,
+	IN  prefix			text,
+	IN  max_results		integer,
+	OUT term			text,
+	OUT docs			bigint
+)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME','groonga_complete'
+	LANGUAGE C STABLE STRICT;
+CREATE FUNCTION groonga.complete(
+	IN  index			regclass,
+	IN  prefix			text,
+	OUT term			text,
+	OUT docs			bigint
+)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME','groonga_complete'
+	LANGUAGE C STABLE STRICT;
+#endif
+
+#if PG_VERSION_NUM >= 80400
+CREATE FUNCTION groonga.snippet(
+		doc				text,
+		keywords		text,
+		width			integer DEFAULT 200,
+		max_results		integer DEFAULT 3,
+		open_tag		text DEFAULT '<b>',
+		close_tag		text DEFAULT '</b>',
+		index			regclass DEFAULT NULL
+	)
+	RETURNS text[]
+	AS 'MODULE_PATHNAME','groonga_snippet'
+	LANGUAGE C STABLE;
+
+CREATE FUNCTION groonga.highlight(
+		doc				text,
+		keywords		text,
+		open_tag		text DEFAULT '<b>',
+		close_tag		text DEFAULT '</b>',
+		index			regclass DEFAULT NULL
+	)
+	RETURNS text
+	AS 'MODULE_PATHNAME','groonga_highlight'
+	LANGUAGE C STABLE;
+#else
+CREATE FUNCTION groonga.snippet(
+		doc				text,
+		keywords		text,
+		width			integer,
+		max_results		integer,
+		open_tag		text,
+		close_tag		text,
+		index			regclass
+	)
+	RETURNS text[]
+	AS 'MODULE_PATHNAME','groonga_snippet'
+	LANGUAGE C STABLE;
+CREATE FUNCTION groonga.snippet(
+		doc				text,
+		keywords		text
+	)
+	RETURNS text[]
+	AS 'MODULE_PATHNAME','groonga_snippet'
+	LANGUAGE C STABLE;
+CREATE FUNCTION groonga.highlight(
+		doc				text,
+		keywords		text,
+		open_tag		text,
+		close_tag		text,
+		index			regclass
+	)
+	RETURNS text
+	AS 'MODULE_PATHNAME','groonga_highlight'
+	LANGUAGE C STABLE;
+CREATE FUNCTION groonga.highlight(
+		doc				text,
+		keywords		text
+	)
+	RETURNS text
+	AS 'MODULE_PATHNAME','groonga_highlight'
+	LANGUAGE C STABLE;
+#endif
+
+CREATE FUNCTION groonga.stat_indexes(
+	OUT spcnode			oid,
+	OUT dbnode			oid,
+	OUT relnode			oid,
+	OUT scans			bigint,
+	OUT hits			bigint,
+	OUT inserts			bigint,
+	OUT deletes			bigint,
+	OUT lock_waits		bigint,
+	OUT lock_time		double precision,
+	OUT command_time	double precision,
+	OUT bytes_parsed	bigint,
+	OUT scan_time_hist	bigint[]
+)
+	RETURNS SETOF record
+	AS 'MODULE_PATHNAME','groonga_stat_indexes'
+	LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION groonga.stat_reset()
+	RETURNS void
+	AS 'MODULE_PATHNAME','groonga_stat_reset'
+	LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION groonga.stat_reset() FROM PUBLIC;
+
+CREATE FUNCTION groonga.cache_stat(
+	OUT hits			bigint,
+	OUT misses			bigint,
+	OUT stores			bigint,
+	OUT evictions		bigint,
+	OUT entries			bigint,
+	OUT max_entries		bigint
+)
+	RETURNS record
+	AS 'MODULE_PATHNAME','groonga_cache_stat'
+	LANGUAGE C VOLATILE STRICT;
+
+CREATE FUNCTION groonga.cache_reset()
+	RETURNS void
+	AS 'MODULE_PATHNAME','groonga_cache_reset'
+	LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION groonga.cache_reset() FROM PUBLIC;
+
+CREATE FUNCTION groonga.memory_usage(
+	OUT results			bigint,
+	OUT peak_results	bigint,
+	OUT heap			bigint,
+	OUT mapped			bigint
+)
+	RETURNS record
+	AS 'MODULE_PATHNAME','groonga_memory_usage'
+	LANGUAGE C VOLATILE STRICT;
+
+CREATE VIEW groonga.stat_indexes AS
+	SELECT i.indrelid AS relid, i.indexrelid, c.relname AS indexrelname, s.scans, s.hits, s.inserts, s.deletes,
+		   s.lock_waits, s.lock_time, s.command_time, s.bytes_parsed,
+		   s.scan_time_hist
+	  FROM groonga.stat_indexes() s
+	  JOIN pg_database d ON d.oid = s.dbnode
+	  JOIN pg_class c ON c.relfilenode = s.relnode
+	  JOIN pg_index i ON i.indexrelid = c.oid
+	 WHERE d.datname = current_database();
+
 CREATE FUNCTION groonga.contains(text, text)
 	RETURNS bool
 	AS 'MODULE_PATHNAME','groonga_contains'
@@ -99,6 +356,26 @@ CREATE FUNCTION groonga.contains(bpchar, bpchar)
 	AS 'MODULE_PATHNAME','groonga_contains_bpchar'
 	LANGUAGE C IMMUTABLE STRICT;
 
+CREATE FUNCTION groonga.prefix(text, text)
+	RETURNS bool
+	AS 'MODULE_PATHNAME','groonga_prefix'
+	LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION groonga.prefix(bpchar, bpchar)
+	RETURNS bool
+	AS 'MODULE_PATHNAME','groonga_prefix_bpchar'
+	LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION groonga.distance(text, text)
+	RETURNS float8
+	AS 'MODULE_PATHNAME','groonga_distance'
+	LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION groonga.distance(bpchar, bpchar)
+	RETURNS float8
+	AS 'MODULE_PATHNAME','groonga_distance_bpchar'
+	LANGUAGE C IMMUTABLE STRICT;
+
 CREATE FUNCTION groonga.match(anyelement, groonga.query)
 	RETURNS bool
 	AS 'MODULE_PATHNAME','groonga_match'
@@ -116,6 +393,32 @@ CREATE OPERATOR %% (
 	RIGHTARG = bpchar
 );
 
+CREATE OPERATOR &^ (
+	PROCEDURE = groonga.prefix,
+	LEFTARG = text,
+	RIGHTARG = text
+);
+
+CREATE OPERATOR &^ (
+	PROCEDURE = groonga.prefix,
+	LEFTARG = bpchar,
+	RIGHTARG = bpchar
+);
+
+CREATE OPERATOR <~> (
+	PROCEDURE = groonga.distance,
+	LEFTARG = text,
+	RIGHTARG = text,
+	COMMUTATOR = <~>
+);
+
+CREATE OPERATOR <~> (
+	PROCEDURE = groonga.distance,
+	LEFTARG = bpchar,
+	RIGHTARG = bpchar,
+	COMMUTATOR = <~>
+);
+
 CREATE OPERATOR @@ (
 	PROCEDURE = groonga.match,
 	LEFTARG = anyelement,
@@ -150,6 +453,7 @@ CREATE FUNCTION groonga.get_float4(float4, internal) RETURNS internal AS 'MODULE
 CREATE FUNCTION groonga.get_float8(float8, internal) RETURNS internal AS 'MODULE_PATHNAME','groonga_get_float8' LANGUAGE C;
 CREATE FUNCTION groonga.get_timestamp(timestamp, internal) RETURNS internal AS 'MODULE_PATHNAME','groonga_get_timestamp' LANGUAGE C;
 CREATE FUNCTION groonga.get_timestamptz(timestamptz, internal) RETURNS internal AS 'MODULE_PATHNAME','groonga_get_timestamptz' LANGUAGE C;
+CREATE FUNCTION groonga.get_point(point, internal) RETURNS internal AS 'MODULE_PATHNAME','groonga_get_point' LANGUAGE C;
 CREATE FUNCTION groonga.set_text(internal, internal, text) RETURNS void AS 'MODULE_PATHNAME','groonga_set_text' LANGUAGE C;
 CREATE FUNCTION groonga.set_bpchar(internal, internal, bpchar) RETURNS void AS 'MODULE_PATHNAME','groonga_set_bpchar' LANGUAGE C;
 CREATE FUNCTION groonga.set_bool(internal, internal, bool) RETURNS void AS 'MODULE_PATHNAME','groonga_set_bool' LANGUAGE C;
@@ -160,14 +464,16 @@ CREATE FUNCTION groonga.set_float4(internal, internal, float4) RETURNS void AS '
 CREATE FUNCTION groonga.set_float8(internal, internal, float8) RETURNS void AS 'MODULE_PATHNAME','groonga_set_float8' LANGUAGE C;
 CREATE FUNCTION groonga.set_timestamp(internal, internal, timestamp) RETURNS void AS 'MODULE_PATHNAME','groonga_set_timestamp' LANGUAGE C;
 CREATE FUNCTION groonga.set_timestamptz(internal, internal, timestamptz) RETURNS void AS 'MODULE_PATHNAME','groonga_set_timestamptz' LANGUAGE C;
+CREATE FUNCTION groonga.set_point(internal, internal, point) RETURNS void AS 'MODULE_PATHNAME','groonga_set_point' LANGUAGE C;
+CREATE FUNCTION groonga.set_array(internal, internal, anyarray) RETURNS void AS 'MODULE_PATHNAME','groonga_set_array' LANGUAGE C;
 
 INSERT INTO pg_catalog.pg_am VALUES(
 	'groonga',	-- amname
-	8,			-- amstrategies
+	18,			-- amstrategies
 	3,			-- amsupport
 	false,		-- amcanorder
 #if PG_VERSION_NUM >= 90100
-	false,		-- amcanorderbyop
+	true,		-- amcanorderbyop
 #endif
 #if PG_VERSION_NUM >= 80400
 	false,		-- amcanbackward
@@ -207,6 +513,14 @@ CREATE OPERATOR CLASS groonga.text_ops DEFAULT FOR TYPE text
 		OPERATOR 6 <>,
 		OPERATOR 7 %%,
 		OPERATOR 8 @@ (anyelement, groonga.query),
+#if PG_VERSION_NUM >= 80400
+		OPERATOR 13 &^,
+#else
+		OPERATOR 13 &^ RECHECK,
+#endif
+#if PG_VERSION_NUM >= 90100
+		OPERATOR 14 <~> FOR ORDER BY pg_catalog.float_ops,
+#endif
 		FUNCTION 1 groonga.typeof(oid, integer),
 		FUNCTION 2 groonga.get_text(text, internal),
 		FUNCTION 3 groonga.set_text(internal, internal, text)
@@ -222,6 +536,81 @@ CREATE OPERATOR CLASS groonga.bpchar_ops DEFAULT FOR TYPE bpchar
 		OPERATOR 6 <>,
 		OPERATOR 7 %%,
 		OPERATOR 8 @@ (anyelement, groonga.query),
+#if PG_VERSION_NUM >= 80400
+		OPERATOR 13 &^,
+#else
+		OPERATOR 13 &^ RECHECK,
+#endif
+#if PG_VERSION_NUM >= 90100
+		OPERATOR 14 <~> FOR ORDER BY pg_catalog.float_ops,
+#endif
+		FUNCTION 1 groonga.typeof(oid, integer),
+		FUNCTION 2 groonga.get_bpchar(bpchar, internal),
+		FUNCTION 3 groonga.set_bpchar(internal, internal, bpchar)
+;
+
+/*
+ * Opclasses for LIKE, ILIKE and regular expressions. They are not default
+ * because patterns are narrowed by the index only with tokenizers that split
+ * every character, such as TokenBigramSplitSymbolAlphaDigit.
+ */
+CREATE OPERATOR CLASS groonga.text_like_ops FOR TYPE text
+	USING groonga AS
+		OPERATOR 1 <,
+		OPERATOR 2 <=,
+		OPERATOR 3 =,
+		OPERATOR 4 >=,
+		OPERATOR 5 >,
+		OPERATOR 6 <>,
+		OPERATOR 7 %%,
+		OPERATOR 8 @@ (anyelement, groonga.query),
+#if PG_VERSION_NUM >= 80400
+		OPERATOR 9 ~~ (text, text),
+		OPERATOR 10 ~~* (text, text),
+		OPERATOR 11 ~ (text, text),
+		OPERATOR 12 ~* (text, text),
+		OPERATOR 13 &^,
+#else
+		OPERATOR 9 ~~ (text, text) RECHECK,
+		OPERATOR 10 ~~* (text, text) RECHECK,
+		OPERATOR 11 ~ (text, text) RECHECK,
+		OPERATOR 12 ~* (text, text) RECHECK,
+		OPERATOR 13 &^ RECHECK,
+#endif
+#if PG_VERSION_NUM >= 90100
+		OPERATOR 14 <~> FOR ORDER BY pg_catalog.float_ops,
+#endif
+		FUNCTION 1 groonga.typeof(oid, integer),
+		FUNCTION 2 groonga.get_text(text, internal),
+		FUNCTION 3 groonga.set_text(internal, internal, text)
+;
+
+CREATE OPERATOR CLASS groonga.bpchar_like_ops FOR TYPE bpchar
+	USING groonga AS
+		OPERATOR 1 <,
+		OPERATOR 2 <=,
+		OPERATOR 3 =,
+		OPERATOR 4 >=,
+		OPERATOR 5 >,
+		OPERATOR 6 <>,
+		OPERATOR 7 %%,
+		OPERATOR 8 @@ (anyelement, groonga.query),
+#if PG_VERSION_NUM >= 80400
+		OPERATOR 9 ~~ (bpchar, text),
+		OPERATOR 10 ~~* (bpchar, text),
+		OPERATOR 11 ~ (bpchar, text),
+		OPERATOR 12 ~* (bpchar, text),
+		OPERATOR 13 &^,
+#else
+		OPERATOR 9 ~~ (bpchar, text) RECHECK,
+		OPERATOR 10 ~~* (bpchar, text) RECHECK,
+		OPERATOR 11 ~ (bpchar, text) RECHECK,
+		OPERATOR 12 ~* (bpchar, text) RECHECK,
+		OPERATOR 13 &^ RECHECK,
+#endif
+#if PG_VERSION_NUM >= 90100
+		OPERATOR 14 <~> FOR ORDER BY pg_catalog.float_ops,
+#endif
 		FUNCTION 1 groonga.typeof(oid, integer),
 		FUNCTION 2 groonga.get_bpchar(bpchar, internal),
 		FUNCTION 3 groonga.set_bpchar(internal, internal, bpchar)
@@ -338,3 +727,88 @@ CREATE OPERATOR CLASS groonga.timestamptz_ops DEFAULT FOR TYPE timestamptz
 		FUNCTION 2 groonga.get_timestamptz(timestamptz, internal),
 		FUNCTION 3 groonga.set_timestamptz(internal, internal, timestamptz)
 ;
+
+CREATE OPERATOR CLASS groonga.point_ops DEFAULT FOR TYPE point
+	USING groonga AS
+		OPERATOR 8 @@ (anyelement, groonga.query),
+#if PG_VERSION_NUM >= 80400
+		OPERATOR 15 <@ (point, box),
+		OPERATOR 16 <@ (point, circle),
+#else
+		OPERATOR 15 <@ (point, box) RECHECK,
+		OPERATOR 16 <@ (point, circle) RECHECK,
+#endif
+		FUNCTION 1 groonga.typeof(oid, integer),
+		FUNCTION 2 groonga.get_point(point, internal),
+		FUNCTION 3 groonga.set_point(internal, internal, point)
+;
+
+CREATE OPERATOR CLASS groonga._text_ops DEFAULT FOR TYPE text[]
+	USING groonga AS
+		OPERATOR 8 @@ (anyelement, groonga.query),
+#if PG_VERSION_NUM >= 80400
+		OPERATOR 17 && (anyarray, anyarray),
+		OPERATOR 18 @> (anyarray, anyarray),
+#else
+		OPERATOR 17 && (anyarray, anyarray) RECHECK,
+		OPERATOR 18 @> (anyarray, anyarray) RECHECK,
+#endif
+		FUNCTION 1 groonga.typeof(oid, integer),
+		FUNCTION 3 groonga.set_array(internal, internal, anyarray)
+;
+
+CREATE OPERATOR CLASS groonga._varchar_ops DEFAULT FOR TYPE varchar[]
+	USING groonga AS
+		OPERATOR 8 @@ (anyelement, groonga.query),
+#if PG_VERSION_NUM >= 80400
+		OPERATOR 17 && (anyarray, anyarray),
+		OPERATOR 18 @> (anyarray, anyarray),
+#else
+		OPERATOR 17 && (anyarray, anyarray) RECHECK,
+		OPERATOR 18 @> (anyarray, anyarray) RECHECK,
+#endif
+		FUNCTION 1 groonga.typeof(oid, integer),
+		FUNCTION 3 groonga.set_array(internal, internal, anyarray)
+;
+
+CREATE OPERATOR CLASS groonga._int2_ops DEFAULT FOR TYPE int2[]
+	USING groonga AS
+		OPERATOR 8 @@ (anyelement, groonga.query),
+#if PG_VERSION_NUM >= 80400
+		OPERATOR 17 && (anyarray, anyarray),
+		OPERATOR 18 @> (anyarray, anyarray),
+#else
+		OPERATOR 17 && (anyarray, anyarray) RECHECK,
+		OPERATOR 18 @> (anyarray, anyarray) RECHECK,
+#endif
+		FUNCTION 1 groonga.typeof(oid, integer),
+		FUNCTION 3 groonga.set_array(internal, internal, anyarray)
+;
+
+CREATE OPERATOR CLASS groonga._int4_ops DEFAULT FOR TYPE int4[]
+	USING groonga AS
+		OPERATOR 8 @@ (anyelement, groonga.query),
+#if PG_VERSION_NUM >= 80400
+		OPERATOR 17 && (anyarray, anyarray),
+		OPERATOR 18 @> (anyarray, anyarray),
+#else
+		OPERATOR 17 && (anyarray, anyarray) RECHECK,
+		OPERATOR 18 @> (anyarray, anyarray) RECHECK,
+#endif
+		FUNCTION 1 groonga.typeof(oid, integer),
+		FUNCTION 3 groonga.set_array(internal, internal, anyarray)
+;
+
+CREATE OPERATOR CLASS groonga._int8_ops DEFAULT FOR TYPE int8[]
+	USING groonga AS
+		OPERATOR 8 @@ (anyelement, groonga.query),
+#if PG_VERSION_NUM >= 80400
+		OPERATOR 17 && (anyarray, anyarray),
+		OPERATOR 18 @> (anyarray, anyarray),
+#else
+		OPERATOR 17 && (anyarray, anyarray) RECHECK,
+		OPERATOR 18 @> (anyarray, anyarray) RECHECK,
+#endif
+		FUNCTION 1 groonga.typeof(oid, integer),
+		FUNCTION 3 groonga.set_array(internal, internal, anyarray)
+;